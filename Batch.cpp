@@ -0,0 +1,112 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <stack>
+#include <deque>
+#include <chrono>
+#include <cstdio>
+#include <cctype>
+
+#include "Batch.h"
+#include "Scene.h"
+#include "Raytracer.h"
+#include "GeometryCache.h"
+
+using namespace std;
+#include "readfile.h"
+
+// Whether a file name pattern holds exactly one %d, with an optional width
+// such as %04d, and otherwise only %% escapes: it is used as a format string
+static bool isFramePattern(const string& pattern) {
+  int conversions = 0;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    if (pattern[i] != '%') continue;
+    if (i+1 < pattern.size() and pattern[i+1] == '%') {
+      i++;
+      continue;
+    }
+    size_t j = i+1;
+    while (j < pattern.size() and isdigit((unsigned char) pattern[j])) j++;
+    if (j == pattern.size() or pattern[j] != 'd') return false;
+    conversions++;
+    i = j;
+  }
+  return conversions == 1;
+}
+
+// Expand the manifest into the list of scene files to render
+static vector<string> readManifest(const string& manifest) {
+  vector<string> scenes;
+  ifstream in(manifest);
+  if (!in.is_open()) {
+    cerr << "Unable to Open Batch Manifest " << manifest << "\n";
+    return scenes;
+  }
+  string str;
+  int lineNumber = 0;
+  while (getline(in, str)) {
+    lineNumber++;
+    if (str.find_first_not_of(" \t\r\n") == string::npos or str[0] == '#') continue;
+    stringstream s(str);
+    string path;
+    int first, last, step = 1;
+    s >> path;
+    if (!(s >> first >> last)) {
+      scenes.push_back(path);
+      continue;
+    }
+    s >> step;
+    if (step <= 0) step = 1;
+    if (!isFramePattern(path)) {
+      cerr << manifest << ":" << lineNumber << ": " << path
+           << " needs exactly one %d for the frame number (%% for a %) Skipping \n";
+      continue;
+    }
+    for (int frame = first; frame <= last; frame += step) {
+      char name[4096];
+      if (snprintf(name, sizeof(name), path.c_str(), frame) >= (int) sizeof(name)) {
+        cerr << manifest << ":" << lineNumber << ": file name too long Skipping \n";
+        break;
+      }
+      scenes.push_back(name);
+    }
+  }
+  return scenes;
+}
+
+int runBatch(const string& manifest, ThreadPool& pool, OutputPipeline& output,
+             const string& accelCache) {
+  vector<string> scenes = readManifest(manifest);
+  GeometryCache cache;
+  int failed = 0;
+
+  auto start = chrono::steady_clock::now();
+  for (auto& sceneFile : scenes) {
+    Scene scene;
+    Raytracer raytracer;
+    raytracer.setThreadPool(&pool);
+    raytracer.setOutputPipeline(&output);
+    try {
+      readfile(sceneFile.c_str(), scene, raytracer, &cache, &pool);
+    } catch (int) {
+      failed++;
+      continue;
+    }
+    // Frames go to standard output, messages must not get into them
+    if (raytracer.getOutputFname() == "-") cout.rdbuf(cerr.rdbuf());
+    scene.bvh = Bvh::build(scene.sceneObjects, accelCache);
+    raytracer.rayTrace(scene);
+    raytracer.saveImage();
+    cache.nextJob();
+  }
+  if (!output.wait()) failed++;
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+
+  int rendered = scenes.size() - failed;
+  cout << "Batch: " << rendered << " of " << scenes.size() << " frames in "
+       << seconds << " s, " << rendered * 3600 / max(seconds, 1e-9)
+       << " frames/hour\n"
+       << "Geometry cache: " << cache.hits << " blocks reused, "
+       << cache.misses << " parsed\n";
+  return failed;
+}
@@ -0,0 +1,31 @@
+#ifndef BATCH_H_
+#define BATCH_H_
+
+// Render many scene files in one process
+
+#include <string>
+#include "ThreadPool.h"
+#include "OutputPipeline.h"
+
+using std::string;
+
+/**
+ * Render every scene listed in a manifest, reusing the threads, the output
+ * pipeline and any geometry that is identical between consecutive scenes.
+ *
+ * Every line of the manifest is either a scene file, or a printf-style
+ * pattern followed by a frame range, e.g. `frames/shot%04d.test 1 240 [step]`.
+ * The pattern must hold exactly one %[width]d and no other conversion but %%;
+ * other lines are reported and skipped.
+ * Empty lines and lines starting with '#' are ignored.
+ *
+ * @param manifest - Path of the manifest
+ * @param pool - Threads used for every scene
+ * @param output - Pipeline writing the images, frame N encodes while N+1 renders
+ * @param accelCache - Directory caching the BVH of every scene, empty for none
+ * @return Number of scenes that could not be rendered
+ */
+int runBatch(const string& manifest, ThreadPool& pool, OutputPipeline& output,
+             const string& accelCache);
+
+#endif // BATCH_H_
@@ -0,0 +1,316 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+
+#include "BinaryScene.h"
+
+using namespace std;
+
+static_assert(sizeof(vec3) == 3*sizeof(float), "vertices are used in place as vec3");
+static_assert(sizeof(mat4) == 16*sizeof(float), "transforms are used in place as mat4");
+static_assert(sizeof(BinaryLight) == 40 and sizeof(BinaryMaterial) == 52 and
+              sizeof(BinarySphere) == 16 and sizeof(BinaryGroup) == 32,
+              "records of the binary scene format changed size");
+
+bool isBinaryScene(const char* data, size_t size) {
+  return size >= 8 and memcmp(data, BINARY_SCENE_MAGIC, 8) == 0;
+}
+
+// Whether an array of records lies within the file
+static bool inFile(const BinarySceneArray& array, size_t recordSize, size_t fileSize) {
+  return array.offset % sizeof(float) == 0 and array.offset <= fileSize and
+    array.count <= (fileSize - array.offset) / recordSize;
+}
+
+// What is wrong with the scalar fields of a header, nullptr if nothing
+static const char* headerOutOfRange(const BinarySceneHeader& header) {
+  if (header.width < 1 or header.width > BINARY_SCENE_MAX_SIZE or
+      header.height < 1 or header.height > BINARY_SCENE_MAX_SIZE) return "image size out of range";
+  if (header.maxdepth < 0 or header.maxdepth > BINARY_SCENE_MAX_DEPTH) return "maxdepth out of range";
+  if (header.samplesPerPixel < 1 or header.samplesPerPixel > BINARY_SCENE_MAX_SAMPLES or
+      header.adaptiveSamples < 0 or header.adaptiveSamples > BINARY_SCENE_MAX_SAMPLES or
+      header.convergeSamples < 0 or header.convergeSamples > BINARY_SCENE_MAX_SAMPLES) {
+    return "samples per pixel out of range";
+  }
+  if (header.filter < PIXEL_FILTER_BOX or header.filter > PIXEL_FILTER_GAUSSIAN) return "unknown filter";
+  if (header.integrator < INTEGRATOR_WHITTED or header.integrator > INTEGRATOR_PATH) {
+    return "unknown integrator";
+  }
+  return nullptr;
+}
+
+static vec3 toVec3(const float* v) {
+  return vec3(v[0], v[1], v[2]);
+}
+
+void readBinaryScene(shared_ptr<MappedFile> file, Scene& scene, Raytracer& raytracer) {
+  const char* data = file->data();
+  size_t size = file->size();
+  auto invalid = [&](const char* reason) {
+    cerr << "Invalid Binary Scene File: " << reason << "\n";
+    throw 2;
+  };
+
+  if (size < sizeof(BinarySceneHeader)) invalid("truncated header");
+  const BinarySceneHeader& header = *(const BinarySceneHeader*) data;
+  if (header.byteOrder != BINARY_SCENE_BYTE_ORDER) invalid("written with another byte order");
+  if (header.version != BINARY_SCENE_VERSION) invalid("unsupported version");
+  if (!inFile(header.output, 1, size) or
+      !inFile(header.lights, sizeof(BinaryLight), size) or
+      !inFile(header.materials, sizeof(BinaryMaterial), size) or
+      !inFile(header.transforms, sizeof(mat4), size) or
+      !inFile(header.vertices, sizeof(vec3), size) or
+      !inFile(header.indices, 3*sizeof(uint32_t), size) or
+      !inFile(header.spheres, sizeof(BinarySphere), size) or
+      !inFile(header.groups, sizeof(BinaryGroup), size) or
+      !inFile(header.normals, sizeof(vec3), size) or
+      !inFile(header.normalIndices, 3*sizeof(uint32_t), size)) invalid("array outside of the file");
+
+  if (const char* reason = headerOutOfRange(header)) invalid(reason);
+
+  auto lights = (const BinaryLight*) (data + header.lights.offset);
+  auto materials = (const BinaryMaterial*) (data + header.materials.offset);
+  auto transforms = (const mat4*) (data + header.transforms.offset);
+  auto spheres = (const BinarySphere*) (data + header.spheres.offset);
+  auto groups = (const BinaryGroup*) (data + header.groups.offset);
+
+  auto mesh = make_shared<MeshData>();
+  mesh->vertices = (const vec3*) (data + header.vertices.offset);
+  mesh->indices = (const uint32_t*) (data + header.indices.offset);
+  mesh->storage = file;
+  mesh->numVertices = header.vertices.count;
+  mesh->numTriangles = header.indices.count;
+  mesh->numNormals = header.normals.count;
+  for (size_t i = 0; i < header.indices.count*3; i++) {
+    if (mesh->indices[i] >= header.vertices.count) invalid("vertex index out of range");
+  }
+  if (header.normalIndices.count > 0) {
+    if (header.normalIndices.count != header.indices.count) invalid("normal indices missing");
+    mesh->normals = (const vec3*) (data + header.normals.offset);
+    mesh->normalIndices = (const uint32_t*) (data + header.normalIndices.offset);
+    for (size_t i = 0; i < header.normalIndices.count*3; i++) {
+      if (mesh->normalIndices[i] != MESH_NO_NORMAL and
+          mesh->normalIndices[i] >= header.normals.count) invalid("normal index out of range");
+    }
+  }
+
+  for (size_t g = 0; g < header.groups.count; g++) {
+    const BinaryGroup& group = groups[g];
+    size_t available = group.type == BinaryGroup::TRIANGLES ? header.indices.count :
+                       group.type == BinaryGroup::SPHERES ? header.spheres.count : 0;
+    if (group.material >= header.materials.count or
+        group.transform >= header.transforms.count or
+        group.first > available or group.count > available - group.first) {
+      invalid("object group out of range");
+    }
+  }
+
+  scene.setImageResolution(header.width, header.height);
+  for (size_t l = 0; l < header.lights.count; l++) {
+    float values[6];
+    memcpy(values, lights[l].values, sizeof(values));
+    vec3 attenuation = toVec3(lights[l].attenuation);
+    shared_ptr<LightSource> light;
+    if (lights[l].point) light = make_shared<PointLight>(values, attenuation);
+    else light = make_shared<DirectionalLight>(values, attenuation);
+    scene.addLight(light);
+  }
+
+  for (size_t g = 0; g < header.groups.count; g++) {
+    const BinaryGroup& group = groups[g];
+    const BinaryMaterial& material = materials[group.material];
+    materialProperties materialProps;
+    materialProps.ambient = toVec3(material.ambient);
+    materialProps.diffuse = toVec3(material.diffuse);
+    materialProps.specular = toVec3(material.specular);
+    materialProps.emission = toVec3(material.emission);
+    materialProps.shininess = material.shininess;
+    const mat4& transform = transforms[group.transform];
+
+    if (group.type == BinaryGroup::TRIANGLES) {
+      scene.addMesh(mesh, group.first, group.count, materialProps, transform);
+      continue;
+    }
+    for (size_t i = group.first; i < group.first + group.count; i++) {
+      const BinarySphere& sphere = spheres[i];
+      scene.addObjectToScene(make_shared<Sphere>(sphere.center[0], sphere.center[1],
+                                                 sphere.center[2], sphere.radius,
+                                                 materialProps, transform));
+    }
+  }
+
+  scene.addCamera(toVec3(header.eye), toVec3(header.center), toVec3(header.up), header.fovy);
+  string output(data + header.output.offset, header.output.count);
+  raytracer.init(header.width, header.height, output, header.maxdepth);
+  raytracer.setSampling(header.samplesPerPixel, (PixelFilter) header.filter, header.filterRadius);
+  raytracer.setAdaptiveSampling(header.adaptiveSamples, header.adaptiveContrast);
+  raytracer.setConvergence(header.convergeError, header.convergeSamples);
+  raytracer.setIntegrator((Integrator) header.integrator);
+}
+
+void BinarySceneWriter::addToGroup(uint32_t type, uint64_t index, uint64_t count) {
+  // Materials and transforms are stored once, however many objects use them
+  vector<float> material;
+  for (float* m : {ambient, diffuse, specular, emission}) material.insert(material.end(), m, m+3);
+  material.push_back(shininess);
+  auto found = materialIds.find(material);
+  uint32_t materialId;
+  if (found != materialIds.end()) {
+    materialId = found->second;
+  } else {
+    materialId = materialIds[material] = materials.size();
+    BinaryMaterial record;
+    memcpy(&record, material.data(), sizeof(record));
+    materials.push_back(record);
+  }
+
+  const mat4& top = transfstack.top();
+  vector<float> transform(&top[0][0], &top[0][0] + 16);
+  found = transformIds.find(transform);
+  uint32_t transformId;
+  if (found != transformIds.end()) {
+    transformId = found->second;
+  } else {
+    transformId = transformIds[transform] = transforms.size();
+    transforms.push_back(top);
+  }
+
+  if (!groups.empty() and groups.back().type == type and
+      groups.back().material == materialId and groups.back().transform == transformId and
+      groups.back().first + groups.back().count == index) {
+    groups.back().count += count;
+  } else {
+    groups.push_back({type, materialId, transformId, 0, index, count});
+  }
+}
+
+void BinarySceneWriter::addTriangle(const float* values) {
+  for (int k = 0; k < 3; k++) {
+    if (values[k] < 0 or values[k] >= allVertices.size()) {
+      cerr << "Vertex index " << values[k] << " out of range, skipping triangle\n";
+      return;
+    }
+  }
+  addToGroup(BinaryGroup::TRIANGLES, indices.size() / 3);
+  for (int k = 0; k < 3; k++) {
+    indices.push_back((uint32_t) values[k]);
+    normalIndices.push_back(MESH_NO_NORMAL);
+  }
+}
+
+void BinarySceneWriter::addMesh(shared_ptr<Mesh> mesh) {
+  size_t numTriangles = mesh->indices.size() / 3;
+  if (numTriangles == 0) return;
+  // A mesh used again, as a defined geometry is, only gets another group
+  auto stored = meshFirstTriangle.find(mesh);
+  if (stored != meshFirstTriangle.end()) {
+    addToGroup(BinaryGroup::TRIANGLES, stored->second, numTriangles);
+    return;
+  }
+  size_t first = indices.size() / 3;
+  meshFirstTriangle[mesh] = first;
+  addToGroup(BinaryGroup::TRIANGLES, first, numTriangles);
+  meshTriangles.push_back({first, numTriangles});
+  for (uint32_t index : mesh->indices) indices.push_back(meshVertices.size() + index);
+  const uint32_t* meshNormalIndices = mesh->normalIndexData();
+  for (size_t i = 0; i < mesh->indices.size(); i++) {
+    uint32_t normal = meshNormalIndices ? meshNormalIndices[i] : MESH_NO_NORMAL;
+    normalIndices.push_back(normal == MESH_NO_NORMAL ? normal : normals.size() + normal);
+  }
+  meshVertices.insert(meshVertices.end(), mesh->vertices.begin(), mesh->vertices.end());
+  normals.insert(normals.end(), mesh->normals.begin(), mesh->normals.end());
+}
+
+void BinarySceneWriter::addSphere(const float* values) {
+  addToGroup(BinaryGroup::SPHERES, spheres.size());
+  spheres.push_back({{values[0], values[1], values[2]}, values[3]});
+}
+
+void BinarySceneWriter::addLight(bool point, float* values) {
+  BinaryLight light = {point};
+  memcpy(light.values, values, sizeof(light.values));
+  for (int k = 0; k < 3; k++) light.attenuation[k] = lightAttenuation[k];
+  lights.push_back(light);
+}
+
+bool BinarySceneWriter::write(const string& fname) {
+  BinarySceneHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BINARY_SCENE_MAGIC, 8);
+  header.version = BINARY_SCENE_VERSION;
+  header.byteOrder = BINARY_SCENE_BYTE_ORDER;
+  header.width = scene.width;
+  header.height = scene.height;
+  header.maxdepth = max(maxdepth, 0); // No bounce either way
+  header.samplesPerPixel = samplesPerPixel;
+  header.filter = filter;
+  header.filterRadius = filterRadius;
+  header.adaptiveSamples = adaptiveSamples;
+  header.adaptiveContrast = adaptiveContrast;
+  header.convergeSamples = convergeSamples;
+  header.convergeError = convergeError;
+  header.integrator = integrator;
+  for (int k = 0; k < 3; k++) {
+    header.eye[k] = eye[k];
+    header.center[k] = center[k];
+    header.up[k] = up[k];
+  }
+  header.fovy = fovy;
+  if (const char* reason = headerOutOfRange(header)) {
+    cerr << "Scene does not fit the binary scene format: " << reason << "\n";
+    return false;
+  }
+
+  // Vertices of the meshes go after those of the scene file
+  size_t numVertices = allVertices.size();
+  for (auto& [first, count] : meshTriangles)
+    for (size_t i = 3*first; i < 3*(first + count); i++) indices[i] += numVertices;
+  meshTriangles.clear();
+  allVertices.insert(allVertices.end(), meshVertices.begin(), meshVertices.end());
+  meshVertices.clear();
+
+  // Lay the arrays out one after the other
+  struct Array {BinarySceneArray& location; const void* data; size_t recordSize;};
+  Array arrays[] = {
+    {header.output, outputFname.data(), 1},
+    {header.lights, lights.data(), sizeof(BinaryLight)},
+    {header.materials, materials.data(), sizeof(BinaryMaterial)},
+    {header.transforms, transforms.data(), sizeof(mat4)},
+    {header.vertices, allVertices.data(), sizeof(vec3)},
+    {header.indices, indices.data(), 3*sizeof(uint32_t)},
+    {header.spheres, spheres.data(), sizeof(BinarySphere)},
+    {header.groups, groups.data(), sizeof(BinaryGroup)},
+    {header.normals, normals.data(), sizeof(vec3)},
+    {header.normalIndices, normalIndices.data(), 3*sizeof(uint32_t)},
+  };
+  header.output.count = outputFname.size();
+  header.lights.count = lights.size();
+  header.materials.count = materials.size();
+  header.transforms.count = transforms.size();
+  header.vertices.count = allVertices.size();
+  header.indices.count = indices.size() / 3;
+  header.spheres.count = spheres.size();
+  header.groups.count = groups.size();
+  header.normals.count = normals.size();
+  header.normalIndices.count = normals.empty() ? 0 : normalIndices.size() / 3;
+  uint64_t offset = sizeof(header);
+  for (auto& array : arrays) {
+    offset = (offset + BINARY_SCENE_ALIGNMENT - 1) / BINARY_SCENE_ALIGNMENT * BINARY_SCENE_ALIGNMENT;
+    array.location.offset = offset;
+    offset += array.location.count * array.recordSize;
+  }
+
+  FILE* out = fopen(fname.c_str(), "wb");
+  if (!out) return false;
+  bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+  const char padding[BINARY_SCENE_ALIGNMENT] = {0};
+  uint64_t written = sizeof(header);
+  for (auto& array : arrays) {
+    size_t pad = array.location.offset - written;
+    size_t bytes = array.location.count * array.recordSize;
+    ok = ok and (pad == 0 or fwrite(padding, 1, pad, out) == pad);
+    ok = ok and (bytes == 0 or fwrite(array.data, 1, bytes, out) == bytes);
+    written = array.location.offset + bytes;
+  }
+  return fclose(out) == 0 and ok;
+}
@@ -0,0 +1,158 @@
+#ifndef BINARYSCENE_H_
+#define BINARYSCENE_H_
+
+// Binary scene files, mapped and used in place
+
+#include <vector>
+#include <map>
+#include <string>
+#include <memory>
+#include <cstdint>
+
+#include "MappedFile.h"
+#include "readfile.h"
+
+using std::vector, std::map, std::string, std::shared_ptr;
+
+#define BINARY_SCENE_MAGIC "NRTSCENE"
+#define BINARY_SCENE_VERSION 6
+// Value of byteOrder when the file was written on a machine of the same endianness
+#define BINARY_SCENE_BYTE_ORDER 0x01020304u
+// Alignment of every array in the file
+#define BINARY_SCENE_ALIGNMENT 64
+// Limits of the scalar fields of the header
+#define BINARY_SCENE_MAX_SIZE 65536 // Width and height of the image
+#define BINARY_SCENE_MAX_DEPTH 1024 // Bounces of a ray
+#define BINARY_SCENE_MAX_SAMPLES 65536 // Samples per pixel
+
+/**
+ * Location of an array in a binary scene file
+ *
+ */
+struct BinarySceneArray {
+        uint64_t offset; // Bytes from the start of the file
+        uint64_t count; // Number of records
+};
+
+/**
+ * Start of a binary scene file. Every array is aligned to
+ * BINARY_SCENE_ALIGNMENT bytes, records are in the byte order
+ * of the machine that wrote them.
+ *
+ */
+struct BinarySceneHeader {
+        char magic[8];
+        uint32_t version;
+        uint32_t byteOrder;
+        int32_t width, height, maxdepth;
+        int32_t samplesPerPixel, filter; // filter is a PixelFilter
+        float filterRadius; // 0 for the default of the filter
+        int32_t adaptiveSamples; // 0 for uniform sampling
+        float adaptiveContrast; // 0 for the default
+        int32_t convergeSamples; // 0 for a fixed spp
+        float convergeError;
+        int32_t integrator; // Integrator
+        float eye[3], center[3], up[3], fovy;
+        BinarySceneArray output; // Name of output file, chars
+        BinarySceneArray lights; // BinaryLight
+        BinarySceneArray materials; // BinaryMaterial
+        BinarySceneArray transforms; // 16 floats, column-major like mat4
+        BinarySceneArray vertices; // 3 floats
+        BinarySceneArray indices; // 3 uint32 vertex indices per triangle
+        BinarySceneArray spheres; // BinarySphere
+        BinarySceneArray groups; // BinaryGroup, in the order of the objects
+        BinarySceneArray normals; // 3 floats
+        // 3 uint32 normal indices per triangle, MESH_NO_NORMAL for none;
+        // empty when no triangle has vertex normals
+        BinarySceneArray normalIndices;
+};
+
+struct BinaryLight {
+        uint32_t point; // 1 for a point light, 0 for directional
+        float values[6]; // Position/direction and color
+        float attenuation[3];
+};
+
+struct BinaryMaterial {
+        float ambient[3], diffuse[3], specular[3], emission[3];
+        float shininess;
+};
+
+struct BinarySphere {
+        float center[3];
+        float radius;
+};
+
+/**
+ * Consecutive objects of one kind sharing a material and transform
+ *
+ */
+struct BinaryGroup {
+        enum {TRIANGLES, SPHERES};
+        uint32_t type;
+        uint32_t material, transform;
+        uint32_t reserved;
+        uint64_t first, count; // Triangles or spheres
+};
+
+/**
+ * Whether a file is a binary scene
+ *
+ * @param data - Contents of the file
+ * @param size - Size of the file
+ */
+bool isBinaryScene(const char* data, size_t size);
+
+/**
+ * Load a binary scene. Triangles become MeshTriangles reading their
+ * vertices straight from the mapped file, which they keep alive.
+ * Throws 2 if the file is invalid.
+ *
+ * @param file - Mapped scene file
+ * @param scene - Scene to add the objects, lights and camera to
+ * @param raytracer - Raytracer to set up for the image
+ */
+void readBinaryScene(shared_ptr<MappedFile> file, Scene& scene, Raytracer& raytracer);
+
+/**
+ * Builder recording the commands of a text scene file into
+ * the tables of a binary scene instead of building the scene.
+ *
+ */
+class BinarySceneWriter : public SceneBuilder {
+  public:
+        BinarySceneWriter(Scene& scene, Raytracer& raytracer) :
+                SceneBuilder(scene, raytracer) {}
+        void addTriangle(const float* indices);
+        void addSphere(const float* values);
+        void addLight(bool point, float* values);
+        void addMesh(shared_ptr<Mesh> mesh);
+        /**
+        * Write the binary scene
+        *
+        * @param fname - Name of the binary scene file
+        * @return false on a write error
+        */
+        bool write(const string& fname);
+
+        vector<uint32_t> indices, normalIndices;
+        // Vertices of meshes, stored after those of the scene file
+        vector<vec3> meshVertices, normals;
+        vector<BinarySphere> spheres;
+        vector<BinaryGroup> groups;
+        vector<BinaryLight> lights;
+        vector<BinaryMaterial> materials;
+        vector<mat4> transforms;
+
+  private:
+        void addToGroup(uint32_t type, uint64_t index, uint64_t count = 1);
+
+        // Triangles whose indices are into meshVertices
+        vector<pair<size_t, size_t>> meshTriangles;
+
+        map<vector<float>, uint32_t> materialIds, transformIds;
+        // First triangle of every mesh stored, kept alive so none reuses its address
+        map<shared_ptr<Mesh>, size_t> meshFirstTriangle;
+};
+
+#endif // BINARYSCENE_H_
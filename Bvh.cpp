@@ -0,0 +1,512 @@
+#include <iostream>
+#include <algorithm>
+#include <numeric>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cfloat>
+#include <filesystem>
+#include <unistd.h>
+#include <atomic>
+
+#include "Bvh.h"
+#include "Lights.h"
+#include "GeometryCache.h"
+
+using namespace std;
+
+// Leaves with at most this many primitives are never split
+#define BVH_LEAF_SIZE 4
+// Leaves are split past this many primitives even when SAH disagrees
+#define BVH_MAX_LEAF_SIZE 16
+#define BVH_BINS 16
+// Deeper nodes are made leaves, bounding the traversal stack
+#define BVH_MAX_DEPTH 100
+// Traversal stack, deep enough for the subtrees of blocks under
+// at most 32 levels split at the median
+#define BVH_STACK_SIZE (BVH_MAX_DEPTH + 34)
+#define BVH_CACHE_BYTE_ORDER 0x01020304u
+
+// Start of a cached hierarchy, followed by the nodes and the primitive indices
+struct BvhCacheHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t byteOrder;
+  uint64_t hash; // Of the bounds of the objects it was built over
+  uint64_t numObjects, numNodes;
+  double buildSeconds;
+};
+static_assert(sizeof(BvhNode) == 32, "nodes of the BVH cache changed size");
+static_assert(sizeof(BvhCacheHeader) <= 64, "BVH cache header outgrew its space");
+#define BVH_CACHE_NODES_OFFSET 64
+
+static float surfaceArea(const vec3& boundsMin, const vec3& boundsMax) {
+  vec3 d = glm::max(boundsMax - boundsMin, vec3(0));
+  return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+string Bvh::defaultCacheDir() {
+  if (const char* dir = getenv("NANORAYTRACER_CACHE")) return dir;
+  if (const char* dir = getenv("XDG_CACHE_HOME")) return string(dir) + "/nanoraytracer";
+  if (const char* home = getenv("HOME")) return string(home) + "/.cache/nanoraytracer";
+  return "";
+}
+
+// Build the nodes of a hierarchy over n boxes. With median, used for the
+// levels above the subtrees of blocks, every box gets a leaf of its own
+// and nodes are split in half so they stay shallow.
+// Returns false, leaving the nodes unfinished, if cancel gets set.
+static bool buildTree(const vec3* boundsMin, const vec3* boundsMax, size_t numObjects,
+                      bool median, vector<BvhNode>& nodes, vector<uint32_t>& indices,
+                      const atomic<bool>* cancel = nullptr) {
+  indices.resize(numObjects);
+  iota(indices.begin(), indices.end(), 0);
+  vector<vec3> centers(numObjects);
+  for (size_t i = 0; i < numObjects; i++) centers[i] = (boundsMin[i] + boundsMax[i]) * 0.5f;
+
+  nodes.clear();
+  nodes.reserve(2*numObjects + 1);
+  nodes.push_back({{0,0,0}, {0,0,0}, 0, (uint32_t) numObjects});
+  // Nodes still to be split, with their depth
+  vector<pair<uint32_t, int>> todo;
+  if (numObjects > 0) todo.push_back({0, 0});
+  while (!todo.empty()) {
+    if (cancel and *cancel) return false;
+    auto [nodeIdx, depth] = todo.back();
+    todo.pop_back();
+    uint32_t first = nodes[nodeIdx].first, count = nodes[nodeIdx].count;
+
+    vec3 nodeMin(FLT_MAX), nodeMax(-FLT_MAX), centerMin(FLT_MAX), centerMax(-FLT_MAX);
+    for (uint32_t i = first; i < first + count; i++) {
+      uint32_t obj = indices[i];
+      nodeMin = glm::min(nodeMin, boundsMin[obj]);
+      nodeMax = glm::max(nodeMax, boundsMax[obj]);
+      centerMin = glm::min(centerMin, centers[obj]);
+      centerMax = glm::max(centerMax, centers[obj]);
+    }
+    for (int k = 0; k < 3; k++) {
+      nodes[nodeIdx].boundsMin[k] = nodeMin[k];
+      nodes[nodeIdx].boundsMax[k] = nodeMax[k];
+    }
+    if (median ? count <= 1 : (count <= BVH_LEAF_SIZE or depth >= BVH_MAX_DEPTH)) continue;
+
+    // Split along the longest axis of the centers
+    vec3 extent = centerMax - centerMin;
+    int axis = extent.x > extent.y ? (extent.x > extent.z ? 0 : 2) : (extent.y > extent.z ? 1 : 2);
+    uint32_t mid = first + count/2;
+    if (extent[axis] > 0 and !median) {
+      // Binned surface area heuristic
+      struct Bin {vec3 boundsMin = vec3(FLT_MAX), boundsMax = vec3(-FLT_MAX); uint32_t count = 0;};
+      Bin bins[BVH_BINS];
+      float scale = BVH_BINS / extent[axis];
+      auto binOf = [&](uint32_t obj) {
+        return min(BVH_BINS - 1, (int) ((centers[obj][axis] - centerMin[axis]) * scale));
+      };
+      for (uint32_t i = first; i < first + count; i++) {
+        uint32_t obj = indices[i];
+        Bin& bin = bins[binOf(obj)];
+        bin.boundsMin = glm::min(bin.boundsMin, boundsMin[obj]);
+        bin.boundsMax = glm::max(bin.boundsMax, boundsMax[obj]);
+        bin.count++;
+      }
+      // Cost of the primitives left of every split, then right of it
+      float leftCost[BVH_BINS];
+      Bin left;
+      for (int b = 0; b < BVH_BINS - 1; b++) {
+        left.boundsMin = glm::min(left.boundsMin, bins[b].boundsMin);
+        left.boundsMax = glm::max(left.boundsMax, bins[b].boundsMax);
+        left.count += bins[b].count;
+        leftCost[b] = left.count * surfaceArea(left.boundsMin, left.boundsMax);
+      }
+      Bin right;
+      float bestCost = FLT_MAX;
+      int bestSplit = -1;
+      for (int b = BVH_BINS - 1; b > 0; b--) {
+        right.boundsMin = glm::min(right.boundsMin, bins[b].boundsMin);
+        right.boundsMax = glm::max(right.boundsMax, bins[b].boundsMax);
+        right.count += bins[b].count;
+        float cost = leftCost[b-1] + right.count * surfaceArea(right.boundsMin, right.boundsMax);
+        if (right.count < count and cost < bestCost) {
+          bestCost = cost;
+          bestSplit = b;
+        }
+      }
+      float leafCost = count * surfaceArea(nodeMin, nodeMax);
+      if (bestCost >= leafCost and count <= BVH_MAX_LEAF_SIZE) continue;
+      if (bestSplit > 0) {
+        mid = partition(indices.begin() + first, indices.begin() + first + count,
+                        [&](uint32_t obj) {return binOf(obj) < bestSplit;})
+              - indices.begin();
+      }
+    }
+    // All centers in one place, every one in the same bin, or a median split
+    if (median or mid == first or mid == first + count) {
+      mid = first + count/2;
+      nth_element(indices.begin() + first, indices.begin() + mid,
+                  indices.begin() + first + count,
+                  [&](uint32_t a, uint32_t b) {return centers[a][axis] < centers[b][axis];});
+    }
+
+    uint32_t leftIdx = nodes.size();
+    nodes.push_back({{0,0,0}, {0,0,0}, first, mid - first});
+    nodes.push_back({{0,0,0}, {0,0,0}, mid, first + count - mid});
+    nodes[nodeIdx].first = leftIdx;
+    nodes[nodeIdx].count = 0;
+    todo.push_back({leftIdx, depth+1});
+    todo.push_back({leftIdx+1, depth+1});
+  }
+  if (numObjects == 0) nodes.clear();
+  return true;
+}
+
+shared_ptr<Bvh> Bvh::build(vector<shared_ptr<SceneObject>>& objects, const string& cacheDir) {
+  BvhBuilder builder;
+  return builder.seal(objects, cacheDir);
+}
+
+BvhBuilder::~BvhBuilder() {
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+    holding = true;
+  }
+  wake.notify_all();
+  if (thread.joinable()) thread.join();
+}
+
+void BvhBuilder::objectsAdded(vector<shared_ptr<SceneObject>>& objects) {
+  if (objects.size() - handedOff < BVH_BLOCK_MIN_OBJECTS) return;
+  addBlock(objects);
+  if (!thread.joinable()) thread = std::thread(&BvhBuilder::threadLoop, this);
+  wake.notify_one();
+}
+
+void BvhBuilder::addBlock(vector<shared_ptr<SceneObject>>& objects) {
+  auto block = make_unique<Block>();
+  block->first = handedOff;
+  // The scene may move its pointers while the block is built, not the objects
+  block->objects.reserve(objects.size() - handedOff);
+  for (size_t i = handedOff; i < objects.size(); i++) block->objects.push_back(objects[i].get());
+  handedOff = objects.size();
+  lock_guard<std::mutex> lock(mutex);
+  queue.push_back(block.get());
+  blocks.push_back(move(block));
+}
+
+void BvhBuilder::boundBlock(Block& block) {
+  size_t count = block.objects.size();
+  block.boundsMin.resize(count);
+  block.boundsMax.resize(count);
+  for (size_t i = 0; i < count; i++) block.objects[i]->getBounds(block.boundsMin[i], block.boundsMax[i]);
+  block.objects = vector<SceneObject*>();
+  block.bounded = true;
+}
+
+bool BvhBuilder::buildBlock(Block& block, const char* stage) {
+  auto start = Timeline::Clock::now();
+  if (!block.bounded) boundBlock(block);
+  bool built = buildTree(block.boundsMin.data(), block.boundsMax.data(), block.boundsMin.size(),
+                         false, block.nodes, block.indices, &holding);
+  if (built)
+    for (uint32_t& index : block.indices) index += block.first;
+  auto end = Timeline::Clock::now();
+  block.buildSeconds += chrono::duration<double>(end - start).count();
+  if (timeline) timeline->record(stage, start, end);
+  return built;
+}
+
+bool BvhBuilder::buildNext(unique_lock<std::mutex>& lock, const char* stage) {
+  if (queue.empty() or holding) return false;
+  Block* block = queue.front();
+  queue.pop_front();
+  building++;
+  lock.unlock();
+  bool built = buildBlock(*block, stage);
+  lock.lock();
+  building--;
+  // Put back for later if the cache is being looked up
+  if (!built) queue.push_front(block);
+  done.notify_all();
+  return true;
+}
+
+void BvhBuilder::threadLoop() {
+  unique_lock<std::mutex> lock(mutex);
+  while (!stopping) {
+    if (!buildNext(lock, "bvh blocks"))
+      wake.wait(lock, [&] {return stopping or (!holding and !queue.empty());});
+  }
+}
+
+shared_ptr<Bvh> BvhBuilder::seal(vector<shared_ptr<SceneObject>>& objects, const string& cacheDir) {
+  auto start = Timeline::Clock::now();
+  size_t numObjects = objects.size();
+  bool useCache = !cacheDir.empty() and numObjects >= BVH_CACHE_MIN_OBJECTS;
+  if (objects.size() > handedOff) addBlock(objects);
+  unique_lock<std::mutex> lock(mutex);
+  if (useCache) {
+    // Trees being built are put aside until the cache has been looked up
+    holding = true;
+    done.wait(lock, [&] {return building == 0;});
+  }
+  lock.unlock();
+  auto bvh = make_shared<Bvh>();
+
+  // The hierarchy only depends on the boxes of the objects, so they are
+  // what identifies it: any change to the geometry or a transform changes them
+  uint64_t hash = 0;
+  string path;
+  if (useCache) {
+    for (auto& block : blocks)
+      if (!block->bounded) boundBlock(*block);
+    hash = GeometryCache::hash(nullptr, 0);
+    for (auto& block : blocks)
+      hash = GeometryCache::hash(block->boundsMin.data(), block->boundsMin.size()*sizeof(vec3), hash);
+    for (auto& block : blocks)
+      hash = GeometryCache::hash(block->boundsMax.data(), block->boundsMax.size()*sizeof(vec3), hash);
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bvh", (unsigned long long) hash);
+    path = cacheDir + "/" + name;
+    auto loadStart = Timeline::Clock::now();
+    if (bvh->load(path, hash, numObjects)) {
+      auto end = Timeline::Clock::now();
+      double seconds = chrono::duration<double>(end - loadStart).count();
+      cout << "BVH cache hit: " << bvh->numNodes << " nodes loaded in " << seconds*1e3
+           << " ms, saved " << (bvh->cachedBuildSeconds - seconds)*1e3 << " ms\n";
+      if (timeline) timeline->record("bvh seal", start, end);
+      return bvh;
+    }
+  }
+
+  // Build what is left together with the background thread
+  lock.lock();
+  holding = false;
+  wake.notify_all();
+  while (buildNext(lock, "bvh blocks")) ;
+  done.wait(lock, [&] {return queue.empty() and building == 0;});
+  lock.unlock();
+  double buildSeconds = 0;
+  for (auto& block : blocks) buildSeconds += block->buildSeconds;
+
+  auto mergeStart = Timeline::Clock::now();
+  vector<BvhNode>& nodes = bvh->builtNodes;
+  vector<uint32_t>& indices = bvh->builtIndices;
+  if (blocks.size() == 1) {
+    nodes = move(blocks[0]->nodes);
+    indices = move(blocks[0]->indices);
+  } else if (blocks.size() > 1) {
+    // Levels over the roots of the blocks, whose leaves become the roots
+    // and are followed by the rest of their subtree
+    size_t numBlocks = blocks.size();
+    vector<vec3> rootMin(numBlocks), rootMax(numBlocks);
+    for (size_t k = 0; k < numBlocks; k++) {
+      const BvhNode& root = blocks[k]->nodes[0];
+      rootMin[k] = vec3(root.boundsMin[0], root.boundsMin[1], root.boundsMin[2]);
+      rootMax[k] = vec3(root.boundsMax[0], root.boundsMax[1], root.boundsMax[2]);
+    }
+    vector<uint32_t> topIndices;
+    buildTree(rootMin.data(), rootMax.data(), numBlocks, true, nodes, topIndices);
+    vector<size_t> firstIndex(numBlocks);
+    for (size_t k = 0; k < numBlocks; k++) {
+      firstIndex[k] = indices.size();
+      indices.insert(indices.end(), blocks[k]->indices.begin(), blocks[k]->indices.end());
+    }
+    size_t numTopNodes = nodes.size();
+    for (size_t n = 0; n < numTopNodes; n++) {
+      if (nodes[n].count == 0) continue;
+      size_t k = topIndices[nodes[n].first];
+      const vector<BvhNode>& subtree = blocks[k]->nodes;
+      // Node j > 0 of the subtree goes to nodeBase + j
+      size_t nodeBase = nodes.size() - 1;
+      auto moved = [&](BvhNode node) {
+        node.first += node.count == 0 ? nodeBase : firstIndex[k];
+        return node;
+      };
+      nodes[n] = moved(subtree[0]);
+      for (size_t j = 1; j < subtree.size(); j++) nodes.push_back(moved(subtree[j]));
+    }
+  }
+  blocks.clear();
+  bvh->nodes = nodes.data();
+  bvh->indices = indices.data();
+  bvh->numNodes = nodes.size();
+  auto end = Timeline::Clock::now();
+  buildSeconds += chrono::duration<double>(end - mergeStart).count();
+  if (timeline) timeline->record("bvh seal", start, end);
+
+  if (useCache) {
+    cout << "BVH cache miss: " << bvh->numNodes << " nodes built in " << buildSeconds*1e3 << " ms";
+    if (bvh->save(path, hash, numObjects, buildSeconds)) cout << ", stored in " << path << "\n";
+    else cout << ", could not store it in " << cacheDir << "\n";
+  }
+  return bvh;
+}
+
+shared_ptr<Bvh> Bvh::copy(size_t numObjects) const {
+  auto bvh = make_shared<Bvh>();
+  bvh->builtNodes.assign(nodes, nodes + numNodes);
+  bvh->builtIndices.assign(indices, indices + numObjects);
+  bvh->nodes = bvh->builtNodes.data();
+  bvh->indices = bvh->builtIndices.data();
+  bvh->numNodes = numNodes;
+  return bvh;
+}
+
+bool Bvh::load(const string& path, uint64_t hash, size_t numObjects) {
+  if (!mapping.open(path)) return false;
+  const char* data = mapping.data();
+  size_t size = mapping.size();
+  const BvhCacheHeader* header = (const BvhCacheHeader*) data;
+  // A stale or damaged file is rebuilt and replaced
+  bool valid = size >= BVH_CACHE_NODES_OFFSET and
+    memcmp(header->magic, BVH_CACHE_MAGIC, 8) == 0 and
+    header->version == BVH_CACHE_VERSION and header->byteOrder == BVH_CACHE_BYTE_ORDER and
+    header->hash == hash and header->numObjects == numObjects and
+    header->numNodes <= (size - BVH_CACHE_NODES_OFFSET) / sizeof(BvhNode) and
+    size - BVH_CACHE_NODES_OFFSET - header->numNodes*sizeof(BvhNode) ==
+      numObjects*sizeof(uint32_t);
+  if (!valid) {
+    mapping.close();
+    return false;
+  }
+  const BvhNode* loadedNodes = (const BvhNode*) (data + BVH_CACHE_NODES_OFFSET);
+  const uint32_t* loadedIndices = (const uint32_t*) (loadedNodes + header->numNodes);
+  // Children always come after their parent, so the nodes form a tree,
+  // and no leaf is deeper than the traversal stack can hold
+  vector<uint32_t> depth(header->numNodes, 0);
+  for (size_t n = 0; valid and n < header->numNodes; n++) {
+    const BvhNode& node = loadedNodes[n];
+    if (node.count == 0) {
+      valid = node.first > n and node.first + 1 < header->numNodes and
+        depth[n] + 1 <= BVH_STACK_SIZE - 1;
+      if (!valid) break;
+      depth[node.first] = max(depth[node.first], depth[n] + 1);
+      depth[node.first+1] = max(depth[node.first+1], depth[n] + 1);
+    }
+    else valid = node.first <= numObjects and node.count <= numObjects - node.first;
+  }
+  for (size_t i = 0; valid and i < numObjects; i++) valid = loadedIndices[i] < numObjects;
+  if (!valid) {
+    mapping.close();
+    return false;
+  }
+
+  nodes = loadedNodes;
+  indices = loadedIndices;
+  numNodes = header->numNodes;
+  cachedBuildSeconds = header->buildSeconds;
+  return true;
+}
+
+bool Bvh::save(const string& path, uint64_t hash, size_t numObjects, double buildSeconds) {
+  error_code error;
+  filesystem::create_directories(filesystem::path(path).parent_path(), error);
+
+  BvhCacheHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, BVH_CACHE_MAGIC, 8);
+  header.version = BVH_CACHE_VERSION;
+  header.byteOrder = BVH_CACHE_BYTE_ORDER;
+  header.hash = hash;
+  header.numObjects = numObjects;
+  header.numNodes = numNodes;
+  header.buildSeconds = buildSeconds;
+  char padding[BVH_CACHE_NODES_OFFSET] = {0};
+  memcpy(padding, &header, sizeof(header));
+
+  // Written aside and renamed, so other renders never map half a file
+  string tmpPath = path + ".tmp" + to_string(getpid());
+  FILE* out = fopen(tmpPath.c_str(), "wb");
+  if (!out) return false;
+  bool ok = fwrite(padding, 1, sizeof(padding), out) == sizeof(padding) and
+    fwrite(nodes, sizeof(BvhNode), numNodes, out) == numNodes and
+    fwrite(indices, sizeof(uint32_t), numObjects, out) == numObjects;
+  ok = fclose(out) == 0 and ok;
+  if (ok) ok = rename(tmpPath.c_str(), path.c_str()) == 0;
+  if (!ok) remove(tmpPath.c_str());
+  return ok;
+}
+
+// Distance along a ray to where it enters a node, if before maxDistance
+static bool hitNode(const BvhNode& node, const vec3& eye, const vec3& invDirection,
+                    float maxDistance, float& entry) {
+  float t0 = 0, t1 = maxDistance;
+  for (int k = 0; k < 3; k++) {
+    float tA = (node.boundsMin[k] - eye[k]) * invDirection[k];
+    float tB = (node.boundsMax[k] - eye[k]) * invDirection[k];
+    if (tA > tB) swap(tA, tB);
+    t0 = max(t0, tA);
+    t1 = min(t1, tB);
+  }
+  entry = t0;
+  return t0 <= t1;
+}
+
+pair<int, vec3> Bvh::closestHit(vector<shared_ptr<SceneObject>>& objects,
+                                vec3& eye, vec3& rayDirection) {
+  float minHitDistance = Z_FAR;
+  vec3 hitPoint(0,0,0);
+  int intersectObjectIdx = -1;
+  if (numNodes == 0) return make_pair(intersectObjectIdx, hitPoint);
+
+  vec3 invDirection = 1.0f / normalize(rayDirection);
+  uint32_t stack[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode& node = nodes[stack[--top]];
+    float entry;
+    if (!hitNode(node, eye, invDirection, minHitDistance, entry)) continue;
+    if (node.count > 0) {
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        auto objHitResults = objects[indices[i]]->hitTest(eye, rayDirection);
+        float hitDistance = objHitResults.first;
+        if (hitDistance > 0 and hitDistance < minHitDistance) {
+          minHitDistance = hitDistance;
+          hitPoint = objHitResults.second;
+          intersectObjectIdx = indices[i];
+        }
+      }
+      continue;
+    }
+    // Visit the nearer child first, its hits cut the other one short
+    float entryA, entryB;
+    bool hitA = hitNode(nodes[node.first], eye, invDirection, minHitDistance, entryA);
+    bool hitB = hitNode(nodes[node.first+1], eye, invDirection, minHitDistance, entryB);
+    if (hitA and hitB) {
+      bool aFirst = entryA <= entryB;
+      stack[top++] = aFirst ? node.first+1 : node.first;
+      stack[top++] = aFirst ? node.first : node.first+1;
+    } else if (hitA) {
+      stack[top++] = node.first;
+    } else if (hitB) {
+      stack[top++] = node.first+1;
+    }
+  }
+  return make_pair(intersectObjectIdx, hitPoint);
+}
+
+bool Bvh::occluded(vector<shared_ptr<SceneObject>>& objects,
+                   vec3& eye, vec3& rayDirection, float maxDistance) {
+  if (numNodes == 0) return false;
+  vec3 invDirection = 1.0f / normalize(rayDirection);
+  uint32_t stack[BVH_STACK_SIZE];
+  int top = 0;
+  stack[top++] = 0;
+  while (top > 0) {
+    const BvhNode& node = nodes[stack[--top]];
+    float entry;
+    if (!hitNode(node, eye, invDirection, maxDistance, entry)) continue;
+    if (node.count > 0) {
+      for (uint32_t i = node.first; i < node.first + node.count; i++) {
+        float hitDistance = objects[indices[i]]->hitTest(eye, rayDirection).first;
+        if (hitDistance > 0 and hitDistance < maxDistance) return true;
+      }
+      continue;
+    }
+    stack[top++] = node.first;
+    stack[top++] = node.first+1;
+  }
+  return false;
+}
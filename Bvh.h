@@ -0,0 +1,169 @@
+#ifndef BVH_H_
+#define BVH_H_
+
+// Bounding volume hierarchy over the objects of a scene, cached on disk
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <cstdint>
+#include <deque>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include "SceneObjects.h"
+#include "MappedFile.h"
+#include "Timeline.h"
+
+using std::vector, std::string, std::shared_ptr, std::unique_ptr, std::pair, std::deque;
+
+#define BVH_CACHE_MAGIC "NRTBVH\0\0"
+#define BVH_CACHE_VERSION 1
+// Scenes with fewer objects build their hierarchy faster than it loads
+#define BVH_CACHE_MIN_OBJECTS 10000
+// Objects handed to the background builder of a scene get a subtree
+// of their own once there are this many
+#define BVH_BLOCK_MIN_OBJECTS 65536
+
+/**
+ * Node of the hierarchy. Inner nodes have their two children next to
+ * each other, leaves a range of the primitive index array.
+ *
+ */
+struct BvhNode {
+        float boundsMin[3], boundsMax[3];
+        uint32_t first; // First child, or first primitive of a leaf
+        uint32_t count; // Number of primitives, 0 for an inner node
+};
+
+/**
+ * Bounding volume hierarchy built with the surface area heuristic.
+ * The node and primitive index arrays are saved to a cache directory
+ * under a hash of the world space bounds of every object, and mapped
+ * back in place when the same geometry is rendered again.
+ *
+ */
+class Bvh {
+  public:
+        /**
+        * Build the hierarchy of a list of objects, or load it from the cache
+        *
+        * @param objects - Objects of the scene, in the order they are indexed
+        * @param cacheDir - Cache directory, empty to always build
+        * @return The hierarchy
+        */
+        static shared_ptr<Bvh> build(vector<shared_ptr<SceneObject>>& objects,
+                                     const string& cacheDir);
+        /**
+        * Directory used when none is given: $NANORAYTRACER_CACHE,
+        * else nanoraytracer under $XDG_CACHE_HOME or ~/.cache
+        *
+        */
+        static string defaultCacheDir();
+        /**
+        * Find the object first hit by a ray
+        *
+        * @param objects - Objects the hierarchy was built over
+        * @param eye - Origin of the ray
+        * @param rayDirection - Normalized direction of the ray
+        * @return Index of the object, -1 for none, and the point hit
+        */
+        pair<int, vec3> closestHit(vector<shared_ptr<SceneObject>>& objects,
+                                   vec3& eye, vec3& rayDirection);
+        /**
+        * Whether any object is hit closer than a distance
+        *
+        * @param objects - Objects the hierarchy was built over
+        * @param eye - Origin of the ray
+        * @param rayDirection - Normalized direction of the ray
+        * @param maxDistance - Distance to the light
+        */
+        bool occluded(vector<shared_ptr<SceneObject>>& objects,
+                      vec3& eye, vec3& rayDirection, float maxDistance);
+        /**
+        * Copy the node and index arrays into memory allocated by the
+        * calling thread, so they live on its NUMA node
+        *
+        * @param numObjects - Number of objects the hierarchy was built over
+        * @return The copy
+        */
+        shared_ptr<Bvh> copy(size_t numObjects) const;
+
+        size_t numNodes = 0;
+
+  private:
+        friend class BvhBuilder;
+        bool load(const string& path, uint64_t hash, size_t numObjects);
+        bool save(const string& path, uint64_t hash, size_t numObjects, double buildSeconds);
+
+        // Either built in memory or mapped from the cache
+        const BvhNode* nodes = nullptr;
+        const uint32_t* indices = nullptr;
+        vector<BvhNode> builtNodes;
+        vector<uint32_t> builtIndices;
+        MappedFile mapping;
+        double cachedBuildSeconds = 0;
+};
+
+/**
+ * Builds the hierarchy of a scene while the scene is still being read.
+ * Blocks of objects handed to it get subtrees built on a background
+ * thread; sealing builds the objects left and puts a few levels split
+ * at the median over the subtrees.
+ *
+ */
+class BvhBuilder {
+  public:
+        /**
+        * @param timeline - Where to record the time spent building, if anywhere
+        */
+        BvhBuilder(Timeline* timeline = nullptr) : timeline(timeline) {}
+        ~BvhBuilder();
+        /**
+        * Hand the objects added since the last call to the background
+        * thread, once there are enough of them for a subtree of their own
+        *
+        * @param objects - Objects of the scene, only ever appended to
+        */
+        void objectsAdded(vector<shared_ptr<SceneObject>>& objects);
+        /**
+        * Finish the hierarchy, or load it from the cache
+        *
+        * @param objects - Every object of the scene, in the order they are indexed
+        * @param cacheDir - Cache directory, empty to always build
+        * @return The hierarchy
+        */
+        shared_ptr<Bvh> seal(vector<shared_ptr<SceneObject>>& objects, const string& cacheDir);
+
+  private:
+        // Consecutive objects of the scene and their subtree
+        struct Block {
+                size_t first; // Index of the first object
+                vector<SceneObject*> objects; // Until their bounds are known
+                vector<vec3> boundsMin, boundsMax;
+                bool bounded = false;
+                vector<BvhNode> nodes;
+                vector<uint32_t> indices; // Into the objects of the scene
+                double buildSeconds = 0;
+        };
+        void addBlock(vector<shared_ptr<SceneObject>>& objects);
+        void boundBlock(Block& block);
+        bool buildBlock(Block& block, const char* stage);
+        bool buildNext(std::unique_lock<std::mutex>& lock, const char* stage);
+        void threadLoop();
+
+        Timeline* timeline;
+        vector<unique_ptr<Block>> blocks; // In the order of their objects
+        size_t handedOff = 0; // Objects given to a block so far
+        deque<Block*> queue; // Blocks whose tree is still to be built
+        int building = 0; // Blocks being built
+        // Set while the cache is looked up, trees being built are given up
+        std::atomic<bool> holding = false;
+        bool stopping = false;
+        std::thread thread;
+        std::mutex mutex;
+        std::condition_variable wake, done;
+};
+
+#endif // BVH_H_
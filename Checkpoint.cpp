@@ -0,0 +1,86 @@
+#include <chrono>
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <unistd.h>
+#include "Checkpoint.h"
+
+using namespace std;
+
+static int64_t nowNanoseconds() {
+  return chrono::duration_cast<chrono::nanoseconds>(
+    chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+Checkpoint::Checkpoint(const string& fname, double interval, bool resume) :
+  fname(fname), interval(interval), resume(resume) {
+  nextDue = nowNanoseconds() + (int64_t) (interval * 1e9);
+}
+
+bool Checkpoint::due() {
+  int64_t now = nowNanoseconds(), next = nextDue;
+  // Whoever moves the time on writes the checkpoint
+  return now >= next and nextDue.compare_exchange_strong(next, INT64_MAX);
+}
+
+bool Checkpoint::save(const CheckpointHeader& header, const vector<uint32_t>& tileSamples,
+                      const float* rgb, size_t numFloats) {
+  auto start = chrono::steady_clock::now();
+  string tempFname = fname + ".tmp";
+  FILE* file = fopen(tempFname.c_str(), "wb");
+  bool ok = file and
+    fwrite(&header, sizeof(header), 1, file) == 1 and
+    fwrite(tileSamples.data(), sizeof(uint32_t), tileSamples.size(), file) == tileSamples.size() and
+    fwrite(rgb, sizeof(float), numFloats, file) == numFloats and
+    fflush(file) == 0 and fsync(fileno(file)) == 0;
+  ok = file and fclose(file) == 0 and ok;
+  ok = ok and rename(tempFname.c_str(), fname.c_str()) == 0;
+  if (!ok) {
+    cerr << "Unable to write checkpoint " << fname << "\n";
+    ::remove(tempFname.c_str());
+  }
+
+  double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+  saves++;
+  saveSeconds += seconds;
+  // Further apart if writing is slow, to keep the overhead down
+  double wait = max(interval, seconds * CHECKPOINT_MAX_OVERHEAD);
+  nextDue = nowNanoseconds() + (int64_t) (wait * 1e9);
+  return ok;
+}
+
+bool Checkpoint::load(const CheckpointHeader& header, vector<uint32_t>& tileSamples,
+                      float* rgb, size_t numFloats) {
+  if (!resume) return false;
+  FILE* file = fopen(fname.c_str(), "rb");
+  if (!file) {
+    cout << "No checkpoint " << fname << ", rendering from the start\n";
+    return false;
+  }
+  CheckpointHeader saved;
+  bool ok = fread(&saved, sizeof(saved), 1, file) == 1;
+  if (ok and memcmp(&saved, &header, sizeof(header)) != 0) {
+    cerr << "Checkpoint " << fname << " is of another render, rendering from the start\n";
+    fclose(file);
+    return false;
+  }
+  tileSamples.resize(header.numTiles);
+  ok = ok and fread(tileSamples.data(), sizeof(uint32_t), header.numTiles, file) == header.numTiles and
+    fread(rgb, sizeof(float), numFloats, file) == numFloats;
+  fclose(file);
+  if (!ok) {
+    cerr << "Checkpoint " << fname << " is truncated, rendering from the start\n";
+    tileSamples.assign(header.numTiles, 0);
+    return false;
+  }
+  return true;
+}
+
+void Checkpoint::remove() {
+  ::remove(fname.c_str());
+}
+
+void Checkpoint::report(ostream& out, double renderSeconds) {
+  out << "Checkpoints: " << saves << " written in " << saveSeconds * 1e3 << " ms, "
+      << 100 * saveSeconds / max(renderSeconds, 1e-9) << "% of the render\n";
+}
@@ -0,0 +1,100 @@
+#ifndef CHECKPOINT_H_
+#define CHECKPOINT_H_
+
+// Progress of a render saved to disk, so it can resume after the process is killed
+
+#include <string>
+#include <vector>
+#include <atomic>
+#include <cstdint>
+#include <iostream>
+
+using std::string, std::vector, std::ostream;
+
+#define CHECKPOINT_MAGIC "NRTCKPT"
+#define CHECKPOINT_VERSION 1
+// Checkpoints are spaced so that writing them takes at most 1/CHECKPOINT_MAX_OVERHEAD
+// of the render, however slow the disk
+#define CHECKPOINT_MAX_OVERHEAD 50
+
+/**
+ * Start of a checkpoint file, identifying the render it belongs to.
+ * It is followed by the samples of every tile of the part of the frame
+ * rendered, 0 for tiles not finished, then its framebuffer as float RGB,
+ * in the byte order of the machine.
+ *
+ */
+struct CheckpointHeader {
+        char magic[8];
+        uint32_t version;
+        int32_t frameWidth, frameHeight;
+        int32_t partX, partY, partWidth, partHeight;
+        int32_t firstTile, lastTile;
+        uint32_t numTiles;
+        uint64_t sceneHash; // Of the scene, so another one is not resumed
+};
+
+/**
+ * Checkpoint file of a render, written every so often while it runs
+ * and read back to resume it
+ *
+ */
+class Checkpoint {
+  public:
+        /**
+        * @param fname - Name of the checkpoint file
+        * @param interval - Seconds between checkpoints
+        * @param resume - Whether to continue from the file if it exists
+        */
+        Checkpoint(const string& fname, double interval, bool resume);
+        /**
+        * Whether it is time for the next checkpoint. Several threads may
+        * ask, only one of them is told yes.
+        *
+        */
+        bool due();
+        /**
+        * Write the checkpoint to a temporary file, then rename it over the
+        * previous one, so a kill at any point leaves a whole checkpoint
+        *
+        * @param header - Render the checkpoint is of
+        * @param tileSamples - Samples of every tile, 0 for tiles not finished
+        * @param rgb - Framebuffer, only read for finished tiles
+        * @param numFloats - Floats in the framebuffer
+        * @return false on a write error
+        */
+        bool save(const CheckpointHeader& header, const vector<uint32_t>& tileSamples,
+                  const float* rgb, size_t numFloats);
+        /**
+        * Read the checkpoint back, if resuming and it is of the same render
+        *
+        * @param header - Render to resume
+        * @param tileSamples - Set to the samples of every tile
+        * @param rgb - Framebuffer to fill
+        * @param numFloats - Floats in the framebuffer
+        * @return false if there is nothing to resume
+        */
+        bool load(const CheckpointHeader& header, vector<uint32_t>& tileSamples,
+                  float* rgb, size_t numFloats);
+        /**
+        * Delete the checkpoint once the image is written
+        *
+        */
+        void remove();
+        /**
+        * Print how many checkpoints were written and what they cost
+        *
+        * @param renderSeconds - Time the render took
+        */
+        void report(ostream& out, double renderSeconds);
+
+  private:
+        string fname;
+        double interval;
+        bool resume;
+        std::atomic<int64_t> nextDue; // Steady clock nanoseconds
+        int saves = 0;
+        double saveSeconds = 0;
+};
+
+#endif // CHECKPOINT_H_
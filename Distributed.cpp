@@ -0,0 +1,643 @@
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <stack>
+#include <chrono>
+#include <cstring>
+#include <climits>
+#include <cerrno>
+#include <csignal>
+#include <cfloat>
+
+#include <unistd.h>
+#include <poll.h>
+#include <netdb.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "Distributed.h"
+
+using namespace std;
+#include "readfile.h"
+
+// Seconds without any connected worker before the coordinator
+// starts rendering the remaining tiles itself
+#define WORKER_TIMEOUT 5
+// Tiles kept in flight per worker so it never waits on the coordinator
+#define TILES_PER_WORKER 2
+
+// Message types exchanged between coordinator and workers.
+// Every message is a (type, payload length) header followed by the payload.
+enum MessageType : uint32_t {
+  MSG_SCENE = 1,  // coordinator -> worker: path of the scene file
+  MSG_READY,      // worker -> coordinator: scene parsed
+  MSG_TILE,       // coordinator -> worker: Tile to render
+  MSG_RESULT,     // worker -> coordinator: tile id followed by RGB floats
+  MSG_DONE,       // coordinator -> worker: no more tiles, exit
+  MSG_PARTITION,  // coordinator -> worker: Partition followed by the scene path
+  MSG_RAYS,       // coordinator -> worker: RayQuery list, closest hit wanted
+  MSG_HITS,       // worker -> coordinator: RayHit for every ray
+  MSG_OCCLUSION,  // coordinator -> worker: RayQuery list, any hit wanted
+  MSG_OCCLUDED    // worker -> coordinator: one byte per ray, 1 if blocked
+};
+
+// Slab of space whose objects a worker keeps in sort-last mode
+struct Partition {
+  int axis;
+  float lo, hi;
+};
+
+static bool writeAll(int fd, const void* data, size_t len) {
+  const char* p = (const char*) data;
+  while (len > 0) {
+    ssize_t n = write(fd, p, len);
+    if (n < 0 and errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n; len -= n;
+  }
+  return true;
+}
+
+static bool readAll(int fd, void* data, size_t len) {
+  char* p = (char*) data;
+  while (len > 0) {
+    ssize_t n = read(fd, p, len);
+    if (n < 0 and errno == EINTR) continue;
+    if (n <= 0) return false;
+    p += n; len -= n;
+  }
+  return true;
+}
+
+static bool sendMessage(int fd, uint32_t type, const void* payload, uint32_t len) {
+  uint32_t header[2] = {type, len};
+  return writeAll(fd, header, sizeof(header)) and
+    (len == 0 or writeAll(fd, payload, len));
+}
+
+// Fails without reading the payload if it is longer than maxLength,
+// so a peer cannot make us allocate what it likes
+static bool receiveMessage(int fd, uint32_t& type, vector<char>& payload,
+                           size_t maxLength) {
+  uint32_t header[2];
+  if (!readAll(fd, header, sizeof(header)) or header[1] > maxLength) return false;
+  type = header[0];
+  payload.resize(header[1]);
+  return header[1] == 0 or readAll(fd, payload.data(), header[1]);
+}
+
+static bool isUnixAddress(const string& address) {
+  return address.find('/') != string::npos;
+}
+
+// Split host:port and resolve it for a TCP socket
+static addrinfo* resolveAddress(const string& address, bool passive) {
+  size_t colon = address.rfind(':');
+  string host = colon == string::npos ? "localhost" : address.substr(0, colon);
+  string port = colon == string::npos ? address : address.substr(colon+1);
+  addrinfo hints, *result = nullptr;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  if (passive) hints.ai_flags = AI_PASSIVE;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &result) != 0) return nullptr;
+  return result;
+}
+
+static int listenOn(const string& address) {
+  int fd = -1;
+  if (isUnixAddress(address)) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path)-1);
+    unlink(address.c_str());
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 or bind(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+      if (fd >= 0) close(fd);
+      return -1;
+    }
+  } else {
+    addrinfo* info = resolveAddress(address, true);
+    if (!info) return -1;
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    int reuse = 1;
+    if (fd >= 0) setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (fd < 0 or bind(fd, info->ai_addr, info->ai_addrlen) < 0) {
+      if (fd >= 0) close(fd);
+      freeaddrinfo(info);
+      return -1;
+    }
+    freeaddrinfo(info);
+  }
+  if (listen(fd, 64) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+static int connectTo(const string& address) {
+  int fd = -1;
+  if (isUnixAddress(address)) {
+    sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, address.c_str(), sizeof(addr.sun_path)-1);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd >= 0 and connect(fd, (sockaddr*) &addr, sizeof(addr)) < 0) {
+      close(fd);
+      fd = -1;
+    }
+  } else {
+    addrinfo* info = resolveAddress(address, false);
+    if (!info) return -1;
+    fd = socket(info->ai_family, info->ai_socktype, info->ai_protocol);
+    if (fd >= 0 and connect(fd, info->ai_addr, info->ai_addrlen) < 0) {
+      close(fd);
+      fd = -1;
+    }
+    freeaddrinfo(info);
+  }
+  return fd;
+}
+
+RenderCoordinator::RenderCoordinator(string address, int numLocalWorkers,
+                                     int tileSize, int numPartitions) :
+  address(address), listenFd(-1), numLocalWorkers(numLocalWorkers),
+  tileSize(tileSize), tilesDone(0), numPartitions(numPartitions),
+  bytesExchanged(0) {
+  if (RenderCoordinator::address.empty())
+    RenderCoordinator::address = "/tmp/nanoraytracer-" + to_string(getpid()) + ".sock";
+}
+
+RenderCoordinator::~RenderCoordinator() {
+  for (auto& w : workers) close(w.fd);
+  if (listenFd >= 0) {
+    close(listenFd);
+    if (isUnixAddress(address)) unlink(address.c_str());
+  }
+  for (int pid : childPids) waitpid(pid, nullptr, 0);
+}
+
+void RenderCoordinator::spawnLocalWorkers() {
+  for (int i = 0; i < numLocalWorkers; i++) {
+    pid_t pid = fork();
+    if (pid == 0) {
+      execl("/proc/self/exe", "nanoraytracer", "--worker", address.c_str(),
+            (char*) nullptr);
+      cerr << "Unable to start worker: " << strerror(errno) << "\n";
+      _exit(127);
+    } else if (pid > 0) {
+      childPids.push_back(pid);
+    } else {
+      cerr << "Unable to fork worker: " << strerror(errno) << "\n";
+    }
+  }
+}
+
+void RenderCoordinator::acceptWorker() {
+  int fd = accept(listenFd, nullptr, nullptr);
+  if (fd < 0) return;
+  Worker worker = {fd, false, {}};
+  // Partitions are only handed out once every worker is connected
+  if (numPartitions > 0 or sendScene(worker)) workers.push_back(worker);
+  else close(fd);
+}
+
+bool RenderCoordinator::sendScene(Worker& worker) {
+  return sendMessage(worker.fd, MSG_SCENE, scenePath.data(), scenePath.size());
+}
+
+bool RenderCoordinator::assignTile(Worker& worker) {
+  if (pending.empty()) return true;
+  Tile tile = pending.front();
+  if (!sendMessage(worker.fd, MSG_TILE, &tile, sizeof(tile))) return false;
+  pending.pop_front();
+  worker.assigned.push_back(tile);
+  return true;
+}
+
+bool RenderCoordinator::receiveResult(Worker& worker, Raytracer& raytracer,
+                                      int height) {
+  uint32_t type;
+  vector<char> payload;
+  // Workers only send tile results, at most a full tile
+  if (!receiveMessage(worker.fd, type, payload,
+                      sizeof(int) + (size_t) tileSize*tileSize*sizeof(vec3))) return false;
+
+  if (type == MSG_READY) {
+    worker.ready = true;
+  } else if (type == MSG_RESULT and payload.size() >= sizeof(int)) {
+    int id;
+    memcpy(&id, payload.data(), sizeof(int));
+    for (size_t t = 0; t < worker.assigned.size(); t++) {
+      Tile tile = worker.assigned[t];
+      if (tile.id != id) continue;
+      size_t numPixels = (tile.x1-tile.x0) * (tile.y1-tile.y0);
+      if (payload.size() != sizeof(int) + numPixels*sizeof(vec3)) return false;
+      const char* pixel = payload.data() + sizeof(int);
+      for (int j = tile.y0; j < tile.y1; j++) {
+        for (int i = tile.x0; i < tile.x1; i++) {
+          vec3 color;
+          memcpy(&color, pixel, sizeof(vec3));
+          pixel += sizeof(vec3);
+          raytracer.setColor(color, i, j);
+        }
+      }
+      worker.assigned.erase(worker.assigned.begin() + t);
+      tilesDone++;
+      break;
+    }
+  } else {
+    return false;
+  }
+  return true;
+}
+
+void RenderCoordinator::assignPending() {
+  // Keep every worker busy, not only the ones that just replied: idle
+  // workers send nothing until they get tiles, e.g. lost by another one.
+  // Iterate backwards as dead workers are erased.
+  for (size_t k = workers.size(); k-- > 0;) {
+    Worker& worker = workers[k];
+    bool alive = true;
+    while (alive and worker.ready and worker.assigned.size() < TILES_PER_WORKER
+           and !pending.empty())
+      alive = assignTile(worker);
+    if (!alive) dropWorker(k);
+  }
+}
+
+void RenderCoordinator::dropWorker(size_t idx) {
+  Worker& worker = workers[idx];
+  if (!worker.assigned.empty())
+    cerr << "Worker lost, reassigning " << worker.assigned.size() << " tile(s)\n";
+  // Lost tiles go to the front of the queue so the image completes in order
+  for (auto it = worker.assigned.rbegin(); it != worker.assigned.rend(); it++)
+    pending.push_front(*it);
+  close(worker.fd);
+  workers.erase(workers.begin() + idx);
+}
+
+bool RenderCoordinator::render(const string& path, Scene& scene,
+                               Raytracer& raytracer) {
+  char resolved[PATH_MAX];
+  scenePath = realpath(path.c_str(), resolved) ? resolved : path;
+  // A worker dying mid-write should not kill the coordinator
+  signal(SIGPIPE, SIG_IGN);
+
+  listenFd = listenOn(address);
+  if (listenFd < 0) {
+    cerr << "Unable to listen on " << address << ": " << strerror(errno) << "\n";
+    return false;
+  }
+  spawnLocalWorkers();
+
+  if (numPartitions > 0) return renderPartitioned(scene, raytracer);
+  return renderTiles(scene, raytracer);
+}
+
+bool RenderCoordinator::renderTiles(Scene& scene, Raytracer& raytracer) {
+  int numTiles = 0;
+  for (int y = 0; y < scene.height; y += tileSize)
+    for (int x = 0; x < scene.width; x += tileSize)
+      pending.push_back({numTiles++, x, y, min(x+tileSize, scene.width),
+                         min(y+tileSize, scene.height)});
+  tilesDone = 0;
+
+  auto lastWorkerSeen = chrono::steady_clock::now();
+  while (tilesDone < numTiles) {
+    assignPending();
+    vector<pollfd> fds = {{listenFd, POLLIN, 0}};
+    for (auto& w : workers) fds.push_back({w.fd, POLLIN, 0});
+
+    bool renderLocally = workers.empty() and
+      chrono::steady_clock::now() - lastWorkerSeen > chrono::seconds(WORKER_TIMEOUT);
+    int ready = poll(fds.data(), fds.size(), renderLocally ? 0 : 1000);
+    if (ready < 0 and errno != EINTR) break;
+
+    if (fds[0].revents & POLLIN) acceptWorker();
+    // Iterate backwards as dead workers are erased
+    for (size_t k = fds.size()-1; k >= 1; k--) {
+      if (fds[k].revents == 0) continue;
+      if (!receiveResult(workers[k-1], raytracer, scene.height)) dropWorker(k-1);
+    }
+    // Tiles of lost workers go to the others at once
+    assignPending();
+
+    if (!workers.empty()) {
+      lastWorkerSeen = chrono::steady_clock::now();
+    } else if (renderLocally and !pending.empty()) {
+      // Nobody left to hand tiles to, render them here
+      raytracer.renderTile(scene, pending.front());
+      pending.pop_front();
+      tilesDone++;
+    }
+  }
+
+  for (auto& w : workers) sendMessage(w.fd, MSG_DONE, nullptr, 0);
+  return tilesDone == numTiles;
+}
+
+bool RenderCoordinator::broadcast(uint32_t type, const void* payload, size_t len) {
+  for (auto& w : workers) {
+    if (!sendMessage(w.fd, type, payload, len)) return false;
+    bytesExchanged += 2*sizeof(uint32_t) + len;
+  }
+  return true;
+}
+
+bool RenderCoordinator::receiveFrom(Worker& worker, uint32_t expectedType,
+                                    vector<char>& payload, size_t maxLength) {
+  uint32_t type;
+  if (!receiveMessage(worker.fd, type, payload, maxLength) or type != expectedType)
+    return false;
+  bytesExchanged += 2*sizeof(uint32_t) + payload.size();
+  return true;
+}
+
+bool RenderCoordinator::sendPartitions(Scene& scene) {
+  // Wait until there is a worker for every partition
+  auto lastWorkerSeen = chrono::steady_clock::now();
+  while ((int) workers.size() < numPartitions) {
+    pollfd fd = {listenFd, POLLIN, 0};
+    if (poll(&fd, 1, 1000) > 0) {
+      acceptWorker();
+      lastWorkerSeen = chrono::steady_clock::now();
+    } else if (chrono::steady_clock::now() - lastWorkerSeen >
+               chrono::seconds(WORKER_TIMEOUT)) {
+      cerr << "Only " << workers.size() << " of " << numPartitions
+           << " workers connected\n";
+      return false;
+    }
+  }
+
+  // Cut the bounds of the geometry into equal slabs along the longest axis
+  vec3 extent = scene.boundsMax - scene.boundsMin;
+  int axis = 0;
+  if (extent[1] > extent[axis]) axis = 1;
+  if (extent[2] > extent[axis]) axis = 2;
+  float slab = extent[axis] / numPartitions;
+  for (int p = 0; p < numPartitions; p++) {
+    Partition partition = {axis, scene.boundsMin[axis] + p*slab,
+                           scene.boundsMin[axis] + (p+1)*slab};
+    if (p == 0) partition.lo = -FLT_MAX;
+    if (p == numPartitions-1) partition.hi = FLT_MAX;
+    vector<char> payload(sizeof(partition) + scenePath.size());
+    memcpy(payload.data(), &partition, sizeof(partition));
+    memcpy(payload.data() + sizeof(partition), scenePath.data(), scenePath.size());
+    if (!sendMessage(workers[p].fd, MSG_PARTITION, payload.data(), payload.size()))
+      return false;
+  }
+  vector<char> payload;
+  for (auto& w : workers)
+    if (!receiveFrom(w, MSG_READY, payload, 0)) return false;
+  return true;
+}
+
+bool RenderCoordinator::traceClosest(const vector<RayQuery>& rays,
+                                     vector<RayHit>& hits) {
+  if (!broadcast(MSG_RAYS, rays.data(), rays.size()*sizeof(RayQuery)))
+    return false;
+  hits.assign(rays.size(), RayHit());
+  for (auto& hit : hits) hit.distance = -1;
+  // Depth compositing: keep the nearest hit over all partitions
+  vector<char> payload;
+  for (auto& w : workers) {
+    if (!receiveFrom(w, MSG_HITS, payload, rays.size()*sizeof(RayHit)) or
+        payload.size() != rays.size()*sizeof(RayHit)) return false;
+    const RayHit* partHits = (const RayHit*) payload.data();
+    for (size_t r = 0; r < rays.size(); r++) {
+      float d = partHits[r].distance;
+      if (d > 0 and (hits[r].distance < 0 or d < hits[r].distance))
+        hits[r] = partHits[r];
+    }
+  }
+  return true;
+}
+
+bool RenderCoordinator::traceOcclusion(const vector<RayQuery>& rays,
+                                       vector<char>& occluded) {
+  if (!broadcast(MSG_OCCLUSION, rays.data(), rays.size()*sizeof(RayQuery)))
+    return false;
+  occluded.assign(rays.size(), 0);
+  vector<char> payload;
+  for (auto& w : workers) {
+    if (!receiveFrom(w, MSG_OCCLUDED, payload, rays.size()) or payload.size() != rays.size())
+      return false;
+    for (size_t r = 0; r < rays.size(); r++) occluded[r] |= payload[r];
+  }
+  return true;
+}
+
+bool RenderCoordinator::renderPartitioned(Scene& scene, Raytracer& raytracer) {
+  if (!sendPartitions(scene)) return false;
+  bytesExchanged = 0;
+  int maxdepth = raytracer.getMaxDepth();
+  // Epsilon to slightly shift source towards destination,
+  // to avoid object intersecting with itself
+  float epsilon = 0.001;
+
+  for (int y0 = 0; y0 < scene.height; y0 += tileSize) {
+    for (int x0 = 0; x0 < scene.width; x0 += tileSize) {
+      int x1 = min(x0+tileSize, scene.width), y1 = min(y0+tileSize, scene.height);
+      int tileWidth = x1-x0;
+      vector<vec3> colors((x1-x0) * (y1-y0), vec3(0.));
+
+      // Rays still bouncing, the pixel they belong to
+      // and the weight of their contribution
+      vector<RayQuery> rays;
+      vector<int> pixels;
+      vector<vec3> weights;
+      // Filter weights of the samples of every pixel
+      vector<float> weightSums(colors.size(), 0);
+      for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+          for (int k = 0; k < raytracer.getSamplesPerPixel(); k++) {
+            float weight;
+            glm::vec2 sample = raytracer.samplePosition(i, j, k, weight);
+            if (weight == 0) continue;
+            rays.push_back({scene.eye, raytracer.rayCast(sample.x, sample.y, scene), Z_FAR,
+                            Raytracer::jitterSeed(i, j)});
+            pixels.push_back((j-y0)*tileWidth + (i-x0));
+            weights.push_back(vec3(weight));
+            weightSums[pixels.back()] += weight;
+          }
+        }
+      }
+
+      for (int depth = 0; depth < maxdepth and !rays.empty(); depth++) {
+        vector<RayHit> hits;
+        if (!traceClosest(rays, hits)) {
+          cerr << "Lost a worker, its partition cannot be recovered\n";
+          return false;
+        }
+
+        // Shadow rays towards every light from every hit
+        vector<RayQuery> shadowRays;
+        for (size_t r = 0; r < rays.size(); r++) {
+          if (hits[r].distance < 0) continue;
+          for (auto l : scene.lights) {
+            vec3 rayDirection = normalize(l->getLightPosition() - hits[r].point);
+            shadowRays.push_back({hits[r].point + epsilon*rayDirection, rayDirection,
+                                  l->getDistanceToLight(hits[r].point), rays[r].seed});
+          }
+        }
+        vector<char> occluded;
+        if (!traceOcclusion(shadowRays, occluded)) {
+          cerr << "Lost a worker, its partition cannot be recovered\n";
+          return false;
+        }
+
+        // Same shading and reflection as Raytracer::recursiveRayTrace
+        vector<RayQuery> reflectRays;
+        vector<int> reflectPixels;
+        vector<vec3> reflectWeights;
+        size_t shadowIdx = 0;
+        for (size_t r = 0; r < rays.size(); r++) {
+          const RayHit& hit = hits[r];
+          if (hit.distance < 0) continue;
+          const materialProperties& m = hit.material;
+          vec3 eye = rays[r].origin;
+          vec3 directionToEye = normalize(eye - hit.point);
+          vec3 color = m.ambient + m.emission;
+          for (auto l : scene.lights) {
+            if (!occluded[shadowIdx++])
+              color += l->computeLight(hit.point, directionToEye, m.diffuse,
+                                       m.specular, m.shininess, hit.normal);
+          }
+          colors[pixels[r]] += weights[r] * color;
+
+          vec3 weight = weights[r] * m.specular;
+          if (weight == vec3(0.)) continue;
+          vec3 directionFromEye = -directionToEye;
+          vec3 reflectDirection = directionFromEye -
+            (2.0f * hit.normal * dot(directionFromEye, hit.normal));
+          reflectRays.push_back({hit.point + epsilon*reflectDirection,
+                                 reflectDirection, Z_FAR, rays[r].seed});
+          reflectPixels.push_back(pixels[r]);
+          reflectWeights.push_back(weight);
+        }
+        rays.swap(reflectRays);
+        pixels.swap(reflectPixels);
+        weights.swap(reflectWeights);
+      }
+
+      for (int j = y0; j < y1; j++) {
+        for (int i = x0; i < x1; i++) {
+          int p = (j-y0)*tileWidth + (i-x0);
+          raytracer.setColor(weightSums[p] > 0 ? colors[p] / weightSums[p] : colors[p], i, j);
+        }
+      }
+    }
+  }
+
+  cout << "Sort-last render over " << numPartitions << " partitions: "
+       << bytesExchanged / (1024.0*1024.0) << " MB exchanged\n";
+  for (auto& w : workers) sendMessage(w.fd, MSG_DONE, nullptr, 0);
+  return true;
+}
+
+// Answer closest-hit and occlusion queries against one partition of the scene
+static int answerRayQueries(int fd, Scene& scene, Raytracer& raytracer) {
+  uint32_t type;
+  vector<char> payload, result;
+  // Batches of rays are as large as the coordinator makes them
+  while (receiveMessage(fd, type, payload, UINT32_MAX)) {
+    size_t numRays = payload.size() / sizeof(RayQuery);
+    const RayQuery* rays = (const RayQuery*) payload.data();
+    if (type == MSG_RAYS) {
+      result.resize(numRays * sizeof(RayHit));
+      RayHit* hits = (RayHit*) result.data();
+      for (size_t r = 0; r < numRays; r++) {
+        // Jittered as the pixel of the ray is in a local render
+        seedJitter(rays[r].seed);
+        auto hitResults = raytracer.hitTest(scene, rays[r].origin, rays[r].direction);
+        hits[r] = RayHit();
+        hits[r].distance = -1;
+        if (hitResults.first == -1) continue;
+        auto object = scene.sceneObjects[hitResults.first];
+        hits[r].distance = length(hitResults.second - rays[r].origin);
+        hits[r].point = hitResults.second;
+        hits[r].normal = object->getNorm(hitResults.second);
+        hits[r].material = object->getMaterialProperties();
+      }
+      type = MSG_HITS;
+    } else if (type == MSG_OCCLUSION) {
+      result.resize(numRays);
+      for (size_t r = 0; r < numRays; r++) {
+        seedJitter(rays[r].seed);
+        result[r] = raytracer.isOccluded(scene, rays[r].origin, rays[r].direction,
+                                         rays[r].maxDistance);
+      }
+      type = MSG_OCCLUDED;
+    } else {
+      break;
+    }
+    if (!sendMessage(fd, type, result.data(), result.size())) break;
+  }
+  close(fd);
+  return 0;
+}
+
+int runRenderWorker(const string& address) {
+  int fd = connectTo(address);
+  if (fd < 0) {
+    cerr << "Unable to connect to coordinator at " << address << "\n";
+    return -1;
+  }
+
+  uint32_t type;
+  vector<char> payload;
+  if (!receiveMessage(fd, type, payload, sizeof(Partition) + PATH_MAX) or (type != MSG_SCENE and
+      (type != MSG_PARTITION or payload.size() < sizeof(Partition)))) {
+    close(fd);
+    return -1;
+  }
+
+  Scene scene;
+  Raytracer raytracer;
+  string scenePath;
+  if (type == MSG_PARTITION) {
+    Partition partition;
+    memcpy(&partition, payload.data(), sizeof(partition));
+    scene.setPartition(partition.axis, partition.lo, partition.hi);
+    scenePath.assign(payload.begin() + sizeof(partition), payload.end());
+  } else {
+    scenePath.assign(payload.begin(), payload.end());
+  }
+  readfile(scenePath.c_str(), scene, raytracer);
+  scene.bvh = Bvh::build(scene.sceneObjects, Bvh::defaultCacheDir());
+  if (!sendMessage(fd, MSG_READY, nullptr, 0)) {
+    close(fd);
+    return -1;
+  }
+  if (type == MSG_PARTITION) return answerRayQueries(fd, scene, raytracer);
+
+  vector<char> result;
+  while (receiveMessage(fd, type, payload, sizeof(Tile)) and type == MSG_TILE
+         and payload.size() == sizeof(Tile)) {
+    Tile tile;
+    memcpy(&tile, payload.data(), sizeof(tile));
+    size_t numPixels = (tile.x1-tile.x0) * (tile.y1-tile.y0);
+    result.resize(sizeof(int) + numPixels*sizeof(vec3));
+    memcpy(result.data(), &tile.id, sizeof(int));
+    char* pixel = result.data() + sizeof(int);
+    // Rendered as the coordinator would, then sent back
+    raytracer.renderTile(scene, tile);
+    for (int j = tile.y0; j < tile.y1; j++) {
+      for (int i = tile.x0; i < tile.x1; i++) {
+        vec3 color = raytracer.getColor(i, j);
+        memcpy(pixel, &color, sizeof(vec3));
+        pixel += sizeof(vec3);
+      }
+    }
+    if (!sendMessage(fd, MSG_RESULT, result.data(), result.size())) break;
+  }
+  close(fd);
+  return 0;
+}
@@ -0,0 +1,124 @@
+#ifndef DISTRIBUTED_H_
+#define DISTRIBUTED_H_
+
+// Coordinator/worker modes for rendering in several processes:
+// sort-first (every worker holds the scene and renders whole tiles) and
+// sort-last (every worker holds a slab of the geometry and answers ray queries)
+
+#include <vector>
+#include <deque>
+#include <string>
+
+#include "Scene.h"
+#include "Raytracer.h"
+
+using std::vector, std::deque, std::string;
+
+/**
+ * Ray sent to the workers of a partitioned render
+ *
+ */
+struct RayQuery {
+        vec3 origin;
+        vec3 direction;
+        float maxDistance;
+        uint32_t seed; // Of the jitter of triangle edges, Raytracer::jitterSeed of its pixel
+};
+
+/**
+ * Closest hit of a ray within one partition of the geometry.
+ * distance is -1 if the ray misses everything in the partition.
+ *
+ */
+struct RayHit {
+        float distance;
+        vec3 point;
+        vec3 normal;
+        materialProperties material;
+};
+
+/**
+ * Parses the scene once, hands work out to worker processes over
+ * Unix domain or TCP sockets and assembles their results into the image.
+ *
+ * By default every worker loads the full scene and renders tiles.
+ * With partitions, every worker only keeps the objects whose centroid falls
+ * into its slab of space; the coordinator traces rays level by level,
+ * asks every worker for its closest hit, keeps the nearest one (depth
+ * compositing) and sends shadow rays as occlusion queries.
+ *
+ * Addresses containing a '/' are Unix socket paths, anything else
+ * is read as host:port.
+ *
+ */
+class RenderCoordinator {
+    public:
+        /**
+        * Initialize the coordinator
+        *
+        * @param address - Address to listen on for workers
+        * @param numLocalWorkers - Number of worker processes to spawn on this machine
+        * @param tileSize - Width and height of the tiles handed out
+        * @param numPartitions - Number of geometry partitions, 0 to give
+        * every worker the full scene
+        */
+        RenderCoordinator(string address, int numLocalWorkers, int tileSize=32,
+                          int numPartitions=0);
+        ~RenderCoordinator();
+        /**
+        * Render the scene with the connected workers.
+        * Tiles owned by a worker that disconnects are put back in the queue.
+        * If no worker is left, the remaining tiles are rendered locally.
+        *
+        * @param scenePath - Path of the scene file, sent to the workers
+        * @param scene - Scene parsed by the coordinator
+        * @param raytracer - Raytracer holding the output image
+        * @return true if every tile was rendered
+        */
+        bool render(const string& scenePath, Scene& scene, Raytracer& raytracer);
+
+    private:
+        struct Worker {
+                int fd;
+                bool ready;
+                vector<Tile> assigned;
+        };
+        void spawnLocalWorkers();
+        void acceptWorker();
+        bool sendScene(Worker& worker);
+        bool assignTile(Worker& worker);
+        bool receiveResult(Worker& worker, Raytracer& raytracer, int height);
+        void assignPending();
+        void dropWorker(size_t idx);
+        bool renderTiles(Scene& scene, Raytracer& raytracer);
+        bool renderPartitioned(Scene& scene, Raytracer& raytracer);
+        bool sendPartitions(Scene& scene);
+        bool traceClosest(const vector<RayQuery>& rays, vector<RayHit>& hits);
+        bool traceOcclusion(const vector<RayQuery>& rays, vector<char>& occluded);
+        bool broadcast(uint32_t type, const void* payload, size_t len);
+        bool receiveFrom(Worker& worker, uint32_t expectedType, vector<char>& payload,
+                         size_t maxLength);
+
+        string address;
+        string scenePath;
+        int listenFd;
+        int numLocalWorkers;
+        int tileSize;
+        vector<int> childPids;
+        vector<Worker> workers;
+        deque<Tile> pending;
+        int tilesDone;
+        int numPartitions;
+        size_t bytesExchanged;
+};
+
+/**
+ * Connect to a coordinator and render tiles or answer ray queries
+ * until told to stop
+ *
+ * @param address - Address the coordinator is listening on
+ * @return Process exit status
+ */
+int runRenderWorker(const string& address);
+
+#endif // DISTRIBUTED_H_
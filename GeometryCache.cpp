@@ -0,0 +1,34 @@
+#include "GeometryCache.h"
+
+shared_ptr<GeometryCache::Block> GeometryCache::find(uint64_t key) {
+  auto it = blocks.find(key);
+  if (it == blocks.end()) {
+    misses++;
+    return nullptr;
+  }
+  hits++;
+  it->second->lastUsed = job;
+  return it->second;
+}
+
+void GeometryCache::insert(uint64_t key, shared_ptr<Block> block) {
+  block->lastUsed = job;
+  blocks[key] = block;
+}
+
+void GeometryCache::nextJob() {
+  for (auto it = blocks.begin(); it != blocks.end(); ) {
+    if (it->second->lastUsed < job) it = blocks.erase(it);
+    else it++;
+  }
+  job++;
+}
+
+uint64_t GeometryCache::hash(const void* data, size_t len, uint64_t seed) {
+  const unsigned char* p = (const unsigned char*) data;
+  for (size_t i = 0; i < len; i++) {
+    seed ^= p[i];
+    seed *= 1099511628211ull;
+  }
+  return seed;
+}
@@ -0,0 +1,67 @@
+#ifndef GEOMETRYCACHE_H_
+#define GEOMETRYCACHE_H_
+
+// Cache of parsed geometry shared between the scenes of a batch
+
+#include <vector>
+#include <memory>
+#include <unordered_map>
+#include <cstdint>
+#include "SceneObjects.h"
+#include "Mesh.h"
+
+using std::vector, std::shared_ptr, std::unordered_map;
+
+/**
+ * Objects and vertices made from a run of vertex/tri lines.
+ * Blocks are keyed by a hash of their text together with the
+ * vertices, material and transform they were parsed with, so a block
+ * found in the cache yields exactly what parsing it would.
+ * The geometry of define blocks is cached by their text alone.
+ *
+ */
+class GeometryCache {
+  public:
+        struct Block {
+                vector<vec3> vertices;
+                vector<shared_ptr<SceneObject>> objects;
+                shared_ptr<Mesh> mesh; // Of a define block instead
+                long lastUsed;
+        };
+        /**
+        * Look up a block, counting the hit or miss
+        *
+        * @param key - Hash of the block
+        * @return The block, or nullptr if it is not cached
+        */
+        shared_ptr<Block> find(uint64_t key);
+        /**
+        * Add a block parsed by the current job
+        *
+        * @param key - Hash of the block
+        * @param block - Vertices and objects parsed from it
+        */
+        void insert(uint64_t key, shared_ptr<Block> block);
+        /**
+        * Move on to the next job, dropping the blocks the
+        * finished job did not use so memory stays bounded.
+        *
+        */
+        void nextJob();
+        /**
+        * 64-bit FNV-1a hash
+        *
+        * @param data - Bytes to hash
+        * @param len - Number of bytes
+        * @param seed - Hash to continue from
+        */
+        static uint64_t hash(const void* data, size_t len,
+                             uint64_t seed = 14695981039346656037ull);
+
+        size_t hits = 0, misses = 0;
+  private:
+        unordered_map<uint64_t, shared_ptr<Block>> blocks;
+        long job = 0;
+};
+
+#endif // GEOMETRYCACHE_H_
@@ -0,0 +1,175 @@
+#include <iostream>
+#include <cstring>
+#include <cstdio>
+#include <cstdlib>
+#include <climits>
+#include <zlib.h>
+#include "ImageReader.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+static uint32_t getBigEndian(const uint8_t* p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static bool invalidImage(const string& fname, const char* reason) {
+  cerr << "Unable to read image " << fname << ": " << reason << "\n";
+  return false;
+}
+
+// Undo the filter of a scanline, given the one above it
+static void unfilter(int type, uint8_t* row, const uint8_t* above, size_t n) {
+  const int bpp = 3;
+  for (size_t i = 0; i < n; i++) {
+    int a = i >= bpp ? row[i-bpp] : 0, b = above[i], c = i >= bpp ? above[i-bpp] : 0;
+    int predicted = 0;
+    if (type == 1) predicted = a;
+    else if (type == 2) predicted = b;
+    else if (type == 3) predicted = (a + b) / 2;
+    else if (type == 4) {
+      int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+      predicted = pa <= pb and pa <= pc ? a : pb <= pc ? b : c;
+    }
+    row[i] += predicted;
+  }
+}
+
+static bool readPng(const string& fname, const uint8_t* data, size_t size, ImageData& image) {
+  image.region = {0, 0, 0, 0, 0, INT_MAX, 0};
+  bool partial = false;
+  vector<uint8_t> compressed;
+  size_t pos = 8;
+  while (pos + 12 <= size) {
+    uint32_t len = getBigEndian(data + pos);
+    const char* type = (const char*) data + pos + 4;
+    const uint8_t* chunk = data + pos + 8;
+    if (len > size - pos - 12) return invalidImage(fname, "truncated chunk");
+    if (!memcmp(type, "IHDR", 4)) {
+      if (len < 13) return invalidImage(fname, "bad header");
+      image.width = getBigEndian(chunk);
+      image.height = getBigEndian(chunk + 4);
+      if (chunk[8] != 8 or chunk[9] != 2 or chunk[12] != 0)
+        return invalidImage(fname, "only 8 bit RGB without interlacing is read");
+    } else if (!memcmp(type, "IDAT", 4)) {
+      compressed.insert(compressed.end(), chunk, chunk + len);
+    } else if (!memcmp(type, "tEXt", 4)) {
+      string text((const char*) chunk, len);
+      size_t keyword = strlen(PNG_REGION_KEYWORD);
+      if (text.size() > keyword and text.compare(0, keyword + 1, string(PNG_REGION_KEYWORD) + '\0') == 0) {
+        ImageRegion& r = image.region;
+        if (sscanf(text.c_str() + keyword + 1, "%d %d %d %d %d %d %d", &r.x, &r.y,
+                   &r.frameWidth, &r.frameHeight, &r.firstTile, &r.lastTile, &r.tileSize) != 7)
+          return invalidImage(fname, "bad region");
+        partial = true;
+      }
+    } else if (!memcmp(type, "IEND", 4)) {
+      break;
+    }
+    pos += 12 + len;
+  }
+  if (image.width <= 0 or image.height <= 0) return invalidImage(fname, "no image header");
+
+  size_t stride = (size_t) image.width * 3;
+  vector<uint8_t> raw(image.height * (stride + 1));
+  uLongf rawSize = raw.size();
+  if (uncompress(raw.data(), &rawSize, compressed.data(), compressed.size()) != Z_OK or
+      rawSize != raw.size())
+    return invalidImage(fname, "bad image data");
+  image.rgb.resize(stride * image.height);
+  vector<uint8_t> zeros(stride, 0);
+  for (int y = 0; y < image.height; y++) {
+    uint8_t* row = &raw[y * (stride + 1)];
+    if (row[0] > 4) return invalidImage(fname, "bad filter");
+    unfilter(row[0], row + 1, y > 0 ? row - stride : zeros.data(), stride);
+    // Halfway between levels, so converting back to bytes gives the same values
+    for (size_t i = 0; i < stride; i++)
+      image.rgb[y*stride + i] = (row[1 + i] + 0.5f) / 255.0f;
+  }
+  if (!partial) image.region = {0, 0, image.width, image.height, 0, INT_MAX, 0};
+  return true;
+}
+
+static bool readExr(const string& fname, const uint8_t* data, size_t size, ImageData& image) {
+  int32_t dataWindow[4] = {0, 0, -1, -1}, displayWindow[4] = {0, 0, -1, -1};
+  int32_t tiles[3] = {0, INT_MAX, 0};
+  vector<string> channels;
+  // Attributes: name, type, size, value, until an empty name
+  size_t pos = 8;
+  while (pos < size and data[pos] != 0) {
+    const char* name = (const char*) data + pos;
+    size_t nameEnd = pos + strnlen(name, size - pos);
+    if (nameEnd + 1 >= size) return invalidImage(fname, "truncated header");
+    const char* type = (const char*) data + nameEnd + 1;
+    size_t typeEnd = nameEnd + 1 + strnlen(type, size - nameEnd - 1);
+    if (typeEnd + 5 > size) return invalidImage(fname, "truncated header");
+    int32_t len;
+    memcpy(&len, data + typeEnd + 1, 4);
+    const uint8_t* value = data + typeEnd + 5;
+    if (len < 0 or (size_t) len > size - typeEnd - 5) return invalidImage(fname, "truncated header");
+
+    string attribute = name;
+    if (attribute == "channels") {
+      for (const uint8_t* p = value; p < value + len and *p; p += strlen((const char*) p) + 17) {
+        int32_t pixelType;
+        memcpy(&pixelType, p + strlen((const char*) p) + 1, 4);
+        if (pixelType != 2) return invalidImage(fname, "only float channels are read");
+        channels.push_back((const char*) p);
+      }
+    } else if (attribute == "compression" and len == 1) {
+      if (value[0] != 0) return invalidImage(fname, "only uncompressed files are read");
+    } else if (attribute == "dataWindow" and len == 16) {
+      memcpy(dataWindow, value, 16);
+    } else if (attribute == "displayWindow" and len == 16) {
+      memcpy(displayWindow, value, 16);
+    } else if (attribute == EXR_TILES_ATTRIBUTE and len == 12) {
+      memcpy(tiles, value, 12);
+    }
+    pos = typeEnd + 5 + len;
+  }
+  pos++;
+  if (channels != vector<string>{"B", "G", "R"}) return invalidImage(fname, "channels are not B, G, R");
+
+  image.width = dataWindow[2] - dataWindow[0] + 1;
+  image.height = dataWindow[3] - dataWindow[1] + 1;
+  if (image.width <= 0 or image.height <= 0) return invalidImage(fname, "empty data window");
+  image.region = {dataWindow[0] - displayWindow[0], dataWindow[1] - displayWindow[1],
+                  displayWindow[2] - displayWindow[0] + 1, displayWindow[3] - displayWindow[1] + 1,
+                  tiles[0], tiles[1], tiles[2]};
+  if (pos + (size_t) image.height * 8 > size) return invalidImage(fname, "truncated offsets");
+
+  // Scanlines: y, size, then B, G and R of every pixel in turn
+  size_t lineBytes = (size_t) image.width * 3 * sizeof(float);
+  image.rgb.resize((size_t) image.width * image.height * 3);
+  for (int k = 0; k < image.height; k++) {
+    uint64_t offset;
+    memcpy(&offset, data + pos + 8*k, 8);
+    int32_t line[2];
+    if (offset > size or size - offset < 8 + lineBytes) return invalidImage(fname, "truncated scanline");
+    memcpy(line, data + offset, 8);
+    int y = line[0] - dataWindow[1];
+    if (y < 0 or y >= image.height or (size_t) line[1] != lineBytes)
+      return invalidImage(fname, "bad scanline");
+    const uint8_t* planar = data + offset + 8;
+    float* out = &image.rgb[(size_t) y * image.width * 3];
+    for (int c = 0; c < 3; c++) {
+      for (int i = 0; i < image.width; i++)
+        memcpy(&out[3*i + 2-c], planar + ((size_t) c*image.width + i) * sizeof(float), sizeof(float));
+    }
+  }
+  return true;
+}
+
+bool readImage(const string& fname, ImageData& image) {
+  MappedFile file;
+  if (!file.open(fname)) return invalidImage(fname, "cannot open it");
+  const uint8_t* data = (const uint8_t*) file.data();
+  const uint8_t pngSignature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  const uint8_t exrMagic[4] = {0x76, 0x2f, 0x31, 0x01};
+  image = ImageData();
+  if (file.size() >= 8 and !memcmp(data, pngSignature, 8))
+    return readPng(fname, data, file.size(), image);
+  if (file.size() >= 8 and !memcmp(data, exrMagic, 4))
+    return readExr(fname, data, file.size(), image);
+  return invalidImage(fname, "not a PNG or OpenEXR file");
+}
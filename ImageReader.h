@@ -0,0 +1,37 @@
+#ifndef IMAGEREADER_H_
+#define IMAGEREADER_H_
+
+// Reading back the images ImageWriter writes, to merge partial images
+
+#include <string>
+#include <vector>
+
+#include "ImageWriter.h"
+
+using std::string, std::vector;
+
+/**
+ * Image read from a file, as linear float RGB rows from the top
+ *
+ */
+struct ImageData {
+        int width, height;
+        vector<float> rgb;
+        // Place in a larger frame; a whole image is a part covering its frame
+        ImageRegion region;
+};
+
+/**
+ * Read a PNG or OpenEXR file as ImageWriter writes them: 8 bit RGB PNG
+ * without interlacing, or single part uncompressed OpenEXR with float
+ * R, G and B channels. Without a region in the file, the image is its
+ * whole frame.
+ * Prints the reason on cerr if the file cannot be read.
+ *
+ * @param fname - Name of the file
+ * @param image - Image read
+ * @return false if the file cannot be read
+ */
+bool readImage(const string& fname, ImageData& image);
+
+#endif // IMAGEREADER_H_
@@ -0,0 +1,518 @@
+#include <iostream>
+#include <cstring>
+#include <algorithm>
+#include <thread>
+#include <chrono>
+#include <functional>
+#include <sys/stat.h>
+#include "ImageWriter.h"
+
+// Filtered rows deflated together, by a thread of their own
+#define PNG_SEGMENT_SIZE (1 << 18)
+// Bytes a deflate stream can refer back to
+#define PNG_WINDOW_SIZE (1 << 15)
+
+static bool hasExtension(const string& fname, const char* extension) {
+  size_t dot = fname.rfind('.');
+  if (dot == string::npos) return false;
+  string ext = fname.substr(dot + 1);
+  transform(ext.begin(), ext.end(), ext.begin(), ::tolower);
+  return ext == extension;
+}
+
+static bool isPipe(const string& fname) {
+  struct stat info;
+  return stat(fname.c_str(), &info) == 0 and S_ISFIFO(info.st_mode);
+}
+
+static bool isLittleEndian() {
+  uint16_t one = 1;
+  return *(uint8_t*) &one == 1;
+}
+
+unique_ptr<ImageWriter> ImageWriter::create(const string& fname) {
+  if (fname == "-" or hasExtension(fname, "raw") or isPipe(fname))
+    return unique_ptr<ImageWriter>(new RawWriter());
+  if (hasExtension(fname, "pfm")) return unique_ptr<ImageWriter>(new PfmWriter());
+  if (hasExtension(fname, "exr")) return unique_ptr<ImageWriter>(new ExrWriter());
+  if (hasExtension(fname, "qoi")) return unique_ptr<ImageWriter>(new QoiWriter());
+  FREE_IMAGE_FORMAT format = FreeImage_GetFIFFromFilename(fname.c_str());
+  // Unknown extensions were always written as PNG
+  if (format == FIF_PNG or format == FIF_UNKNOWN)
+    return unique_ptr<ImageWriter>(new PngWriter());
+  return unique_ptr<ImageWriter>(new FreeImageWriter());
+}
+
+bool ImageWriter::isStream(const string& fname) {
+  return fname == "-" or isPipe(fname);
+}
+
+void ImageWriter::toBytes(const float* __restrict in, size_t n, uint8_t* __restrict out) {
+  // A flat loop, which the compiler vectorizes
+  for (size_t k = 0; k < n; k++) {
+    float v = in[k] * 255.0f;
+    v = v > 0.0f ? v : 0.0f; // Also for NaN
+    v = v < 255.0f ? v : 255.0f;
+    out[k] = (uint8_t) v;
+  }
+}
+
+static void putBigEndian(uint8_t* p, uint32_t value) {
+  p[0] = value >> 24; p[1] = value >> 16; p[2] = value >> 8; p[3] = value;
+}
+
+int PngWriter::level = Z_DEFAULT_COMPRESSION;
+
+bool PngWriter::writeChunk(const char* type, const uint8_t* data, size_t len) {
+  uint8_t header[8], footer[4];
+  putBigEndian(header, len);
+  memcpy(header+4, type, 4);
+  uLong crc = crc32(0, header+4, 4);
+  if (len > 0) crc = crc32(crc, data, len);
+  putBigEndian(footer, crc);
+  return fwrite(header, 1, 8, file) == 8 and
+    (len == 0 or fwrite(data, 1, len, file) == len) and
+    fwrite(footer, 1, 4, file) == 4;
+}
+
+PngWriter::Segment PngWriter::deflateSegment(vector<uint8_t> input, vector<uint8_t> dictionary,
+                                             int level, bool last) {
+  Segment segment;
+  segment.adler = adler32(1, input.data(), input.size());
+  segment.length = input.size();
+  segment.last = last;
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+    return segment;
+  if (!dictionary.empty())
+    deflateSetDictionary(&stream, dictionary.data(), dictionary.size());
+  // Room for the sync flush marker on top of the bound
+  segment.data.resize(deflateBound(&stream, input.size()) + 16);
+  stream.next_in = input.data();
+  stream.avail_in = input.size();
+  stream.next_out = segment.data.data();
+  stream.avail_out = segment.data.size();
+  while (true) {
+    int status = deflate(&stream, last ? Z_FINISH : Z_SYNC_FLUSH);
+    if (status == Z_STREAM_ERROR) {
+      stream.total_out = 0;
+      break;
+    }
+    if (stream.avail_out == 0) {
+      size_t used = segment.data.size();
+      segment.data.resize(used * 2);
+      stream.next_out = segment.data.data() + used;
+      stream.avail_out = used;
+    } else if (last ? status == Z_STREAM_END : stream.avail_in == 0) {
+      break;
+    }
+  }
+  segment.data.resize(stream.total_out);
+  deflateEnd(&stream);
+  return segment;
+}
+
+bool PngWriter::open(const string& fname, int w, int h) {
+  file = fopen(fname.c_str(), "wb");
+  if (!file) return false;
+  width = w;
+  bytes = new uint8_t[width*3];
+  filtered.clear();
+  filtered.reserve(PNG_SEGMENT_SIZE + 1 + width*3);
+  dictionary.clear();
+  adler = adler32(0, nullptr, 0);
+  headerWritten = false;
+  maxSegments = std::max(1u, std::thread::hardware_concurrency());
+
+  const uint8_t signature[8] = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1a, '\n'};
+  uint8_t ihdr[13];
+  putBigEndian(ihdr, width);
+  putBigEndian(ihdr+4, h);
+  ihdr[8] = 8;   // bits per channel
+  ihdr[9] = 2;   // RGB
+  ihdr[10] = 0;  // deflate
+  ihdr[11] = 0;  // adaptive filtering
+  ihdr[12] = 0;  // no interlace
+  if (!(fwrite(signature, 1, 8, file) == 8 and writeChunk("IHDR", ihdr, 13))) return false;
+  if (!partial) return true;
+  // Offset in pixels, then everything needed to merge the part back
+  uint8_t offset[9];
+  putBigEndian(offset, region.x);
+  putBigEndian(offset+4, region.y);
+  offset[8] = 0;
+  string text = string(PNG_REGION_KEYWORD) + '\0' +
+    std::to_string(region.x) + " " + std::to_string(region.y) + " " +
+    std::to_string(region.frameWidth) + " " + std::to_string(region.frameHeight) + " " +
+    std::to_string(region.firstTile) + " " + std::to_string(region.lastTile) + " " +
+    std::to_string(region.tileSize);
+  return writeChunk("oFFs", offset, 9) and
+    writeChunk("tEXt", (const uint8_t*) text.data(), text.size());
+}
+
+void PngWriter::startSegment(bool last) {
+  vector<uint8_t> input;
+  input.swap(filtered);
+  filtered.reserve(input.capacity());
+  vector<uint8_t> primer = dictionary;
+  // The next segment may refer back to the end of this one
+  size_t keep = std::min(input.size(), (size_t) PNG_WINDOW_SIZE);
+  dictionary.assign(input.end() - keep, input.end());
+  if (last) {
+    // Nothing left to overlap with, compressed here
+    std::promise<Segment> done;
+    done.set_value(deflateSegment(std::move(input), std::move(primer), level, true));
+    segments.push_back(done.get_future());
+  } else {
+    segments.push_back(std::async(std::launch::async, deflateSegment,
+                                  std::move(input), std::move(primer), level, false));
+  }
+}
+
+bool PngWriter::writeSegment() {
+  Segment segment = segments.front().get();
+  segments.pop_front();
+  if (segment.data.empty()) return false;
+  if (!headerWritten) {
+    // zlib header: deflate with a 32K window, check bits for the level
+    uint8_t header[2] = {0x78, (uint8_t) (level == Z_DEFAULT_COMPRESSION ? 0x9c : 0x01)};
+    segment.data.insert(segment.data.begin(), header, header + 2);
+    headerWritten = true;
+  }
+  adler = adler32_combine(adler, segment.adler, segment.length);
+  if (segment.last) {
+    uint8_t trailer[4];
+    putBigEndian(trailer, adler);
+    segment.data.insert(segment.data.end(), trailer, trailer + 4);
+  }
+  return writeChunk("IDAT", segment.data.data(), segment.data.size());
+}
+
+bool PngWriter::writeRow(const float* row) {
+  const uint8_t* rgb = bytes;
+  toBytes(row, width*3, bytes);
+  // Sub filter: every byte is stored relative to the same channel
+  // of the previous pixel, which compresses smooth renders well
+  size_t start = filtered.size();
+  filtered.resize(start + 1 + width*3);
+  uint8_t* out = &filtered[start];
+  out[0] = 1;
+  for (int i = 0; i < width*3; i++)
+    out[1+i] = rgb[i] - (i >= 3 ? rgb[i-3] : 0);
+  if (filtered.size() < PNG_SEGMENT_SIZE) return true;
+  startSegment(false);
+  // Bounds the memory held, however large the image
+  if (segments.size() >= maxSegments) return writeSegment();
+  return true;
+}
+
+bool PngWriter::close() {
+  startSegment(true);
+  bool ok = true;
+  while (ok and !segments.empty()) ok = writeSegment();
+  ok = ok and writeChunk("IEND", nullptr, 0);
+  ok = fclose(file) == 0 and ok;
+  file = nullptr;
+  return ok;
+}
+
+PngWriter::~PngWriter() {
+  // Threads still compressing finish before their futures go
+  segments.clear();
+  if (file) fclose(file);
+  delete[] bytes;
+}
+
+bool QoiWriter::open(const string& fname, int w, int h) {
+  file = fopen(fname.c_str(), "wb");
+  if (!file) return false;
+  width = w;
+  bytes = new uint8_t[width*3];
+  encoded.reserve(width*4 + 8);
+  memset(index, 0, sizeof(index));
+  memset(previous, 0, sizeof(previous));
+  run = 0;
+
+  uint8_t header[14] = {'q', 'o', 'i', 'f'};
+  putBigEndian(header+4, width);
+  putBigEndian(header+8, h);
+  header[12] = 3; // RGB
+  header[13] = 0; // sRGB, the bytes PNG output gets too
+  return fwrite(header, 1, 14, file) == 14;
+}
+
+bool QoiWriter::writeRow(const float* rgb) {
+  toBytes(rgb, width*3, bytes);
+  encoded.clear();
+  for (int i = 0; i < width; i++) {
+    const uint8_t* p = bytes + 3*i;
+    if (p[0] == previous[0] and p[1] == previous[1] and p[2] == previous[2]) {
+      // Runs carry on over the end of a row
+      if (++run == 62) {
+        encoded.push_back(0xc0 | (run-1));
+        run = 0;
+      }
+      continue;
+    }
+    if (run > 0) {
+      encoded.push_back(0xc0 | (run-1));
+      run = 0;
+    }
+    // Alpha is always 255, but is hashed and compared like the others:
+    // the decoder starts with a table of (0, 0, 0, 0), which black must
+    // not match
+    int hash = (p[0]*3 + p[1]*5 + p[2]*7 + 255*11) % 64;
+    if (index[hash][0] == p[0] and index[hash][1] == p[1] and index[hash][2] == p[2]
+        and index[hash][3] == 255) {
+      encoded.push_back(hash);
+    } else {
+      memcpy(index[hash], p, 3);
+      index[hash][3] = 255;
+      int8_t dr = p[0] - previous[0], dg = p[1] - previous[1], db = p[2] - previous[2];
+      int drg = dr - dg, dbg = db - dg;
+      if (dr >= -2 and dr <= 1 and dg >= -2 and dg <= 1 and db >= -2 and db <= 1) {
+        encoded.push_back(0x40 | (dr+2) << 4 | (dg+2) << 2 | (db+2));
+      } else if (dg >= -32 and dg <= 31 and drg >= -8 and drg <= 7 and dbg >= -8 and dbg <= 7) {
+        encoded.push_back(0x80 | (dg+32));
+        encoded.push_back((drg+8) << 4 | (dbg+8));
+      } else {
+        encoded.insert(encoded.end(), {0xfe, p[0], p[1], p[2]});
+      }
+    }
+    memcpy(previous, p, 3);
+  }
+  return fwrite(encoded.data(), 1, encoded.size(), file) == encoded.size();
+}
+
+bool QoiWriter::close() {
+  const uint8_t end[8] = {0, 0, 0, 0, 0, 0, 0, 1};
+  bool ok = (run == 0 or fputc(0xc0 | (run-1), file) != EOF) and
+    fwrite(end, 1, 8, file) == 8;
+  ok = fclose(file) == 0 and ok;
+  file = nullptr;
+  return ok;
+}
+
+QoiWriter::~QoiWriter() {
+  if (file) fclose(file);
+  delete[] bytes;
+}
+
+bool FreeImageWriter::open(const string& outputFname, int width, int height) {
+  fname = outputFname;
+  format = FreeImage_GetFIFFromFilename(fname.c_str());
+  image = FreeImage_Allocate(width, height, 24);
+  row = 0;
+  return image != nullptr;
+}
+
+bool FreeImageWriter::writeRow(const float* rgb) {
+  // FreeImage stores the bottom row first, in BGR order on little endian machines
+  unsigned width = FreeImage_GetWidth(image);
+  BYTE* scanline = FreeImage_GetScanLine(image, FreeImage_GetHeight(image)-1-row);
+  toBytes(rgb, width*3, scanline);
+  if (FI_RGBA_RED != 0)
+    for (unsigned i = 0; i < width; i++) std::swap(scanline[3*i], scanline[3*i + 2]);
+  row++;
+  return true;
+}
+
+bool FreeImageWriter::close() {
+  return FreeImage_Save(format, image, fname.c_str(), 0);
+}
+
+FreeImageWriter::~FreeImageWriter() {
+  if (image) FreeImage_Unload(image);
+}
+
+bool RawWriter::open(const string& fname, int w, int h) {
+  width = w;
+  toStdout = fname == "-";
+  file = toStdout ? stdout : fopen(fname.c_str(), "wb");
+  return file != nullptr;
+}
+
+bool RawWriter::writeRow(const float* rgb) {
+  return fwrite(rgb, sizeof(float), width*3, file) == (size_t) width*3;
+}
+
+bool RawWriter::close() {
+  // Frames of a batch follow each other on standard output
+  bool ok = toStdout ? fflush(file) == 0 : fclose(file) == 0;
+  file = nullptr;
+  return ok;
+}
+
+RawWriter::~RawWriter() {
+  if (file and !toStdout) fclose(file);
+}
+
+bool PfmWriter::open(const string& fname, int w, int h) {
+  width = w;
+  height = h;
+  row = 0;
+  file = fname == "-" ? stdout : fopen(fname.c_str(), "wb");
+  if (!file) return false;
+  // A negative scale means little endian
+  if (fprintf(file, "PF\n%d %d\n%s\n", width, height, isLittleEndian() ? "-1.0" : "1.0") < 0)
+    return false;
+  dataStart = ftell(file);
+  seekable = dataStart >= 0 and fseek(file, dataStart, SEEK_SET) == 0;
+  if (!seekable) pending.resize((size_t) width*height*3);
+  return true;
+}
+
+bool PfmWriter::writeRow(const float* rgb) {
+  size_t rowFloats = (size_t) width*3;
+  int pfmRow = height-1-row;
+  row++;
+  if (!seekable) {
+    std::copy(rgb, rgb + rowFloats, pending.begin() + pfmRow*rowFloats);
+    return true;
+  }
+  return fseek(file, dataStart + (long) (pfmRow*rowFloats*sizeof(float)), SEEK_SET) == 0 and
+    fwrite(rgb, sizeof(float), rowFloats, file) == rowFloats;
+}
+
+bool PfmWriter::close() {
+  bool ok = seekable or
+    fwrite(pending.data(), sizeof(float), pending.size(), file) == pending.size();
+  ok = (file == stdout ? fflush(file) == 0 : fclose(file) == 0) and ok;
+  file = nullptr;
+  return ok;
+}
+
+PfmWriter::~PfmWriter() {
+  if (file and file != stdout) fclose(file);
+}
+
+// Attribute of an OpenEXR header, little endian
+static void putExrAttribute(string& header, const char* name, const char* type,
+                            const void* value, int32_t size) {
+  header.append(name, strlen(name) + 1);
+  header.append(type, strlen(type) + 1);
+  header.append((const char*) &size, 4);
+  header.append((const char*) value, size);
+}
+
+bool ExrWriter::open(const string& fname, int w, int h) {
+  // The format is little endian, so is every machine this is built for
+  if (!isLittleEndian()) return false;
+  width = w;
+  row = 0;
+  file = fopen(fname.c_str(), "wb");
+  if (!file) return false;
+
+  string header("\x76\x2f\x31\x01\x02\0\0\0", 8); // Magic, version 2, scanlines
+  // Channels in alphabetical order: name, FLOAT, linear, reserved, sampling
+  string channels;
+  for (const char* name : {"B", "G", "R"}) {
+    int32_t pixelType = 2, sampling = 1;
+    channels.append(name, 2);
+    channels.append((const char*) &pixelType, 4);
+    channels.append(4, '\0');
+    channels.append((const char*) &sampling, 4);
+    channels.append((const char*) &sampling, 4);
+  }
+  channels.push_back('\0');
+  putExrAttribute(header, "channels", "chlist", channels.data(), channels.size());
+  uint8_t none = 0;
+  putExrAttribute(header, "compression", "compression", &none, 1);
+  // A partial image is its part of the frame
+  if (!partial) region = {0, 0, w, h, 0, 0, 0};
+  int32_t dataWindow[4] = {region.x, region.y, region.x + w-1, region.y + h-1};
+  int32_t displayWindow[4] = {0, 0, region.frameWidth-1, region.frameHeight-1};
+  putExrAttribute(header, "dataWindow", "box2i", dataWindow, 16);
+  putExrAttribute(header, "displayWindow", "box2i", displayWindow, 16);
+  uint8_t increasingY = 0;
+  putExrAttribute(header, "lineOrder", "lineOrder", &increasingY, 1);
+  float one = 1, center[2] = {0, 0};
+  putExrAttribute(header, "pixelAspectRatio", "float", &one, 4);
+  putExrAttribute(header, "screenWindowCenter", "v2f", center, 8);
+  putExrAttribute(header, "screenWindowWidth", "float", &one, 4);
+  if (partial) {
+    int32_t tiles[3] = {region.firstTile, region.lastTile, region.tileSize};
+    putExrAttribute(header, EXR_TILES_ATTRIBUTE, "v3i", tiles, 12);
+  }
+  header.push_back('\0');
+
+  // Offsets of the scanlines, each of a fixed size when uncompressed
+  uint64_t lineSize = 8 + (uint64_t) w*3*sizeof(float);
+  uint64_t offset = header.size() + (uint64_t) h*sizeof(uint64_t);
+  vector<uint64_t> offsets(h);
+  for (int y = 0; y < h; y++) offsets[y] = offset + y*lineSize;
+  planar.resize((size_t) w*3);
+  return fwrite(header.data(), 1, header.size(), file) == header.size() and
+    fwrite(offsets.data(), sizeof(uint64_t), h, file) == (size_t) h;
+}
+
+bool ExrWriter::writeRow(const float* rgb) {
+  // Row in the frame and size, then every channel in turn
+  int32_t line[2] = {region.y + row++, (int32_t) (width*3*sizeof(float))};
+  for (int i = 0; i < width; i++) {
+    planar[i] = rgb[3*i + 2];
+    planar[width + i] = rgb[3*i + 1];
+    planar[2*width + i] = rgb[3*i];
+  }
+  return fwrite(line, sizeof(int32_t), 2, file) == 2 and
+    fwrite(planar.data(), sizeof(float), planar.size(), file) == planar.size();
+}
+
+bool ExrWriter::close() {
+  bool ok = fclose(file) == 0;
+  file = nullptr;
+  return ok;
+}
+
+ExrWriter::~ExrWriter() {
+  if (file) fclose(file);
+}
+
+bool benchmarkImageWriters(const float* rgb, int width, int height, const string& fname) {
+  struct Format {
+    string name, extension;
+    std::function<ImageWriter*()> make;
+    int pngLevel;
+  };
+  const Format formats[] = {
+    {"PNG", "png", [] {return new PngWriter();}, Z_DEFAULT_COMPRESSION},
+    {"PNG fast", "png", [] {return new PngWriter();}, Z_BEST_SPEED},
+    {"PNG stored", "png", [] {return new PngWriter();}, Z_NO_COMPRESSION},
+    {"PNG through FreeImage", "png", [] {return new FreeImageWriter();}, 0},
+    {"QOI", "qoi", [] {return new QoiWriter();}, 0},
+    {"PFM", "pfm", [] {return new PfmWriter();}, 0},
+    {"EXR", "exr", [] {return new ExrWriter();}, 0},
+    {"raw", "raw", [] {return new RawWriter();}, 0},
+  };
+  // Speeds are of the 8 bit image, whatever the format stores
+  double megabytes = (double) width*height*3 / 1e6;
+  int savedLevel = PngWriter::level;
+  bool ok = true;
+  for (const Format& format : formats) {
+    string testFname = fname + ".bench." + format.extension;
+    PngWriter::level = format.pngLevel;
+    // Best of a few runs
+    double best = 1e30;
+    bool written = true;
+    for (int run = 0; run < 3 and written; run++) {
+      unique_ptr<ImageWriter> writer(format.make());
+      auto start = std::chrono::steady_clock::now();
+      written = writer->open(testFname, width, height);
+      for (int j = 0; j < height and written; j++)
+        written = writer->writeRow(rgb + (size_t) j*width*3);
+      written = written and writer->close();
+      best = std::min(best, std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+    struct stat info;
+    if (written and stat(testFname.c_str(), &info) == 0) {
+      std::cout << format.name << ": " << best * 1e3 << " ms, " << megabytes / best << " MB/s, "
+                << info.st_size << " bytes\n";
+    } else {
+      std::cerr << format.name << ": unable to write " << testFname << "\n";
+      ok = false;
+    }
+    remove(testFname.c_str());
+  }
+  PngWriter::level = savedLevel;
+  return ok;
+}
@@ -0,0 +1,277 @@
+#ifndef IMAGEWRITER_H_
+#define IMAGEWRITER_H_
+
+// Writers that take an image one scanline at a time
+
+#include <string>
+#include <memory>
+#include <vector>
+#include <deque>
+#include <future>
+#include <cstdint>
+#include <cstdio>
+#include <zlib.h>
+#include <FreeImage.h>
+
+using std::string, std::unique_ptr, std::vector, std::deque;
+
+// Keyword of the PNG text chunk giving the region of a partial image
+#define PNG_REGION_KEYWORD "nanoraytracer region"
+// OpenEXR attribute giving the tiles of a partial image
+#define EXR_TILES_ATTRIBUTE "nanoraytracerTiles"
+
+/**
+ * Place of a partial image in the full frame, for frames rendered in parts
+ *
+ */
+struct ImageRegion {
+        int x, y; // Offset of the part, from the top left of the frame
+        int frameWidth, frameHeight;
+        // Tiles of tileSize pixels rendered, numbered in rows from the top of
+        // the frame; pixels of other tiles in the part are not part of it
+        int firstTile, lastTile, tileSize;
+};
+
+/**
+ * Abstract Base Class for image writers.
+ * Rows are linear float RGB, given in order from the top of the image.
+ *
+ */
+class ImageWriter {
+  public:
+        virtual ~ImageWriter() {}
+        /**
+        * Start writing an image
+        *
+        * @param fname - Name of output file
+        * @param width - Width of the image
+        * @param height - Height of the image
+        * @return false if the file could not be opened
+        */
+        virtual bool open(const string& fname, int width, int height) = 0;
+        /**
+        * Write the next scanline
+        *
+        * @param rgb - width*3 floats of RGB
+        * @return false on a write error
+        */
+        virtual bool writeRow(const float* rgb) = 0;
+        /**
+        * Finish the image and close the file
+        *
+        * @return false on a write error
+        */
+        virtual bool close() = 0;
+        /**
+        * Mark the image as part of a larger frame, before open
+        *
+        * @param part - Place of the image in the frame
+        */
+        void setRegion(const ImageRegion& part) {region = part; partial = true;}
+        /**
+        * Whether the format records the region of a partial image
+        *
+        */
+        virtual bool keepsRegion() {return false;}
+        /**
+        * Whether rows go to the file as they are written, instead of
+        * being held until the image is complete
+        *
+        */
+        virtual bool streamsRows() {return true;}
+        /**
+        * Create the writer suited to a file name.
+        * PNG, QOI, PFM, EXR and raw floats are streamed to disk as rows come in;
+        * other formats FreeImage knows are encoded by FreeImage once complete.
+        * A name of -, or of a named pipe, gets raw floats.
+        *
+        * @param fname - Name of output file
+        * @return The writer
+        */
+        static unique_ptr<ImageWriter> create(const string& fname);
+        /**
+        * Whether a file name is a stream, standard output (-) or a named
+        * pipe, whose images follow each other instead of replacing each other
+        *
+        */
+        static bool isStream(const string& fname);
+        /**
+        * Convert linear colours to 8 bits, clamped then truncated
+        *
+        * @param in - Floats to convert
+        * @param n - Number of floats
+        * @param out - n bytes
+        */
+        static void toBytes(const float* in, size_t n, uint8_t* out);
+
+  protected:
+        ImageRegion region;
+        bool partial = false;
+};
+
+/**
+ * Time every writer on an image and print their speed
+ *
+ * @param rgb - width*height*3 floats of RGB, rows from the top
+ * @param fname - Name the test files are derived from, removed afterwards
+ * @return false if a writer failed
+ */
+bool benchmarkImageWriters(const float* rgb, int width, int height, const string& fname);
+
+/**
+ * PNG writer compressing rows as they arrive. The rows are split into
+ * segments deflated in parallel by threads of their own, each primed
+ * with the end of the segment before it, and written as IDAT chunks of
+ * a single zlib stream. The region of a partial image goes in an oFFs
+ * chunk and a tEXt chunk with the keyword PNG_REGION_KEYWORD.
+ *
+ */
+class PngWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        bool keepsRegion() {return true;}
+        ~PngWriter();
+
+        // zlib level of every PNG written: Z_DEFAULT_COMPRESSION,
+        // Z_BEST_SPEED for fast, Z_NO_COMPRESSION for stored blocks
+        static int level;
+  private:
+        struct Segment {
+                vector<uint8_t> data;
+                uLong adler; // Of the uncompressed segment
+                size_t length; // Uncompressed
+                bool last; // Ends the stream
+        };
+        /**
+        * Deflate part of the zlib stream, as raw deflate ending on a byte
+        * boundary unless it is the last part
+        *
+        * @param input - Filtered rows
+        * @param dictionary - Data before them the output may refer to
+        * @param level - zlib level
+        * @param last - Whether this is the end of the stream
+        */
+        static Segment deflateSegment(vector<uint8_t> input, vector<uint8_t> dictionary,
+                                      int level, bool last);
+        bool writeChunk(const char* type, const uint8_t* data, size_t len);
+        /**
+        * Start compressing the rows given since the last segment
+        *
+        * @param last - Whether this is the end of the image
+        */
+        void startSegment(bool last);
+        /**
+        * Wait for the oldest segment and write it out
+        *
+        */
+        bool writeSegment();
+
+        FILE* file = nullptr;
+        int width;
+        uint8_t* bytes = nullptr;
+        vector<uint8_t> filtered; // Rows of the segment being gathered
+        vector<uint8_t> dictionary; // End of the previous segment
+        deque<std::future<Segment>> segments; // Being compressed, in order
+        uLong adler; // Of the image data written so far
+        bool headerWritten;
+        unsigned maxSegments; // Compressed at once
+};
+
+/**
+ * QOI writer, streaming every row as it arrives
+ *
+ */
+class QoiWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        ~QoiWriter();
+  private:
+        FILE* file = nullptr;
+        int width;
+        uint8_t* bytes = nullptr;
+        vector<uint8_t> encoded;
+        uint8_t index[64][4]; // RGBA colours seen, by hash, as the decoder keeps them
+        uint8_t previous[3];
+        int run;
+};
+
+/**
+ * Writer for the formats FreeImage supports, buffering the whole image
+ *
+ */
+class FreeImageWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        bool streamsRows() {return false;}
+        ~FreeImageWriter();
+  private:
+        FIBITMAP* image = nullptr;
+        FREE_IMAGE_FORMAT format;
+        string fname;
+        int row;
+};
+
+/**
+ * Headerless float32 RGB in the byte order of the machine, rows from the
+ * top. Never seeks, so it can go to standard output (-) or a named pipe.
+ *
+ */
+class RawWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        ~RawWriter();
+  private:
+        FILE* file = nullptr;
+        bool toStdout;
+        int width;
+};
+
+/**
+ * Portable float map (PF), in the byte order of the machine as the sign
+ * of its scale tells. Its rows go from the bottom
+ * of the image, so they are written in place, or kept until the end
+ * when the file cannot seek.
+ *
+ */
+class PfmWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        ~PfmWriter();
+  private:
+        FILE* file = nullptr;
+        int width, height, row;
+        long dataStart;
+        bool seekable;
+        vector<float> pending; // Rows of an unseekable file
+};
+
+/**
+ * Minimal OpenEXR writer: single part, uncompressed scanlines
+ * of 32-bit float B, G and R channels. A partial image has the frame
+ * as its display window and its tiles in a v3i EXR_TILES_ATTRIBUTE.
+ *
+ */
+class ExrWriter : public ImageWriter {
+  public:
+        bool open(const string& fname, int width, int height);
+        bool writeRow(const float* rgb);
+        bool close();
+        bool keepsRegion() {return true;}
+        ~ExrWriter();
+  private:
+        FILE* file = nullptr;
+        int width, row;
+        vector<float> planar;
+};
+
+#endif // IMAGEWRITER_H_
@@ -0,0 +1,41 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include "MappedFile.h"
+
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open(const string& fname) {
+  close();
+  int fd = ::open(fname.c_str(), O_RDONLY);
+  if (fd < 0) return false;
+  struct stat info;
+  if (fstat(fd, &info) != 0 or !S_ISREG(info.st_mode)) {
+    ::close(fd);
+    return false;
+  }
+  length = info.st_size;
+  // An empty file cannot be mapped, but is a valid empty file
+  if (length > 0) {
+    addr = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (addr == MAP_FAILED) {
+      addr = nullptr;
+      length = 0;
+      ::close(fd);
+      return false;
+    }
+    madvise(addr, length, MADV_SEQUENTIAL);
+  }
+  ::close(fd);
+  return true;
+}
+
+void MappedFile::close() {
+  if (addr) munmap(addr, length);
+  addr = nullptr;
+  length = 0;
+}
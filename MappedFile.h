@@ -0,0 +1,42 @@
+#ifndef MAPPEDFILE_H_
+#define MAPPEDFILE_H_
+
+// Read-only memory mapping of a whole file
+
+#include <string>
+#include <cstddef>
+
+using std::string;
+
+/**
+ * A file mapped into memory for reading, unmapped on destruction.
+ * Pages are read in by the OS as they are touched, so nothing is copied.
+ *
+ */
+class MappedFile {
+  public:
+        MappedFile() {}
+        MappedFile(const MappedFile&) = delete;
+        MappedFile& operator=(const MappedFile&) = delete;
+        ~MappedFile();
+        /**
+        * Map a file
+        *
+        * @param fname - Name of the file
+        * @return false if the file could not be opened or mapped
+        */
+        bool open(const string& fname);
+        /**
+        * Unmap the file
+        *
+        */
+        void close();
+        const char* data() const {return (const char*) addr;}
+        size_t size() const {return length;}
+
+  private:
+        void* addr = nullptr;
+        size_t length = 0;
+};
+
+#endif // MAPPEDFILE_H_
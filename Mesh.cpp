@@ -0,0 +1,410 @@
+#include <iostream>
+#include <charconv>
+#include <cstring>
+#include <sstream>
+#include <algorithm>
+
+#include "Mesh.h"
+#include "MappedFile.h"
+
+using namespace std;
+
+static bool isBlank(char c) {
+  return c == ' ' or c == '\t' or c == '\r' or c == '\v' or c == '\f';
+}
+
+static void skipBlanks(const char*& p, const char* end) {
+  while (p < end and isBlank(*p)) p++;
+}
+
+// Read a number at p and move past it
+template <class T>
+static bool readNumber(const char*& p, const char* end, T& value) {
+  skipBlanks(p, end);
+  if (p < end and *p == '+') p++;
+  auto result = from_chars(p, end, value);
+  if (result.ec != errc()) return false;
+  p = result.ptr;
+  return true;
+}
+
+// Turn a 1-based, or negative relative, OBJ index into an array index.
+// Indices past the end are kept and checked once the file is read.
+static bool resolveIndex(long index, size_t count, uint32_t& resolved) {
+  if (index > 0 and index <= UINT32_MAX) resolved = index - 1;
+  else if (index < 0 and (size_t) -index <= count) resolved = count + index;
+  else return false;
+  return true;
+}
+
+bool loadObj(const string& fname, Mesh& mesh) {
+  MappedFile file;
+  if (!file.open(fname)) return false;
+
+  const char* p = file.data();
+  const char* end = p + file.size();
+  size_t skippedFaces = 0;
+  vector<pair<uint32_t, uint32_t>> corners; // Vertex and normal of every corner of a face
+  while (p < end) {
+    const char* eol = (const char*) memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    skipBlanks(p, eol);
+    const char* cmd = p;
+    while (p < eol and !isBlank(*p)) p++;
+    size_t cmdLength = p - cmd;
+
+    if (cmdLength == 1 and cmd[0] == 'v') {
+      vec3 v;
+      if (readNumber(p, eol, v.x) and readNumber(p, eol, v.y) and readNumber(p, eol, v.z))
+        mesh.vertices.push_back(v);
+      else
+        mesh.vertices.push_back(vec3(0)); // Keep the numbering of later vertices
+    } else if (cmdLength == 2 and cmd[0] == 'v' and cmd[1] == 'n') {
+      vec3 n;
+      if (readNumber(p, eol, n.x) and readNumber(p, eol, n.y) and readNumber(p, eol, n.z))
+        mesh.normals.push_back(n);
+      else
+        mesh.normals.push_back(vec3(0));
+    } else if (cmdLength == 1 and cmd[0] == 'f') {
+      // Corners are v, v/vt, v//vn or v/vt/vn
+      corners.clear();
+      bool valid = true;
+      while (true) {
+        skipBlanks(p, eol);
+        if (p == eol) break;
+        long index;
+        uint32_t vertex, normal = MESH_NO_NORMAL;
+        valid = readNumber(p, eol, index) and
+          resolveIndex(index, mesh.vertices.size(), vertex);
+        if (valid and p < eol and *p == '/') {
+          p++;
+          while (p < eol and *p != '/' and !isBlank(*p)) p++; // Texture coordinate
+          if (p < eol and *p == '/') {
+            p++;
+            valid = readNumber(p, eol, index) and
+              resolveIndex(index, mesh.normals.size(), normal);
+          }
+        }
+        if (!valid) break;
+        corners.push_back({vertex, normal});
+      }
+      if (!valid or corners.size() < 3) {
+        skippedFaces++;
+      } else {
+        // Fan of triangles around the first corner
+        for (size_t k = 1; k + 1 < corners.size(); k++) {
+          for (size_t c : {(size_t) 0, k, k+1}) {
+            mesh.indices.push_back(corners[c].first);
+            mesh.normalIndices.push_back(corners[c].second);
+          }
+        }
+      }
+    }
+    // Anything else, such as vt, g, o, s, usemtl or comments, is not needed
+    p = eol < end ? eol + 1 : end;
+  }
+
+  // Faces may only be checked once every vertex is known
+  size_t numTriangles = 0;
+  for (size_t t = 0; t < mesh.indices.size() / 3; t++) {
+    bool valid = true;
+    for (int k = 0; k < 3; k++) {
+      uint32_t normal = mesh.normalIndices[3*t + k];
+      valid = valid and mesh.indices[3*t + k] < mesh.vertices.size() and
+        (normal == MESH_NO_NORMAL or normal < mesh.normals.size());
+    }
+    if (!valid) {
+      skippedFaces++;
+      continue;
+    }
+    for (int k = 0; k < 3; k++) {
+      mesh.indices[3*numTriangles + k] = mesh.indices[3*t + k];
+      mesh.normalIndices[3*numTriangles + k] = mesh.normalIndices[3*t + k];
+    }
+    numTriangles++;
+  }
+  mesh.indices.resize(3*numTriangles);
+  mesh.normalIndices.resize(3*numTriangles);
+  if (mesh.normals.empty()) mesh.normalIndices.clear();
+  mesh.indices.shrink_to_fit();
+  mesh.normalIndices.shrink_to_fit();
+
+  if (skippedFaces > 0)
+    cerr << "Skipped " << skippedFaces << " invalid faces of " << fname << "\n";
+  return true;
+}
+
+enum PlyType {PLY_INT8, PLY_UINT8, PLY_INT16, PLY_UINT16, PLY_INT32, PLY_UINT32,
+              PLY_FLOAT32, PLY_FLOAT64, PLY_NONE};
+
+static const size_t plyTypeSize[] = {1, 1, 2, 2, 4, 4, 4, 8};
+
+static PlyType plyType(const string& name) {
+  static const pair<const char*, PlyType> names[] = {
+    {"char", PLY_INT8}, {"int8", PLY_INT8}, {"uchar", PLY_UINT8}, {"uint8", PLY_UINT8},
+    {"short", PLY_INT16}, {"int16", PLY_INT16}, {"ushort", PLY_UINT16}, {"uint16", PLY_UINT16},
+    {"int", PLY_INT32}, {"int32", PLY_INT32}, {"uint", PLY_UINT32}, {"uint32", PLY_UINT32},
+    {"float", PLY_FLOAT32}, {"float32", PLY_FLOAT32}, {"double", PLY_FLOAT64}, {"float64", PLY_FLOAT64}};
+  for (auto& n : names) if (name == n.first) return n.second;
+  return PLY_NONE;
+}
+
+struct PlyProperty {
+  string name;
+  PlyType type;
+  PlyType countType = PLY_NONE; // Type of the count of a list property
+};
+
+struct PlyElement {
+  string name;
+  size_t count;
+  vector<PlyProperty> properties;
+};
+
+// Values of the body of a PLY file, in any of its formats
+class PlyReader {
+  public:
+    enum Format {ASCII, BINARY_LITTLE_ENDIAN, BINARY_BIG_ENDIAN};
+
+    PlyReader(const char* p, const char* end, Format format) :
+      p(p), end(end), swap(format == (isLittleEndian() ? BINARY_BIG_ENDIAN : BINARY_LITTLE_ENDIAN)),
+      ascii(format == ASCII) {}
+
+    bool read(PlyType type, double& value) {
+      if (ascii) {
+        while (p < end and (isBlank(*p) or *p == '\n')) p++;
+        return readNumber(p, end, value);
+      }
+      size_t size = plyTypeSize[type];
+      if ((size_t) (end - p) < size) return false;
+      unsigned char bytes[8];
+      memcpy(bytes, p, size);
+      if (swap) std::reverse(bytes, bytes + size);
+      p += size;
+      switch (type) {
+        case PLY_INT8: value = (int8_t) bytes[0]; break;
+        case PLY_UINT8: value = bytes[0]; break;
+        case PLY_INT16: value = as<int16_t>(bytes); break;
+        case PLY_UINT16: value = as<uint16_t>(bytes); break;
+        case PLY_INT32: value = as<int32_t>(bytes); break;
+        case PLY_UINT32: value = as<uint32_t>(bytes); break;
+        case PLY_FLOAT32: value = as<float>(bytes); break;
+        default: value = as<double>(bytes); break;
+      }
+      return true;
+    }
+
+    // Read the count of a list, false if the file ends first or the count
+    // is negative or more than the rest of the file can hold
+    bool readCount(PlyType type, size_t& count) {
+      double value;
+      if (!read(type, value) or !(value >= 0 and value <= end - p)) return false;
+      count = (size_t) value;
+      return true;
+    }
+
+    // Move past a property, false if the file ends first
+    bool skip(const PlyProperty& property) {
+      double value;
+      size_t count;
+      if (property.countType == PLY_NONE) return read(property.type, value);
+      if (!readCount(property.countType, count)) return false;
+      for (size_t i = 0; i < count; i++)
+        if (!read(property.type, value)) return false;
+      return true;
+    }
+
+    // Most records of an element the rest of the body can hold, to reserve
+    // no more than that whatever the header claims; 0 for ASCII, whose
+    // records have no minimum size worth bounding by
+    size_t maxRecords(const PlyElement& element) {
+      size_t minSize = 0;
+      for (auto& property : element.properties)
+        minSize += plyTypeSize[property.countType == PLY_NONE ? property.type : property.countType];
+      if (ascii or minSize == 0) return 0;
+      return (end - p) / minSize;
+    }
+
+  private:
+    template <class T>
+    static T as(const unsigned char* bytes) {
+      T value;
+      memcpy(&value, bytes, sizeof(T));
+      return value;
+    }
+
+    static bool isLittleEndian() {
+      uint16_t one = 1;
+      return *(unsigned char*) &one == 1;
+    }
+
+    const char* p;
+    const char* end;
+    bool swap, ascii;
+};
+
+static bool invalidPly(const string& fname, const char* reason) {
+  cerr << "Invalid PLY file " << fname << ": " << reason << "\n";
+  return false;
+}
+
+bool loadPly(const string& fname, Mesh& mesh) {
+  MappedFile file;
+  if (!file.open(fname)) return false;
+
+  // Header, one keyword line at a time up to end_header
+  const char* p = file.data();
+  const char* end = p + file.size();
+  vector<PlyElement> elements;
+  PlyReader::Format format = PlyReader::ASCII;
+  bool formatKnown = false, headerDone = false, first = true;
+  while (p < end and !headerDone) {
+    const char* eol = (const char*) memchr(p, '\n', end - p);
+    if (!eol) eol = end;
+    stringstream line(string(p, eol));
+    p = eol < end ? eol + 1 : end;
+    string keyword;
+    line >> keyword;
+    if (first) {
+      if (keyword != "ply") return invalidPly(fname, "no ply signature");
+      first = false;
+    } else if (keyword == "format") {
+      string name;
+      line >> name;
+      if (name == "ascii") format = PlyReader::ASCII;
+      else if (name == "binary_little_endian") format = PlyReader::BINARY_LITTLE_ENDIAN;
+      else if (name == "binary_big_endian") format = PlyReader::BINARY_BIG_ENDIAN;
+      else return invalidPly(fname, "unknown format");
+      formatKnown = true;
+    } else if (keyword == "element") {
+      PlyElement element;
+      if (!(line >> element.name >> element.count)) return invalidPly(fname, "bad element");
+      elements.push_back(element);
+    } else if (keyword == "property") {
+      if (elements.empty()) return invalidPly(fname, "property outside of an element");
+      PlyProperty property;
+      string type;
+      line >> type;
+      if (type == "list") {
+        string countType;
+        line >> countType >> type;
+        property.countType = plyType(countType);
+        if (property.countType == PLY_NONE or property.countType >= PLY_FLOAT32)
+          return invalidPly(fname, "bad list count type");
+      }
+      property.type = plyType(type);
+      if (property.type == PLY_NONE or !(line >> property.name))
+        return invalidPly(fname, "bad property");
+      elements.back().properties.push_back(property);
+    } else if (keyword == "end_header") {
+      headerDone = true;
+    }
+    // comment and obj_info lines are skipped
+  }
+  if (!headerDone) return invalidPly(fname, "no end_header");
+  if (!formatKnown) return invalidPly(fname, "no format");
+
+  // Vertex count, known before any face is read
+  size_t numVertices = 0;
+  for (auto& element : elements)
+    if (element.name == "vertex") numVertices = element.count;
+  if (numVertices > UINT32_MAX) return invalidPly(fname, "too many vertices");
+
+  PlyReader reader(p, end, format);
+  size_t skippedFaces = 0;
+  bool truncated = false;
+  vector<uint32_t> corners;
+  for (auto& element : elements) {
+    const auto& properties = element.properties;
+    if (element.name == "vertex") {
+      // Coordinate given by each property, -1 for none
+      static const char* coordinateNames[6] = {"x", "y", "z", "nx", "ny", "nz"};
+      vector<int> coordinate(properties.size(), -1);
+      int numNormals = 0;
+      for (size_t i = 0; i < properties.size(); i++)
+        for (int c = 0; c < 6; c++)
+          if (properties[i].name == coordinateNames[c] and properties[i].countType == PLY_NONE) {
+            coordinate[i] = c;
+            if (c >= 3) numNormals++;
+          }
+      bool hasNormals = numNormals == 3;
+      size_t reserved = min(element.count, reader.maxRecords(element));
+      mesh.vertices.reserve(reserved);
+      if (hasNormals) mesh.normals.reserve(reserved);
+      for (size_t v = 0; v < element.count and !truncated; v++) {
+        double values[6] = {0, 0, 0, 0, 0, 0};
+        for (size_t i = 0; i < properties.size() and !truncated; i++) {
+          int c = coordinate[i];
+          truncated = c >= 0 ? !reader.read(properties[i].type, values[c])
+                             : !reader.skip(properties[i]);
+        }
+        if (truncated) break;
+        mesh.vertices.push_back(vec3(values[0], values[1], values[2]));
+        if (hasNormals) mesh.normals.push_back(vec3(values[3], values[4], values[5]));
+      }
+    } else if (element.name == "face") {
+      mesh.indices.reserve(3 * min(element.count, reader.maxRecords(element)));
+      for (size_t f = 0; f < element.count and !truncated; f++) {
+        corners.clear();
+        bool valid = true;
+        for (auto& property : properties) {
+          if (property.countType == PLY_NONE or
+              (property.name != "vertex_indices" and property.name != "vertex_index")) {
+            truncated = !reader.skip(property);
+          } else {
+            size_t count;
+            double index;
+            truncated = !reader.readCount(property.countType, count);
+            for (size_t k = 0; k < count and !truncated; k++) {
+              truncated = !reader.read(property.type, index);
+              if (truncated) break;
+              if (index < 0 or index >= numVertices) valid = false;
+              else corners.push_back(index);
+            }
+          }
+          if (truncated) break;
+        }
+        if (truncated) break;
+        if (!valid or corners.size() < 3) {
+          skippedFaces++;
+          continue;
+        }
+        // Fan of triangles around the first corner
+        for (size_t k = 1; k + 1 < corners.size(); k++) {
+          mesh.indices.push_back(corners[0]);
+          mesh.indices.push_back(corners[k]);
+          mesh.indices.push_back(corners[k+1]);
+        }
+      }
+    } else {
+      for (size_t i = 0; i < element.count and !truncated; i++)
+        for (auto& property : properties)
+          if (!reader.skip(property)) {
+            truncated = true;
+            break;
+          }
+    }
+    if (truncated) break;
+  }
+
+  if (truncated) {
+    // Keep the complete faces, which only use vertices that were read
+    cerr << "PLY file " << fname << " is truncated or damaged\n";
+    size_t numTriangles = 0;
+    for (size_t t = 0; t < mesh.indices.size() / 3; t++) {
+      bool complete = true;
+      for (int k = 0; k < 3; k++) complete = complete and mesh.indices[3*t + k] < mesh.vertices.size();
+      if (!complete) continue;
+      for (int k = 0; k < 3; k++) mesh.indices[3*numTriangles + k] = mesh.indices[3*t + k];
+      numTriangles++;
+    }
+    mesh.indices.resize(3 * numTriangles);
+  }
+  // Only n-gons make the index array grow past its reservation
+  if (mesh.indices.capacity() > mesh.indices.size() + mesh.indices.size() / 4)
+    mesh.indices.shrink_to_fit();
+
+  if (skippedFaces > 0)
+    cerr << "Skipped " << skippedFaces << " invalid faces of " << fname << "\n";
+  return true;
+}
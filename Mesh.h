@@ -0,0 +1,65 @@
+#ifndef MESH_H_
+#define MESH_H_
+
+// Indexed triangle meshes read from mesh files
+
+#include <vector>
+#include <string>
+#include <cstdint>
+#include "SceneObjects.h"
+
+using std::vector, std::string;
+
+/**
+ * Triangle mesh with shared vertices, as read from a mesh file.
+ * Its arrays are used in place by the MeshTriangles of the scene.
+ *
+ */
+struct Mesh {
+        vector<vec3> vertices;
+        vector<vec3> normals;
+        vector<uint32_t> indices; // Three vertices per triangle
+        // Three normals per triangle, MESH_NO_NORMAL for faces without
+        // any; empty when the file has no normals, or one per vertex
+        vector<uint32_t> normalIndices;
+
+        /**
+        * Normal indices of the triangles, nullptr without normals. A mesh
+        * with one normal per vertex and no normalIndices shares the
+        * vertex indices.
+        *
+        */
+        const uint32_t* normalIndexData() const {
+                if (!normalIndices.empty()) return normalIndices.data();
+                if (!normals.empty() and normals.size() == vertices.size()) return indices.data();
+                return nullptr;
+        }
+};
+
+/**
+ * Read a Wavefront OBJ file. Vertices (v), normals (vn) and faces (f)
+ * are read, faces of more than three vertices are split into a fan of
+ * triangles. Texture coordinates, groups and materials are ignored.
+ * The file is mapped and its faces go straight into the index arrays.
+ *
+ * @param fname - Name of the OBJ file
+ * @param mesh - Mesh to fill
+ * @return false if the file could not be opened
+ */
+bool loadObj(const string& fname, Mesh& mesh);
+
+/**
+ * Read a PLY file, binary little or big endian or ASCII. The vertex
+ * element gives the vertices (x, y, z) and normals (nx, ny, nz), the
+ * vertex_indices list of the face element the faces, split into a fan
+ * of triangles. Other elements and properties are skipped. The file
+ * is mapped and its arrays read straight into the mesh, reserved from
+ * the counts of the header.
+ *
+ * @param fname - Name of the PLY file
+ * @param mesh - Mesh to fill
+ * @return false if the file could not be opened or has an invalid header
+ */
+bool loadPly(const string& fname, Mesh& mesh);
+
+#endif // MESH_H_
@@ -0,0 +1,112 @@
+#include <iostream>
+#include <cstring>
+#include "OutputPipeline.h"
+
+using namespace std;
+
+OutputPipeline::OutputPipeline() :
+  busy(false), stopping(false), failed(false), width(0), queuedBytes(0), queueLimit(0) {
+  encoder = std::thread(&OutputPipeline::encoderLoop, this);
+}
+
+OutputPipeline::~OutputPipeline() {
+  wait();
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  queued.notify_one();
+  encoder.join();
+}
+
+void OutputPipeline::beginFrame(const string& fname, int w, int h, const ImageRegion* part) {
+  lock_guard<std::mutex> lock(mutex);
+  width = w;
+  tasks.push_back({Task::BEGIN, fname, 0, 0, w, h, {}, part != nullptr,
+                   part ? *part : ImageRegion()});
+  queued.notify_one();
+}
+
+void OutputPipeline::writeRows(int y, int numRows, const float* rgb) {
+  // Copy outside the lock, render threads only wait for the queue
+  Task task = {Task::ROWS, "", y, numRows, 0, 0,
+               vector<float>(rgb, rgb + (size_t) numRows*width*3), false, {}};
+  size_t bytes = task.rgb.size() * sizeof(float);
+  unique_lock<std::mutex> lock(mutex);
+  // Rows already queued are always let through, however large
+  dequeued.wait(lock, [&] {return queueLimit == 0 or queuedBytes == 0 or
+                                  queuedBytes + bytes <= queueLimit;});
+  queuedBytes += bytes;
+  tasks.push_back(std::move(task));
+  queued.notify_one();
+}
+
+void OutputPipeline::setQueueLimit(size_t bytes) {
+  lock_guard<std::mutex> lock(mutex);
+  queueLimit = bytes;
+}
+
+void OutputPipeline::endFrame() {
+  lock_guard<std::mutex> lock(mutex);
+  tasks.push_back({Task::END, "", 0, 0, 0, 0, {}, false, {}});
+  queued.notify_one();
+}
+
+bool OutputPipeline::wait() {
+  unique_lock<std::mutex> lock(mutex);
+  drained.wait(lock, [this] {return tasks.empty() and !busy;});
+  return !failed;
+}
+
+void OutputPipeline::encoderLoop() {
+  while (true) {
+    Task task;
+    {
+      unique_lock<std::mutex> lock(mutex);
+      queued.wait(lock, [this] {return stopping or !tasks.empty();});
+      if (tasks.empty()) return;
+      task = std::move(tasks.front());
+      tasks.pop_front();
+      busy = true;
+      if (task.type == Task::ROWS) {
+        queuedBytes -= task.rgb.size() * sizeof(float);
+        dequeued.notify_all();
+      }
+    }
+
+    if (task.type == Task::BEGIN) {
+      fname = task.fname;
+      writer = ImageWriter::create(fname);
+      if (task.partial) writer->setRegion(task.region);
+      frameOk = writer->open(fname, task.width, task.height);
+      nextRow = 0;
+      rowFloats = task.width*3;
+      waitingRows.clear();
+    } else if (task.type == Task::ROWS) {
+      for (int k = 0; k < task.numRows; k++) {
+        const float* row = task.rgb.data() + (size_t) k*rowFloats;
+        if (task.y+k == nextRow) {
+          if (frameOk) frameOk = writer->writeRow(row);
+          nextRow++;
+        } else {
+          waitingRows[task.y+k].assign(row, row + rowFloats);
+        }
+      }
+      // Rows that were waiting on the ones just written
+      while (!waitingRows.empty() and waitingRows.begin()->first == nextRow) {
+        if (frameOk) frameOk = writer->writeRow(waitingRows.begin()->second.data());
+        waitingRows.erase(waitingRows.begin());
+        nextRow++;
+      }
+    } else {
+      frameOk = frameOk and waitingRows.empty() and writer->close();
+      if (!frameOk) cerr << "Unable to write output file " << fname << "\n";
+      writer.reset();
+    }
+
+    lock_guard<std::mutex> lock(mutex);
+    if (task.type == Task::END and !frameOk) failed = true;
+    busy = false;
+    if (tasks.empty()) drained.notify_all();
+  }
+}
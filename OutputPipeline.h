@@ -0,0 +1,102 @@
+#ifndef OUTPUTPIPELINE_H_
+#define OUTPUTPIPELINE_H_
+
+// Background thread encoding and writing images while rendering continues
+
+#include <vector>
+#include <deque>
+#include <map>
+#include <string>
+#include <memory>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <cstdint>
+
+#include "ImageWriter.h"
+
+using std::vector, std::deque, std::map, std::string, std::unique_ptr;
+
+/**
+ * Hands finished rows of an image to an encoder thread, which streams them
+ * to disk in order. Frames are queued, so a frame can still be encoding
+ * while the next one renders.
+ *
+ */
+class OutputPipeline {
+  public:
+        OutputPipeline();
+        /**
+        * Wait until every queued frame is written
+        *
+        */
+        ~OutputPipeline();
+        /**
+        * Start a new output image.
+        * Rows of the previous frame must all have been given.
+        *
+        * @param fname - Name of output file
+        * @param width - Width of the image
+        * @param height - Height of the image
+        * @param part - Place of the image in a larger frame, nullptr for a whole frame
+        */
+        void beginFrame(const string& fname, int width, int height,
+                        const ImageRegion* part = nullptr);
+        /**
+        * Queue finished rows of the current frame. Rows may come in any
+        * order, they are written once all the rows above them are in.
+        * Can be called from several threads.
+        *
+        * @param y - First row, counted from the top of the image
+        * @param numRows - Number of rows
+        * @param rgb - numRows*width*3 floats of linear RGB, copied
+        */
+        void writeRows(int y, int numRows, const float* rgb);
+        /**
+        * Make writeRows wait while the rows queued for the encoder take
+        * more than a given size, so a slow encoder holds back rendering
+        * rather than letting the queue grow with the image
+        *
+        * @param bytes - Most bytes of rows queued, 0 for no limit
+        */
+        void setQueueLimit(size_t bytes);
+        /**
+        * Mark the current frame as complete
+        *
+        */
+        void endFrame();
+        /**
+        * Block until every queued frame is written
+        *
+        * @return false if any frame could not be written
+        */
+        bool wait();
+
+  private:
+        struct Task {
+                enum {BEGIN, ROWS, END} type;
+                string fname;
+                int y, numRows, width, height;
+                vector<float> rgb;
+                bool partial;
+                ImageRegion region;
+        };
+        void encoderLoop();
+
+        std::thread encoder;
+        std::mutex mutex;
+        std::condition_variable queued, drained, dequeued;
+        deque<Task> tasks;
+        bool busy, stopping, failed;
+        int width;
+        size_t queuedBytes, queueLimit; // Of the rows in tasks
+
+        // Encoder thread state for the frame being written
+        unique_ptr<ImageWriter> writer;
+        string fname;
+        map<int, vector<float>> waitingRows;
+        int nextRow, rowFloats;
+        bool frameOk;
+};
+
+#endif // OUTPUTPIPELINE_H_
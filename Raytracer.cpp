@@ -1,39 +1,754 @@
 #include "Raytracer.h"
 #include <iostream>
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <algorithm>
+#include <random>
+#include <cstring>
+#include <FreeImage.h>
+#include "GeometryCache.h"
 
 #define Z_FAR 1000000
+// Tiles left in a band whose rows have gone to the output pipeline
+#define BAND_WRITTEN -1
+// Neighbouring samples whose normals are further apart than this
+// cosine (about 25 degrees) are on different sides of an edge
+#define ADAPTIVE_NORMAL_COS 0.9f
+// Samples of every pixel of a tile before its error is first estimated
+#define CONVERGE_FIRST_SAMPLES 8
+// Fewest samples given to a tile that has not converged
+#define CONVERGE_MIN_BATCH 4
+// Added to the luminance the error is relative to, so that nearly black
+// pixels do not take endless samples
+#define CONVERGE_DARK 0.05f
+
+// Side of the blocks of pixels sharing a ray in the first image of a preview
+#define PREVIEW_BLOCK 16
+
+// Paths this long or longer may be ended by Russian roulette
+#define PATH_ROULETTE_DEPTH 3
+
+// Weights of linear RGB in luminance (Rec. 709)
+static const vec3 LUMINANCE(0.2126f, 0.7152f, 0.0722f);
+
+// Mixes the coordinates of a pixel into 32 well spread bits
+static uint32_t hashPixel(uint32_t i, uint32_t j) {
+  uint32_t h = i * 0x8da6b343u ^ j * 0xd8163841u;
+  h ^= h >> 16;
+  h *= 0x7feb352du;
+  h ^= h >> 15;
+  h *= 0x846ca68bu;
+  h ^= h >> 16;
+  return h;
+}
+
+// Seed of the random numbers of a sample of a pixel, the same whichever
+// thread traces it
+static uint32_t sampleSeed(uint32_t i, uint32_t j, uint32_t k) {
+  return hashPixel(hashPixel(i, j), k);
+}
 
 void Raytracer::rayTrace(Scene& scene) {
-  float iCenter, jCenter;
-  vec3 rayDirection, color;
-  int currentDepth = 0;
-  for (int i=0; i < width; i++) {
-    for (int j=0; j < height; j++) {
-      // Convention: Ray is cast through center of pixel
-      iCenter = i+0.5; jCenter = j+0.5;
-      rayDirection = rayCast(iCenter, jCenter, scene);
+  // Tiles of the frame covering the part, numbered in rows from its top
+  // and cut to the part
+  int frameTilesPerBand = (width + TILE_SIZE-1) / TILE_SIZE;
+  int firstColumn = partX / TILE_SIZE, firstBand = partY / TILE_SIZE;
+  int tilesPerBand = (partX + partWidth + TILE_SIZE-1) / TILE_SIZE - firstColumn;
+  int numBands = (partY + partHeight + TILE_SIZE-1) / TILE_SIZE - firstBand;
+  int numTiles = partWidth > 0 and partHeight > 0 ? tilesPerBand * numBands : 0;
+  auto tileAt = [&](int t) {
+    int column = firstColumn + t % tilesPerBand, band = firstBand + t / tilesPerBand;
+    int x = column * TILE_SIZE, y = band * TILE_SIZE;
+    return Tile{band*frameTilesPerBand + column, max(x, partX), max(y, partY),
+                min(x+TILE_SIZE, partX+partWidth), min(y+TILE_SIZE, partY+partHeight)};
+  };
+
+  // With bounded memory the framebuffer is a ring of bands, enough for
+  // every thread to work a band or two ahead of the oldest unfinished one
+  int ringBands = numBands;
+  if (boundedMemory) {
+    int numThreads = pool ? pool->size() : 1;
+    ringBands = min(numBands, max(4, 2*numThreads / tilesPerBand + 2));
+    framebufferY = firstBand * TILE_SIZE;
+    framebufferRows = ringBands * TILE_SIZE;
+    framebuffer.assign((size_t) framebufferRows*partWidth, vec3(0));
+    output->setQueueLimit(framebuffer.size() * sizeof(vec3));
+  }
+
+  // Rows go to the output pipeline once every tile of their band is done
+  vector<std::atomic<int>> bandTilesLeft(numBands);
+  for (auto& left : bandTilesLeft) left = tilesPerBand;
+
+  // Running statistics of every pixel, when tiles are sampled until they
+  // converge or progressively
+  bool converging = isConverging(), progressive = isProgressive(), preview = previewing;
+  if (converging or progressive) pixelStats.assign((size_t) partWidth*partHeight, PixelStats());
+  else pixelStats = vector<PixelStats>();
+
+  // Samples of every finished tile, some of them from a checkpoint resumed
+  auto renderStart = std::chrono::steady_clock::now();
+  vector<std::atomic<uint32_t>> tileSamples(numTiles);
+  CheckpointHeader header;
+  if (checkpoint) {
+    header = checkpointHeader(scene, numTiles);
+    vector<uint32_t> saved;
+    if (checkpoint->load(header, saved, &framebuffer.data()->x, framebuffer.size()*3)) {
+      int resumed = 0;
+      for (int t = 0; t < numTiles; t++) {
+        tileSamples[t] = saved[t];
+        resumed += saved[t] > 0;
+        if (converging and saved[t] > 0) {
+          Tile tile = tileAt(t);
+          for (int j = tile.y0; j < tile.y1; j++)
+            for (int i = tile.x0; i < tile.x1; i++) getStats(i, j).samples = saved[t];
+        }
+      }
+      std::cout << "Resumed " << resumed << " of " << numTiles << " tiles from checkpoint\n";
+    }
+  }
+  auto saveCheckpoint = [&] {
+    vector<uint32_t> samples(numTiles);
+    for (int t = 0; t < numTiles; t++) samples[t] = tileSamples[t].load(std::memory_order_acquire);
+    // Pixels of tiles still being rendered may change while they are
+    // written, they are read back as not finished anyway
+    checkpoint->save(header, samples, &framebuffer.data()->x, framebuffer.size()*3);
+  };
+  std::atomic<long> primaryRays(0), renderedPixels(0);
+  // Copied once for all the passes, which may have a deadline to keep
+  vector<Scene> replicas;
+  if (pool and pool->numNodes() > 1) replicas = replicateScene(scene);
+  // Coarser images of a preview go out before the frame itself
+  if (preview) renderPreview(scene, replicas, numTiles, tileAt);
+  ImageRegion region = getRegion();
+  if (output) output->beginFrame(fname, partWidth, partHeight, isPartial() ? &region : nullptr);
+  streamed = output != nullptr;
+  if (progressive) renderProgressive(scene, replicas, numTiles, tileAt);
+  if (progressive or (preview and isOneRayPerPixel())) {
+    if (output) streamRows(partY, partY + partHeight);
+    return;
+  }
+  auto renderTileAt = [&](Scene& tileScene, int t) {
+    Tile tile = tileAt(t);
+    int band = t / tilesPerBand;
+    // Its rows of the ring are free once the band using them before is written
+    if (band >= ringBands)
+      while (bandTilesLeft[band - ringBands] != BAND_WRITTEN) std::this_thread::yield();
+    if (tileSamples[t] == 0) {
+      long numPixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0), rays = 0;
+      bool inRange = tile.id >= firstTile and tile.id <= lastTile;
+      if (inRange) {
+        // Tiles sampled until they converge only get their first samples here
+        rays = converging ? sampleTile(tileScene, tile, min(CONVERGE_FIRST_SAMPLES, convergeSamples))
+                          : renderTile(tileScene, tile);
+        primaryRays += rays;
+        renderedPixels += numPixels;
+      } else {
+        // Tiles of the part outside the range asked for stay black
+        for (int j = tile.y0; j < tile.y1; j++)
+          for (int i = tile.x0; i < tile.x1; i++) setColor(vec3(0), i, j);
+      }
+      uint32_t samples = max((rays + numPixels-1) / numPixels, 1L);
+      if (!converging or !inRange) tileSamples[t].store(samples, std::memory_order_release);
+    }
+    if (output and !converging and --bandTilesLeft[band] == 0) {
+      streamRows(tile.y0, tile.y1);
+      bandTilesLeft[band] = BAND_WRITTEN;
+    }
+    if (checkpoint and checkpoint->due()) saveCheckpoint();
+  };
+
+  runPass(scene, replicas, numTiles, renderTileAt);
+  int convergedTiles = 0;
+  if (converging) {
+    convergedTiles = convergeTiles(scene, replicas, numTiles, tileAt, tileSamples, primaryRays,
+                                   saveCheckpoint);
+    if (output) streamRows(partY, partY + partHeight);
+  }
+  if (checkpoint) {
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - renderStart).count();
+    checkpoint->report(std::cout, seconds);
+  }
+  if (converging and renderedPixels > 0) {
+    std::cout << "Variance sampling: " << primaryRays << " samples, "
+              << (double) primaryRays / renderedPixels << " per pixel; " << convergedTiles
+              << " tiles converged, the others stopped at " << convergeSamples << " spp\n";
+  } else if (adaptiveSamples > 0 and renderedPixels > 0) {
+    // The most rays a pixel may cast, which uniform sampling casts through
+    // every pixel for the same edges
+    int uniformSpp = 1 << 2*adaptiveLevels();
+    long uniformRays = renderedPixels * uniformSpp;
+    std::cout << "Adaptive sampling: " << primaryRays << " primary rays, "
+              << (double) primaryRays / renderedPixels << " per pixel, at most " << uniformSpp
+              << "; " << uniformSpp << " spp would cast " << uniformRays << ", "
+              << 100.0 * (uniformRays - primaryRays) / uniformRays << "% saved\n";
+  }
+}
+
+void Raytracer::runPass(Scene& scene, vector<Scene>& replicas, int numTiles,
+                        const function<void(Scene&, int)>& renderTileAt) {
+  if (!pool) {
+    for (int t = 0; t < numTiles; t++) renderTileAt(scene, t);
+    return;
+  }
+
+  // Every node gets a contiguous range of tiles and a copy of the scene.
+  // Threads start on the range of their own node, then help the other nodes
+  // while still tracing against their local copy of the scene. With bounded
+  // memory all threads share one range, so they stay within the ring.
+  int numNodes = pool->numNodes();
+  int numRanges = boundedMemory ? 1 : numNodes;
+  vector<std::atomic<int>> nextTile(numRanges);
+  vector<int> rangeEnd(numRanges);
+  for (int r = 0; r < numRanges; r++) {
+    nextTile[r] = (long) numTiles * r / numRanges;
+    rangeEnd[r] = (long) numTiles * (r+1) / numRanges;
+  }
+
+  pool->run([&](int thread) {
+    int node = pool->nodeOf(thread);
+    Scene& localScene = replicas.empty() ? scene : replicas[node];
+    for (int k = 0; k < numRanges; k++) {
+      int range = (node + k) % numRanges;
+      for (int t = nextTile[range]++; t < rangeEnd[range]; t = nextTile[range]++)
+        renderTileAt(localScene, t);
+    }
+  });
+}
+
+long Raytracer::renderTile(Scene& scene, const Tile& tile) {
+  if (adaptiveSamples > 0) return renderTileAdaptive(scene, tile);
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      seedJitter(jitterSeed(i, j));
+      setColor(tracePixel(scene, i, j), i, j);
+    }
+  }
+  return (long) samplesPerPixel * (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+}
+
+long Raytracer::renderTileAdaptive(Scene& scene, const Tile& tile) {
+  // A sample through the center of every pixel of the tile and of the
+  // pixels around it, so edges along the sides of tiles are found too
+  int x0 = max(tile.x0-1, 0), y0 = max(tile.y0-1, 0);
+  int x1 = min(tile.x1+1, width), y1 = min(tile.y1+1, height);
+  int w = x1 - x0;
+  vector<PixelSample> centers((size_t) w * (y1-y0));
+  for (int j = y0; j < y1; j++) {
+    for (int i = x0; i < x1; i++) {
+      seedJitter(jitterSeed(i, j));
+      centers[(j-y0)*w + i-x0] = traceSample(scene, i+0.5, j+0.5);
+    }
+  }
+  long rays = centers.size();
+
+  int levels = adaptiveLevels();
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      const PixelSample& center = centers[(j-y0)*w + i-x0];
+      // Pixels differing from any of their 8 neighbours are subdivided
+      bool edge = false;
+      for (int nj = max(j-1, y0); nj <= min(j+1, y1-1) and !edge; nj++)
+        for (int ni = max(i-1, x0); ni <= min(i+1, x1-1) and !edge; ni++)
+          edge = samplesDiffer(scene, center, centers[(nj-y0)*w + ni-x0]);
+      // Restarted, as the centres traced before it depend on the tile
+      if (edge) seedJitter(sampleSeed(i, j, 1));
+      setColor(edge and levels > 0 ? refineSquare(scene, i, j, 1, center, i+0.5f, j+0.5f, levels, rays)
+                                   : center.color, i, j);
+    }
+  }
+  return rays;
+}
+
+vec3 Raytracer::refineSquare(Scene& scene, float x, float y, float size, const PixelSample& known,
+                             float knownX, float knownY, int levels, long& rays) {
+  float half = size / 2;
+  // The sample already traced in the square stands for the quadrant
+  // holding it, so a pixel split down to the last level casts exactly
+  // 4^levels rays, the centre one included. The centre of a pixel is a
+  // corner of all four, the one it goes to varies from pixel to pixel so
+  // that images are not shifted towards one corner.
+  int reused = (knownX >= x + half) + 2*(knownY >= y + half);
+  if (knownX == x + half and knownY == y + half) reused = hashPixel((uint32_t) x, (uint32_t) y) % 4;
+  PixelSample quadrants[4];
+  float sampleX[4], sampleY[4];
+  for (int q = 0; q < 4; q++) {
+    if (q == reused) {
+      quadrants[q] = known;
+      sampleX[q] = knownX;
+      sampleY[q] = knownY;
+    } else {
+      sampleX[q] = x + (q%2 + 0.5f)*half;
+      sampleY[q] = y + (q/2 + 0.5f)*half;
+      quadrants[q] = traceSample(scene, sampleX[q], sampleY[q]);
+    }
+  }
+  rays += 3;
+
+  // Quadrants still differing from one of the others are split again
+  vec3 color(0.);
+  for (int q = 0; q < 4; q++) {
+    bool edge = false;
+    for (int r = 0; r < 4 and levels > 1 and !edge; r++)
+      edge = r != q and samplesDiffer(scene, quadrants[q], quadrants[r]);
+    color += edge ? refineSquare(scene, x + q%2*half, y + q/2*half, half, quadrants[q],
+                                 sampleX[q], sampleY[q], levels-1, rays)
+                  : quadrants[q].color;
+  }
+  return color / 4.f;
+}
+
+long Raytracer::sampleTile(Scene& scene, const Tile& tile, int samples,
+                           std::chrono::steady_clock::time_point until) {
+  bool timed = until != std::chrono::steady_clock::time_point::max(), late = false;
+  long cast = 0;
+  for (int j = tile.y0; j < tile.y1 and !late; j++) {
+    for (int i = tile.x0; i < tile.x1 and !late; i++) {
+      PixelStats& stats = getStats(i, j);
+      vec3 mean = getColor(i, j);
+      int k = stats.samples;
+      // Restarted for every batch of the pixel, so it comes out the same in any order
+      seedJitter(sampleSeed(i, j, k));
+      for (; k < stats.samples + samples; k++) {
+        // Stops at the deadline, every pixel keeping the samples it got
+        if (timed and (late = std::chrono::steady_clock::now() >= until)) break;
+        float weight;
+        glm::vec2 sample = samplePosition(i, j, k, weight);
+        if (weight == 0) continue;
+        vec3 color = radiance(scene, rayCast(sample.x, sample.y, scene), sampleSeed(i, j, k));
+        // Weighted running mean, and variance of the luminance (West, 1979)
+        stats.weight += weight;
+        vec3 delta = color - mean;
+        mean += weight / stats.weight * delta;
+        stats.m2 += weight * dot(LUMINANCE, delta) * dot(LUMINANCE, color - mean);
+      }
+      cast += k - stats.samples;
+      stats.samples = k;
+      setColor(mean, i, j);
+    }
+  }
+  return cast;
+}
+
+void Raytracer::renderProgressive(Scene& scene, vector<Scene>& replicas, int numTiles,
+                                  const function<Tile(int)>& tileAt) {
+  using std::chrono::steady_clock;
+  auto nanoseconds = [](steady_clock::time_point time) {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+  };
+  // Whichever thread moves the time of the next snapshot on writes it
+  int64_t interval = snapshotInterval * 1e9;
+  std::atomic<int64_t> nextSnapshot(nanoseconds(steady_clock::now()) + interval);
+  std::atomic<int> snapshots(0);
+  auto snapshotDue = [&] {
+    int64_t now = nanoseconds(steady_clock::now()), next = nextSnapshot;
+    return interval > 0 and now >= next and nextSnapshot.compare_exchange_strong(next, now + interval);
+  };
+
+  // Every pass doubles the samples of the pixels, the first one casting one
+  int passes = 0, samples = 0;
+  std::atomic<long> rays(0);
+  while (steady_clock::now() < deadline) {
+    int batch = max(samples, 1);
+    runPass(scene, replicas, numTiles, [&](Scene& tileScene, int t) {
+      Tile tile = tileAt(t);
+      // Tiles of the part outside the range asked for stay black
+      if (tile.id < firstTile or tile.id > lastTile) return;
+      rays += sampleTile(tileScene, tile, batch, deadline);
+      // Not worth delaying the end for
+      if (steady_clock::now() < deadline and snapshotDue() and saveSnapshot()) snapshots++;
+    });
+    if (steady_clock::now() >= deadline) break;
+    passes++;
+    samples += batch;
+  }
+
+  double late = std::chrono::duration<double>(steady_clock::now() - deadline).count();
+  std::cout << "Progressive: " << passes << " passes of " << samples << " spp, then "
+            << rays - (long) samples * partWidth * partHeight << " more samples; stopped "
+            << late * 1e3 << " ms after the deadline";
+  if (interval > 0) std::cout << ", " << snapshots << " snapshots written";
+  std::cout << "\n";
+}
+
+void Raytracer::renderPreview(Scene& scene, vector<Scene>& replicas, int numTiles,
+                              const function<Tile(int)>& tileAt) {
+  auto start = std::chrono::steady_clock::now();
+  // Blocks are aligned on the frame and cut to the tile, a block being
+  // traced through the center of its top left pixel. That pixel is also
+  // the top left of one of the blocks of the next level, so every ray is
+  // reused by the levels below, the last one tracing every other pixel.
+  auto corner = [](int x, int block, int x0) {return max(x / block * block, x0);};
+  for (int block = PREVIEW_BLOCK; block >= 1; block /= 2) {
+    std::atomic<long> rays(0);
+    runPass(scene, replicas, numTiles, [&](Scene& tileScene, int t) {
+      Tile tile = tileAt(t);
+      // Tiles of the part outside the range asked for stay black
+      if (tile.id < firstTile or tile.id > lastTile) return;
+      for (int y = corner(tile.y0, block, tile.y0); y < tile.y1; y = corner(y + block, block, tile.y0)) {
+        for (int x = corner(tile.x0, block, tile.x0); x < tile.x1; x = corner(x + block, block, tile.x0)) {
+          bool traced = block < PREVIEW_BLOCK and x == corner(x, 2*block, tile.x0) and
+            y == corner(y, 2*block, tile.y0);
+          if (!traced) {
+            seedJitter(jitterSeed(x, y));
+            setColor(radiance(tileScene, rayCast(x+0.5, y+0.5, tileScene), sampleSeed(x, y, 0)), x, y);
+            rays++;
+          }
+          vec3 color = getColor(x, y);
+          int x1 = min(corner(x + block, block, tile.x0), tile.x1);
+          int y1 = min(corner(y + block, block, tile.y0), tile.y1);
+          for (int j = y; j < y1; j++)
+            for (int i = x; i < x1; i++) setColor(color, i, j);
+        }
+      }
+    });
+    // The last level is the frame itself when the scene samples no
+    // more, saved as usual; otherwise the frame is rendered after it
+    bool written = block > 1 or !isOneRayPerPixel();
+    if (written and (!output or !ImageWriter::isStream(fname))) {
+      saveSnapshot();
+    } else if (written) {
+      ImageRegion region = getRegion();
+      output->beginFrame(fname, partWidth, partHeight, isPartial() ? &region : nullptr);
+      streamRows(partY, partY + partHeight);
+      output->endFrame();
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Preview " << block << "x" << block << ": " << rays << " rays, "
+              << (written ? "written after " : "done after ") << seconds * 1e3 << " ms\n";
+  }
+}
+
+bool Raytracer::writeImage(const string& imageFname) {
+  std::unique_ptr<ImageWriter> writer = ImageWriter::create(imageFname);
+  if (isPartial()) writer->setRegion(getRegion());
+  bool ok = writer->open(imageFname, partWidth, partHeight);
+  for (int j = 0; j < partHeight and ok; j++)
+    ok = writer->writeRow(&framebuffer[(size_t) j*partWidth].x);
+  return ok and writer->close();
+}
+
+bool Raytracer::saveSnapshot() {
+  // Written next to the output, keeping its extension for the format, then
+  // renamed over it, so the output is always a whole image
+  size_t dot = fname.rfind('.'), slash = fname.rfind('/');
+  bool extension = dot != string::npos and (slash == string::npos or dot > slash);
+  string tempFname = extension ? fname.substr(0, dot) + ".partial" + fname.substr(dot)
+                               : fname + ".partial";
+  if (!writeImage(tempFname) or rename(tempFname.c_str(), fname.c_str()) != 0) {
+    std::cerr << "Unable to write snapshot " << fname << "\n";
+    remove(tempFname.c_str());
+    return false;
+  }
+  return true;
+}
+
+void Raytracer::setDeadline(std::chrono::steady_clock::time_point time, double snapshotSeconds) {
+  deadline = time;
+  snapshotInterval = snapshotSeconds;
+}
+
+float Raytracer::tileError(const Tile& tile) {
+  // Root mean square over the pixels of the standard error of their
+  // luminance, relative to it so dark and bright areas converge alike
+  double sum = 0;
+  for (int j = tile.y0; j < tile.y1; j++) {
+    for (int i = tile.x0; i < tile.x1; i++) {
+      const PixelStats& stats = getStats(i, j);
+      if (stats.weight <= 0 or stats.samples < 2) continue;
+      float variance = stats.m2 / stats.weight / stats.samples;
+      float luminance = dot(LUMINANCE, glm::clamp(getColor(i, j), 0.f, 1.f)) + CONVERGE_DARK;
+      sum += variance / (luminance * luminance);
+    }
+  }
+  return sqrt(sum / ((tile.x1 - tile.x0) * (tile.y1 - tile.y0)));
+}
+
+int Raytracer::convergeTiles(Scene& scene, vector<Scene>& replicas, int numTiles,
+                             const function<Tile(int)>& tileAt,
+                             vector<std::atomic<uint32_t>>& tileSamples,
+                             std::atomic<long>& rays, const function<void()>& saveCheckpoint) {
+  vector<int> active;
+  for (int t = 0; t < numTiles; t++)
+    if (tileSamples[t] == 0) active.push_back(t);
+  vector<float> errors(numTiles);
+  int converged = 0;
+
+  while (!active.empty()) {
+    // Tiles below the error or at the cap are done
+    vector<int> next;
+    for (int t : active) {
+      Tile tile = tileAt(t);
+      errors[t] = tileError(tile);
+      uint32_t samples = getStats(tile.x0, tile.y0).samples;
+      if (errors[t] <= convergeError or samples >= convergeSamples) {
+        converged += errors[t] <= convergeError;
+        tileSamples[t].store(samples, std::memory_order_release);
+      } else {
+        next.push_back(t);
+      }
+    }
+    if (checkpoint and checkpoint->due()) saveCheckpoint();
+
+    // The noisiest tiles go first, with as many samples as their error
+    // says they still need, at most doubling them in a round
+    std::stable_sort(next.begin(), next.end(), [&](int a, int b) {return errors[a] > errors[b];});
+    runPass(scene, replicas, next.size(), [&](Scene& tileScene, int k) {
+      Tile tile = tileAt(next[k]);
+      int samples = getStats(tile.x0, tile.y0).samples;
+      float ratio = errors[next[k]] / convergeError;
+      int needed = (int) ceil(min(samples * ratio * ratio, 2.f * samples)) - samples;
+      int batch = min(max(needed, CONVERGE_MIN_BATCH), convergeSamples - samples);
+      rays += sampleTile(tileScene, tile, batch);
+    });
+    active.swap(next);
+  }
+  return converged;
+}
+
+bool Raytracer::saveSampleMap(const string& mapFname) {
+  if (pixelStats.empty()) {
+    std::cerr << "Only renders sampled until they converge or progressively record where samples went\n";
+    return false;
+  }
+  uint32_t maxSamples = 1;
+  for (auto& stats : pixelStats) maxSamples = max(maxSamples, stats.samples);
+  std::unique_ptr<ImageWriter> writer = ImageWriter::create(mapFname);
+  if (isPartial()) writer->setRegion(getRegion());
+  bool ok = writer->open(mapFname, partWidth, partHeight);
+  vector<float> row((size_t) partWidth*3);
+  for (int j = partY; j < partY + partHeight and ok; j++) {
+    for (int i = partX; i < partX + partWidth; i++) {
+      // Black for no samples, then red, yellow and white for the most
+      float t = 3.f * getStats(i, j).samples / maxSamples;
+      for (int c = 0; c < 3; c++) row[(i - partX)*3 + c] = glm::clamp(t - c, 0.f, 1.f);
+    }
+    ok = writer->writeRow(row.data());
+  }
+  if (!(ok and writer->close())) {
+    std::cerr << "Unable to write sample map " << mapFname << "\n";
+    return false;
+  }
+  return true;
+}
+
+void Raytracer::setConvergence(float error, int maxSamples) {
+  convergeError = error;
+  convergeSamples = max(maxSamples, 0);
+}
+
+Raytracer::PixelSample Raytracer::traceSample(Scene& scene, float x, float y) {
+  PixelSample sample;
+  uint32_t xBits, yBits;
+  memcpy(&xBits, &x, sizeof(x));
+  memcpy(&yBits, &y, sizeof(y));
+  sample.color = radiance(scene, rayCast(x, y, scene), sampleSeed(xBits, yBits, 0),
+                          &sample.object, &sample.normal);
+  return sample;
+}
+
+bool Raytracer::samplesDiffer(Scene& scene, const PixelSample& a, const PixelSample& b) {
+  if ((a.object < 0) != (b.object < 0)) return true;
+  if (a.object >= 0 and a.object != b.object) {
+    // Triangles of a mesh are objects of their own, so objects only
+    // count as different surfaces when their materials are
+    materialProperties ma = scene.sceneObjects[a.object]->getMaterialProperties();
+    materialProperties mb = scene.sceneObjects[b.object]->getMaterialProperties();
+    if (ma.ambient != mb.ambient or ma.diffuse != mb.diffuse or ma.specular != mb.specular or
+        ma.emission != mb.emission or ma.shininess != mb.shininess) return true;
+  }
+  if (a.object >= 0 and dot(a.normal, b.normal) < ADAPTIVE_NORMAL_COS) return true;
+  // Contrast of the colours as they end up in the image
+  vec3 contrast = abs(glm::clamp(a.color, 0.f, 1.f) - glm::clamp(b.color, 0.f, 1.f));
+  return max(contrast.x, max(contrast.y, contrast.z)) > adaptiveContrast;
+}
+
+bool Raytracer::isOneRayPerPixel() {
+  return samplesPerPixel == 1 and adaptiveSamples == 0 and !isConverging() and
+    integrator == INTEGRATOR_WHITTED;
+}
+
+int Raytracer::adaptiveLevels() {
+  int levels = 0;
+  while (4 << 2*levels <= adaptiveSamples) levels++;
+  return levels;
+}
+
+void Raytracer::setAdaptiveSampling(int maxSamples, float contrast) {
+  adaptiveSamples = max(maxSamples, 0);
+  adaptiveContrast = contrast > 0 ? contrast : 0.1;
+}
+
+vector<Scene> Raytracer::replicateScene(Scene& scene) {
+  vector<Scene> replicas(pool->numNodes());
+  pool->run([&](int thread) {
+    // The first thread of every node does the copy, so the objects, the
+    // mesh arrays and the BVH are all allocated in the memory of the node
+    if (thread >= pool->numNodes()) return;
+    Scene& replica = replicas[pool->nodeOf(thread)];
+    replica = scene;
+    MeshCopies meshes;
+    for (auto& obj : replica.sceneObjects) obj = obj->clone(meshes);
+    if (scene.bvh) replica.bvh = scene.bvh->copy(scene.sceneObjects.size());
+  });
+  return replicas;
+}
+
+uint32_t Raytracer::jitterSeed(int i, int j) {
+  return hashPixel(i, j);
+}
+
+vec3 Raytracer::tracePixel(Scene& scene, int i, int j) {
+  vec3 color(0.);
+  float weightSum = 0;
+  for (int k = 0; k < samplesPerPixel; k++) {
+    float weight;
+    glm::vec2 sample = samplePosition(i, j, k, weight);
+    if (weight == 0) continue;
+    vec3 rayDirection = rayCast(sample.x, sample.y, scene);
+
+    color += weight * radiance(scene, rayDirection, sampleSeed(i, j, k));
+    weightSum += weight;
+  }
+  return weightSum > 0 ? color / weightSum : color;
+}
+
+glm::vec2 Raytracer::samplePosition(int i, int j, int k, float& weight) {
+  // Convention: a single ray is cast through center of pixel
+  if (samplesPerPixel == 1 and !isConverging() and !isProgressive()) {
+    weight = 1;
+    return glm::vec2(i+0.5, j+0.5);
+  }
+  // R2 sequence (generalised golden ratio), rotated by a random offset per pixel
+  uint32_t h = hashPixel(i, j);
+  double u = (h & 0xffff) / 65536.0 + k * 0.7548776662466927;
+  double v = (h >> 16) / 65536.0 + k * 0.5698402909980532;
+  float dx = (2*(u - floor(u)) - 1) * filterRadius;
+  float dy = (2*(v - floor(v)) - 1) * filterRadius;
+
+  auto profile = [&](float d) {
+    switch (filter) {
+      case PIXEL_FILTER_TENT:
+        return max(0.f, 1 - std::abs(d) / filterRadius);
+      case PIXEL_FILTER_GAUSSIAN:
+        return max(0.f, expf(-2*d*d) - expf(-2*filterRadius*filterRadius));
+      default:
+        return 1.f;
+    }
+  };
+  weight = profile(dx) * profile(dy);
+  return glm::vec2(i+0.5 + dx, j+0.5 + dy);
+}
+
+bool Raytracer::setSampling(int spp, PixelFilter pixelFilter, float radius) {
+  float defaultRadius[] = {0.5, 1, 1.5};
+  if (pixelFilter < PIXEL_FILTER_BOX or pixelFilter > PIXEL_FILTER_GAUSSIAN) {
+    std::cerr << "Unknown filter " << (int) pixelFilter << " Skipping \n";
+    return false;
+  }
+  samplesPerPixel = max(spp, 1);
+  filter = pixelFilter;
+  filterRadius = radius > 0 ? radius : defaultRadius[filter];
+  return true;
+}
 
-      // Recursively raytrace a given ray through the scene
-      // accounting for shadows and reflections
-      color = recursiveRayTrace(scene, scene.eye, rayDirection,
-                                currentDepth);
-      // height - j as FreeImage array is inverted
-      // origin at bottom left instead of top left
-      // height - j -1 to align properly with autograder
-      setColor(color, i, height-j-1);
+vec3 Raytracer::radiance(Scene& scene, vec3 rayDirection, uint32_t seed,
+                         int* hitObject, vec3* hitNormal) {
+  if (integrator == INTEGRATOR_PATH)
+    return pathTrace(scene, scene.eye, rayDirection, seed, hitObject, hitNormal);
+  // Recursively raytrace a given ray through the scene
+  // accounting for shadows and reflections
+  return recursiveRayTrace(scene, scene.eye, rayDirection, 0, hitObject, hitNormal);
+}
+
+// Direction around a normal, with a density proportional to its cosine with it
+static vec3 cosineSample(vec3 normal, float u1, float u2) {
+  vec3 tangent = normalize(cross(normal, std::abs(normal.x) > 0.1f ? vec3(0, 1, 0) : vec3(1, 0, 0)));
+  vec3 bitangent = cross(normal, tangent);
+  float r = std::sqrt(u1), phi = 2 * glm::pi<float>() * u2;
+  return normalize(r*std::cos(phi)*tangent + r*std::sin(phi)*bitangent + std::sqrt(max(0.f, 1 - u1))*normal);
+}
+
+vec3 Raytracer::pathTrace(Scene& scene, vec3 eye, vec3 rayDirection, uint32_t seed,
+                          int* hitObject, vec3* hitNormal) {
+  std::minstd_rand generator(seed);
+  std::uniform_real_distribution<float> uniform(0.f, 1.f);
+  vec3 color(0.), throughput(1.);
+  // Epsilon to slightly shift source towards destination,
+  // to avoid object intersecting with itself
+  float epsilon = 0.001;
+  if (hitObject) *hitObject = -1;
+
+  for (int depth = 0; depth < maxdepth; depth++) {
+    auto hitResults = hitTest(scene, eye, rayDirection);
+    int objectIdx = hitResults.first;
+    vec3 hitPoint = hitResults.second;
+    if (depth == 0 and hitObject) *hitObject = objectIdx;
+    if (objectIdx == -1) break;
+
+    auto object = scene.sceneObjects[objectIdx];
+    materialProperties materialProps = object->getMaterialProperties();
+    vec3 objectNormal = object->getNorm(hitPoint);
+    if (depth == 0 and hitNormal) *hitNormal = objectNormal;
+    vec3 directionToEye = normalize(eye - hitPoint);
+    // Light leaves from the side the ray comes from
+    if (dot(objectNormal, directionToEye) < 0) objectNormal = -objectNormal;
+
+    // Light emitted by the surface, then next-event estimation: every light
+    // sampled with a shadow ray, shaded as computeColorAtPoint does. Ambient
+    // light is left out, it stands in for the indirect light traced here.
+    color += throughput * materialProps.emission;
+    for (auto l : scene.lights) {
+      if (isLightVisible(scene, hitPoint, l))
+        color += throughput * l->computeLight(hitPoint, directionToEye, materialProps.diffuse,
+                                              materialProps.specular, materialProps.shininess,
+                                              objectNormal);
+    }
+
+    // Carry on along the diffuse or the mirror lobe, chosen in proportion
+    // to their reflectance; the diffuse one is sampled by the cosine, so
+    // the Lambertian BRDF, cosine and density cancel to the diffuse colour
+    float diffuse = dot(LUMINANCE, materialProps.diffuse);
+    float specular = dot(LUMINANCE, materialProps.specular);
+    if (diffuse + specular <= 0) break;
+    float diffuseChance = diffuse / (diffuse + specular);
+    if (uniform(generator) < diffuseChance) {
+      float u1 = uniform(generator), u2 = uniform(generator);
+      rayDirection = cosineSample(objectNormal, u1, u2);
+      throughput *= materialProps.diffuse / diffuseChance;
+    } else {
+      rayDirection = -directionToEye + 2.0f * objectNormal * dot(directionToEye, objectNormal);
+      throughput *= materialProps.specular / (1 - diffuseChance);
+    }
+    eye = hitPoint + epsilon*rayDirection;
+
+    // Russian roulette: paths carrying little light are ended, the others
+    // weighted up so the estimate stays unbiased
+    if (depth + 1 >= PATH_ROULETTE_DEPTH) {
+      float survival = min(max(throughput.x, max(throughput.y, throughput.z)), 0.95f);
+      if (uniform(generator) >= survival) break;
+      throughput /= survival;
     }
   }
+  return color;
+}
+
+void Raytracer::setIntegrator(Integrator method) {
+  integrator = method;
 }
 
 vec3 Raytracer::recursiveRayTrace(Scene& scene, vec3 eye,
-                                  vec3 rayDirection, int currentDepth) {
+                                  vec3 rayDirection, int currentDepth,
+                                  int* hitObject, vec3* hitNormal) {
   vec3 color(0.,0.,0.);
+  if (hitObject) *hitObject = -1;
   if (currentDepth >= maxdepth) return color;
 
   // Get the id of the object being hit by the ray, and the hitPoint
   auto hitResults = hitTest(scene, eye, rayDirection);
   int objectIdx = hitResults.first;
   vec3 hitPoint = hitResults.second;
+  if (hitObject) *hitObject = objectIdx;
 
   if (objectIdx != -1) {
     // Get colour from ray at a single point
@@ -42,6 +757,7 @@ vec3 Raytracer::recursiveRayTrace(Scene& scene, vec3 eye,
     auto object = scene.sceneObjects[objectIdx];
     // Cast reflection ray from hitPoint
     vec3 objectNormal = object->getNorm(hitPoint);
+    if (hitNormal) *hitNormal = objectNormal;
     vec3 directionFromEye = normalize(hitPoint - eye);
 
     // Reflected ray originates at point of intersection
@@ -101,6 +817,7 @@ vec3 Raytracer::rayCast(float iCenter, float jCenter, Scene& scene) {
 }
 
 pair<int, vec3> Raytracer::hitTest(Scene& scene, vec3 eye, vec3 rayDirection) {
+  if (scene.bvh) return scene.bvh->closestHit(scene.sceneObjects, eye, rayDirection);
   float hitDistance, minHitDistance = Z_FAR;
   vec3 hitPoint(0,0,0);
   int intersectObjectIdx = -1;
@@ -123,51 +840,126 @@ bool Raytracer::isLightVisible(Scene& scene, vec3 eye, shared_ptr<LightSource> l
   vec3 lightpos = l->getLightPosition();
   float distanceToLight = l->getDistanceToLight(eye);
   vec3 rayDirection = normalize(lightpos-eye);
-  bool isVisible = true;
   // Epsilon to slightly shift source towards destination,
   // to avoid object intersecting with itself
   float epsilon = 0.001;
   eye = eye + epsilon*rayDirection;
+  // object should be between eye and lightpos
+  return !isOccluded(scene, eye, rayDirection, distanceToLight);
+}
+
+bool Raytracer::isOccluded(Scene& scene, vec3 eye, vec3 rayDirection,
+                           float maxDistance) {
+  if (scene.bvh) return scene.bvh->occluded(scene.sceneObjects, eye, rayDirection, maxDistance);
   for (auto obj : scene.sceneObjects) {
     auto objHitResults = obj->hitTest(eye, rayDirection);
     float hitDistance = objHitResults.first;
-    // object should be between eye and lightpos
-    if (hitDistance > 0 and hitDistance < distanceToLight) {
-      isVisible = false;
-      break;
-    }
+    if (hitDistance > 0 and hitDistance < maxDistance) return true;
   }
-  return isVisible;
+  return false;
 }
 
-void Raytracer::setColor(vec3 RGB, int i, int j) {
-  RGB = RGB * 255.0f;
-  //Clamp at permissible values for image
-  RGB = glm::clamp(RGB, 0.f, 255.0f);
+void Raytracer::saveImage() {
+  if (!output) {
+    // Written straight away, in the format the output name asks for
+    if (!writeImage(fname)) std::cerr << "Unable to write output file " << fname << "\n";
+    return;
+  }
+  // Images not made by rayTrace, e.g. assembled from workers
+  if (!streamed) {
+    ImageRegion region = getRegion();
+    output->beginFrame(fname, partWidth, partHeight, isPartial() ? &region : nullptr);
+    streamRows(partY, partY + partHeight);
+  }
+  output->endFrame();
+  streamed = false;
+}
 
-  RGBQUAD color;
-  color.rgbRed = RGB[0];
-  color.rgbGreen = RGB[1];
-  color.rgbBlue = RGB[2];
-  FreeImage_SetPixelColor(image, i, j, &color);
+void Raytracer::streamRows(int y0, int y1) {
+  size_t row = (y0 - framebufferY) % framebufferRows;
+  output->writeRows(y0 - partY, y1-y0, &framebuffer[row*partWidth].x);
 }
 
-void Raytracer::saveImage() {
-  FreeImage_Save(FIF_PNG, image, fname.c_str(), 0);
+CheckpointHeader Raytracer::checkpointHeader(Scene& scene, uint32_t numTiles) {
+  CheckpointHeader header;
+  memset(&header, 0, sizeof(header));
+  memcpy(header.magic, CHECKPOINT_MAGIC, 8);
+  header.version = CHECKPOINT_VERSION;
+  header.frameWidth = width;
+  header.frameHeight = height;
+  header.partX = partX;
+  header.partY = partY;
+  header.partWidth = partWidth;
+  header.partHeight = partHeight;
+  header.firstTile = firstTile;
+  header.lastTile = lastTile;
+  header.numTiles = numTiles;
+  // A cheap fingerprint of the scene: camera, depth, sampling, counts and bounds
+  float values[] = {scene.eye.x, scene.eye.y, scene.eye.z, scene.center.x, scene.center.y,
+                    scene.center.z, scene.up.x, scene.up.y, scene.up.z, scene.fieldOfViewY,
+                    (float) maxdepth, (float) samplesPerPixel, (float) filter, filterRadius,
+                    (float) adaptiveSamples, adaptiveContrast, (float) convergeSamples, convergeError,
+                    (float) integrator,
+                    (float) scene.sceneObjects.size(), (float) scene.lights.size(),
+                    scene.boundsMin.x, scene.boundsMin.y, scene.boundsMin.z,
+                    scene.boundsMax.x, scene.boundsMax.y, scene.boundsMax.z};
+  header.sceneHash = GeometryCache::hash(values, sizeof(values));
+  return header;
+}
+
+void Raytracer::setCrop(int x0, int y0, int x1, int y1, int first, int last) {
+  cropX0 = x0;
+  cropY0 = y0;
+  cropX1 = x1;
+  cropY1 = y1;
+  firstTile = first;
+  lastTile = last;
+}
+
+bool Raytracer::isPartial() {
+  int numTiles = (width + TILE_SIZE-1) / TILE_SIZE * ((height + TILE_SIZE-1) / TILE_SIZE);
+  return partX != 0 or partY != 0 or partWidth != width or partHeight != height or
+    firstTile > 0 or lastTile < numTiles-1;
+}
+
+ImageRegion Raytracer::getRegion() {
+  int numTiles = (width + TILE_SIZE-1) / TILE_SIZE * ((height + TILE_SIZE-1) / TILE_SIZE);
+  return {partX, partY, width, height, firstTile, min(lastTile, numTiles-1), TILE_SIZE};
 }
 
+// FreeImage is set up once per process, however many images are rendered
+struct FreeImageLibrary {
+  FreeImageLibrary() {FreeImage_Initialise();}
+  ~FreeImageLibrary() {FreeImage_DeInitialise();}
+};
+
 void Raytracer::init(int w, int h, string outputFname,
                      int maximumRayTraceDepth) {
-  FreeImage_Initialise();
-  int bitsPerPixel = 24;
+  static FreeImageLibrary library;
   width = w;
   height = h;
-  image = FreeImage_Allocate(width, height, bitsPerPixel);
+  // The part rendered is the crop, cut to the bands of the tiles asked
+  // for, and to their columns when they are all in one band
+  int tilesPerBand = (width + TILE_SIZE-1) / TILE_SIZE;
+  long firstBand = firstTile / tilesPerBand, lastBand = lastTile / tilesPerBand;
+  long x0 = max(cropX0, 0), y0 = max((long) cropY0, firstBand*TILE_SIZE);
+  long x1 = min(cropX1, width), y1 = min({(long) cropY1, (long) height, (lastBand+1)*TILE_SIZE});
+  if (firstBand == lastBand) {
+    x0 = max(x0, (long) firstTile % tilesPerBand * TILE_SIZE);
+    x1 = min(x1, (long) (lastTile % tilesPerBand + 1) * TILE_SIZE);
+  }
+  partX = x0;
+  partY = y0;
+  partWidth = max(x1 - x0, 0L);
+  partHeight = max(y1 - y0, 0L);
+
+  // A bounded framebuffer is allocated by rayTrace, once the threads are known
+  framebufferY = partY;
+  framebufferRows = max(partHeight, 1);
+  if (boundedMemory) framebuffer = vector<vec3>();
+  else framebuffer.assign((size_t) partWidth*partHeight, vec3(0));
 
   fname = outputFname;
   maxdepth = maximumRayTraceDepth;
 }
 
-Raytracer::~Raytracer() {
-  FreeImage_DeInitialise();
-}
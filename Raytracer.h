@@ -5,12 +5,49 @@
 
 #include <vector>
 #include <string>
-#include <FreeImage.h>
+#include <cstdint>
+#include <climits>
+#include <chrono>
 
 #include "Transform.h"
 #include "Scene.h"
+#include "ThreadPool.h"
+#include "OutputPipeline.h"
+#include "Checkpoint.h"
 
-using std::vector, std::string, std::shared_ptr, std::max, glm::vec3;
+using std::vector, std::string, std::shared_ptr, std::function, std::max, std::min, glm::vec3;
+
+// Width and height of the tiles the image is split into
+#define TILE_SIZE 32
+
+/**
+ * Reconstruction filter weighting the samples of a pixel
+ *
+ */
+enum PixelFilter {
+        PIXEL_FILTER_BOX, // Radius 0.5 by default, a plain average
+        PIXEL_FILTER_TENT, // Radius 1 by default
+        PIXEL_FILTER_GAUSSIAN // Radius 1.5 by default, standard deviation 0.5
+};
+
+/**
+ * How the light seen along a ray is computed
+ *
+ */
+enum Integrator {
+        INTEGRATOR_WHITTED, // Direct light, shadows and mirror reflections
+        INTEGRATOR_PATH // Path tracing, for global illumination
+};
+
+/**
+ * Rectangular range of pixels rendered as one unit of work.
+ * Rows are counted from the top of the image, as in Raytracer::tracePixel.
+ *
+ */
+struct Tile {
+        int id;
+        int x0, y0, x1, y1; // [x0, x1) x [y0, y1)
+};
 
 /**
  * Class to instantiate a RayTracer to render a given scene
@@ -29,7 +66,6 @@ class Raytracer {
         void init(int width=640, int height=480,
                   string fname="output.png",
                   int maxdepth=5);
-        ~Raytracer();
         /**
         * Raytrace a given scene
         *
@@ -37,16 +73,244 @@ class Raytracer {
         */
         void rayTrace(Scene& scene);
         /**
+        * Raytrace the pixels of a tile and store their colours
+        *
+        * @param scene - Object describing the composition of the scene
+        * @param tile - Range of pixels to render
+        * @return Number of rays cast through the pixels
+        */
+        long renderTile(Scene& scene, const Tile& tile);
+        /**
+        * Render with a pool of threads instead of the calling thread.
+        * If the pool spans several NUMA nodes, tiles are split between
+        * the nodes and every node traces against its own copy of the scene.
+        *
+        * @param threadPool - Pool to use, or nullptr to render serially
+        */
+        void setThreadPool(ThreadPool* threadPool) {pool = threadPool;}
+        /**
+        * Hand rows to an output pipeline as soon as their tiles are done,
+        * instead of encoding the whole image in saveImage.
+        *
+        * @param pipeline - Pipeline to use, or nullptr to save synchronously
+        */
+        void setOutputPipeline(OutputPipeline* pipeline) {output = pipeline;}
+        /**
+        * Hold only the bands of tiles being rendered instead of the whole
+        * framebuffer, so memory does not grow with the size of the image.
+        * Needs an output pipeline, which then also limits the rows it queues,
+        * and must be set before init.
+        *
+        * @param bounded - Whether to keep memory bounded
+        */
+        void setBoundedMemory(bool bounded) {boundedMemory = bounded;}
+        /**
+        * Save the progress of renders to a checkpoint every so often, and
+        * resume them from it if it was told to. Not with bounded memory.
+        *
+        * @param progress - Checkpoint to use, or nullptr for none
+        */
+        void setCheckpoint(Checkpoint* progress) {checkpoint = progress;}
+        /**
+        * Choose how the light along rays is computed. Whitted ray tracing
+        * follows mirror reflections weighted by the specular colour. Path
+        * tracing also follows diffuse reflections, for global illumination:
+        * at every bounce it samples every light with a shadow ray, then
+        * carries on along a cosine-distributed diffuse direction or the mirror
+        * one, and ends paths of little weight by Russian roulette. maxdepth
+        * still limits the bounces. Needs several samples per pixel to be
+        * free of noise, e.g. with spp, converge or a time limit.
+        *
+        * @param method - Integrator to use
+        */
+        void setIntegrator(Integrator method);
+        /**
+        * Whether rays are path traced
+        *
+        */
+        bool isPathTracing() {return integrator == INTEGRATOR_PATH;}
+        /**
+        * Cast several rays through every pixel and filter them, for anti-aliasing.
+        * The samples of a pixel follow a low-discrepancy sequence over the
+        * support of the filter, shifted by a pseudo-random amount per pixel,
+        * so images do not depend on the threads rendering them.
+        * A single sample per pixel goes through its center.
+        *
+        * @param spp - Samples per pixel
+        * @param pixelFilter - Filter weighting the samples
+        * @param radius - Radius of the filter in pixels, 0 for its default
+        * @return false if the filter is unknown, the sampling is then unchanged
+        */
+        bool setSampling(int spp, PixelFilter pixelFilter, float radius=0);
+        /**
+        * Sample pixels adaptively instead of uniformly: one sample through the
+        * center of every pixel, then pixels differing from a neighbour in
+        * contrast, surface hit or normal are split into quadrants, and
+        * quadrants differing from each other split again, down to maxSamples
+        * per pixel. Samples are averaged, spp and the filter are not used.
+        *
+        * @param maxSamples - Samples per pixel of the finest split, 0 to sample uniformly
+        * @param contrast - Difference of a colour channel, in [0, 1], that
+        *                   counts as an edge; 0 for the default of 0.1
+        */
+        void setAdaptiveSampling(int maxSamples, float contrast=0);
+        /**
+        * Sample tiles until they converge instead of a fixed number of times.
+        * Every pixel keeps the running mean and variance of its samples;
+        * after a first few samples, tiles get more in rounds, the noisiest
+        * first and as many as their error asks for, until the relative
+        * standard error of their luminance is below error or they have
+        * maxSamples per pixel. Samples follow spp's sequence and filter,
+        * adaptive sampling is not used.
+        *
+        * @param error - Relative standard error tiles stop at, e.g. 0.01
+        * @param maxSamples - Most samples per pixel, 0 for a fixed spp
+        */
+        void setConvergence(float error, int maxSamples);
+        /**
+        * Whether tiles are sampled until they converge
+        *
+        */
+        bool isConverging() {return convergeSamples > 0;}
+        /**
+        * Render progressive passes until a deadline instead of a fixed number
+        * of samples: a first pass casting one sample through every pixel,
+        * then passes doubling the samples, following spp's sequence and filter.
+        * Rendering stops at the deadline, within a sample, leaving every pixel
+        * the mean of the samples it got; adaptive sampling and convergence
+        * are not used.
+        *
+        * @param time - Deadline
+        * @param snapshotSeconds - Seconds between writes of the image so far
+        *                          to the output file, 0 for none
+        */
+        void setDeadline(std::chrono::steady_clock::time_point time, double snapshotSeconds=0);
+        /**
+        * Render a preview first: an image tracing one ray per block of
+        * 16x16 pixels, then one per 8x8 block reusing those rays, and so on
+        * down to a ray through every pixel, each level written out as soon as
+        * it is done: renamed over the output file, or as the next image of a
+        * stream. The levels ignore the sampling settings; unless the scene
+        * casts a single Whitted ray through the center of its pixels, the
+        * frame is then rendered with them. Not with bounded memory.
+        *
+        * @param enable - Whether to render previews
+        */
+        void setPreview(bool enable) {previewing = enable;}
+        /**
+        * Whether passes are rendered until a deadline
+        *
+        */
+        bool isProgressive() {return deadline != std::chrono::steady_clock::time_point::max();}
+        /**
+        * Write an image of where the samples of the last render went,
+        * from black for none through red and yellow to white for the most.
+        * Only renders sampled until they converge or progressively keep
+        * track of them.
+        *
+        * @param mapFname - Name of the image file
+        * @return false if there is no map or it could not be written
+        */
+        bool saveSampleMap(const string& mapFname);
+        /**
+        * Get the number of samples per pixel
+        *
+        */
+        int getSamplesPerPixel() {return samplesPerPixel;}
+        /**
+        * Compute where a sample of a pixel goes and the weight of its colour
+        *
+        * @param i - Pixel coord (column)
+        * @param j - Pixel coord (row, from the top of the image)
+        * @param k - Number of the sample, from 0
+        * @param weight - Set to the filter weight of the sample
+        * @return Image coordinates the ray of the sample goes through
+        */
+        glm::vec2 samplePosition(int i, int j, int k, float& weight);
+        /**
+        * Seed of the jitter of triangle edges while tracing a pixel, given to
+        * seedJitter before its rays so that it comes out the same whichever
+        * tile, crop or thread it is traced in
+        *
+        * @param i - Pixel coord (column)
+        * @param j - Pixel coord (row, from the top of the image)
+        */
+        static uint32_t jitterSeed(int i, int j);
+        /**
+        * Render only part of the frame, e.g. one slot of a render farm.
+        * Rays are still cast through the whole frame, so parts rendered
+        * separately join without seams. The output image is the bounding
+        * box of the pixels rendered, written with its place in the frame.
+        * Must be set before init.
+        *
+        * @param x0, y0, x1, y1 - Pixels to render, [x0, x1) x [y0, y1) from the top left
+        * @param first, last - Range of tiles to render, numbered in rows from the top
+        *                      of the frame; pixels of other tiles in the output are black
+        */
+        void setCrop(int x0, int y0, int x1, int y1, int first, int last);
+        /**
+        * Whether only part of the frame is rendered
+        *
+        */
+        bool isPartial();
+        /**
+        * Whether the crop and tiles asked for leave no pixel of the frame
+        *
+        */
+        bool isEmpty() {return partWidth == 0 or partHeight == 0;}
+        /**
+        * Get the place of the output image in the frame, once init has been called
+        *
+        */
+        ImageRegion getRegion();
+        /**
+        * Compute the colour of a single pixel
+        *
+        * @param scene - Object describing the composition of the scene
+        * @param i - Pixel coord (column)
+        * @param j - Pixel coord (row, from the top of the image)
+        * @return The filtered colour of the samples of the pixel
+        */
+        vec3 tracePixel(Scene& scene, int i, int j);
+        /**
+        * Compute the colour seen along a ray from the eye, with the integrator chosen
+        *
+        * @param scene - Object describing the composition of the scene
+        * @param rayDirection - Direction of the ray
+        * @param seed - Seed of the random numbers of a path, e.g. from the pixel and sample
+        * @param hitObject - Set to the object the ray hits first, -1 for none, if not nullptr
+        * @param hitNormal - Set to the normal where it hits, if not nullptr
+        * @return The colour visible along this ray
+        */
+        vec3 radiance(Scene& scene, vec3 rayDirection, uint32_t seed,
+                      int* hitObject=nullptr, vec3* hitNormal=nullptr);
+        /**
+        * Path trace a single ray, see setIntegrator
+        *
+        * @param scene - Object describing the composition of the scene
+        * @param eye - Origin of the ray
+        * @param rayDirection - Direction of the ray
+        * @param seed - Seed of the random numbers of the path
+        * @param hitObject - Set to the object the ray hits first, -1 for none, if not nullptr
+        * @param hitNormal - Set to the normal where it hits, if not nullptr
+        * @return The light arriving along the ray
+        */
+        vec3 pathTrace(Scene& scene, vec3 eye, vec3 rayDirection, uint32_t seed,
+                       int* hitObject=nullptr, vec3* hitNormal=nullptr);
+        /**
         * Recursively raytrace a single ray
         *
         * @param scene - Object describing the composition of the scene
         * @param eye - Vector describing eye location
         * @param rayDirection - Vector describing direction of ray
         * @param currentDepth - Number of times ray has bounced
+        * @param hitObject - Set to the object the ray hits first, -1 for none, if not nullptr
+        * @param hitNormal - Set to the normal where it hits, if not nullptr
         * @return The colour visible from this ray
         */
         vec3 recursiveRayTrace(Scene& scene, vec3 eye,
-                               vec3 rayDirection, int currentDepth);
+                               vec3 rayDirection, int currentDepth,
+                               int* hitObject=nullptr, vec3* hitNormal=nullptr);
         /**
         * Compute the colour from a single raytrace (without reflections)
         *
@@ -87,23 +351,253 @@ class Raytracer {
         */
         bool isLightVisible(Scene& scene, vec3 eye, shared_ptr<LightSource> light);
         /**
-        * Set the colour of a pixel
+        * Checks if any object lies along a ray, closer than a given distance.
         *
-        * @param RGB - Colour to be set
-        * @param i - Pixel coord
-        * @param j - Pixel coord
+        * @param scene - Object describing the composition of the scene
+        * @param eye - Origin of the ray
+        * @param rayDirection - Direction of the ray being cast
+        * @param maxDistance - Objects further away than this are ignored
+        * @return boolean indicating whether the ray is blocked
+        */
+        bool isOccluded(Scene& scene, vec3 eye, vec3 rayDirection, float maxDistance);
+        /**
+        * Set the colour of a pixel in the framebuffer. Threads may set
+        * pixels of different tiles at the same time.
+        *
+        * @param RGB - Linear colour, not clamped
+        * @param i - Pixel coord (column)
+        * @param j - Pixel coord (row, from the top of the image)
         */
-        void setColor(vec3 RGB, int i, int j);
+        void setColor(vec3 RGB, int i, int j) {
+                framebuffer[(size_t) ((j - framebufferY) % framebufferRows)*partWidth + i - partX] = RGB;
+        }
         /**
-        * Save the output image after raytracing
+        * Get the colour of a pixel of the framebuffer
+        *
+        * @param i - Pixel coord (column)
+        * @param j - Pixel coord (row, from the top of the image)
+        */
+        vec3 getColor(int i, int j) {
+                return framebuffer[(size_t) ((j - framebufferY) % framebufferRows)*partWidth + i - partX];
+        }
+        /**
+        * Save the output image after raytracing.
+        * With an output pipeline this only queues the end of the frame.
         *
         */
         void saveImage();
+        /**
+        * Time writing the rendered image in every output format, instead of saving it
+        *
+        * @return false if a format could not be written
+        */
+        bool benchmarkOutput() {
+                return benchmarkImageWriters(&framebuffer[0].x, partWidth, partHeight, fname);
+        }
+        /**
+        * Get the maximum number of bounces for a ray
+        *
+        */
+        int getMaxDepth() {return maxdepth;}
+        /**
+        * Get the name of the output file, - for standard output
+        *
+        */
+        const string& getOutputFname() {return fname;}
+        /**
+        * Write to another file than the scene file names
+        *
+        * @param outputFname - Name of output file, - for standard output
+        */
+        void setOutputFname(const string& outputFname) {fname = outputFname;}
 
     private:
-        FIBITMAP* image;
+        // Running statistics of the samples of a pixel, whose weighted
+        // mean is its colour in the framebuffer
+        struct PixelStats {
+                float weight = 0; // Sum of the filter weights
+                float m2 = 0; // Weighted sum of squared deviations of the luminance
+                uint32_t samples = 0;
+        };
+        PixelStats& getStats(int i, int j) {
+                return pixelStats[(size_t) (j - partY)*partWidth + i - partX];
+        }
+        /**
+        * Add samples to every pixel of a tile, updating their statistics
+        *
+        * @param samples - Samples per pixel to add
+        * @param until - Time to stop at, even if some samples are missing
+        * @return Number of samples cast
+        */
+        long sampleTile(Scene& scene, const Tile& tile, int samples,
+                        std::chrono::steady_clock::time_point until =
+                        std::chrono::steady_clock::time_point::max());
+        /**
+        * Render passes of every tile, each doubling the samples, until the deadline
+        *
+        * @param replicas - Copies of the scene per NUMA node, see runPass
+        * @param tileAt - Tile of a given number
+        */
+        void renderProgressive(Scene& scene, vector<Scene>& replicas, int numTiles,
+                               const function<Tile(int)>& tileAt);
+        /**
+        * Render the levels of a preview, writing out all but the last one
+        *
+        * @param replicas - Copies of the scene per NUMA node, see runPass
+        * @param tileAt - Tile of a given number
+        */
+        void renderPreview(Scene& scene, vector<Scene>& replicas, int numTiles,
+                           const function<Tile(int)>& tileAt);
+        /**
+        * Write the image to a file, in the format its name asks for
+        *
+        * @return false on a write error
+        */
+        bool writeImage(const string& imageFname);
+        /**
+        * Replace the output file with the image rendered so far
+        *
+        * @return false on a write error
+        */
+        bool saveSnapshot();
+        /**
+        * Estimate the error left in a tile
+        *
+        * @return Root mean square of the relative standard error of its pixels
+        */
+        float tileError(const Tile& tile);
+        /**
+        * Sample the tiles not finished yet in rounds until they converge or
+        * reach the cap, the noisiest first
+        *
+        * @param replicas - Copies of the scene per NUMA node, see runPass
+        * @param tileAt - Tile of a given number
+        * @param tileSamples - Samples of every finished tile, 0 for the others;
+        *                      set as tiles finish
+        * @param rays - Incremented by the number of samples cast
+        * @param saveCheckpoint - Saves a checkpoint
+        * @return Number of tiles that converged below the error
+        */
+        int convergeTiles(Scene& scene, vector<Scene>& replicas, int numTiles,
+                          const function<Tile(int)>& tileAt,
+                          vector<std::atomic<uint32_t>>& tileSamples,
+                          std::atomic<long>& rays, const function<void()>& saveCheckpoint);
+        // A primary ray and what it hit, to find edges between pixels
+        struct PixelSample {
+                vec3 color;
+                int object; // -1 for none
+                vec3 normal;
+        };
+        /**
+        * Render a tile with adaptive sampling
+        *
+        * @return Number of rays cast through the pixels
+        */
+        long renderTileAdaptive(Scene& scene, const Tile& tile);
+        /**
+        * Colour of a square of the image, from a sample through each of its
+        * quadrants, those differing from the others being split again.
+        * The sample already traced in the square is used for its quadrant.
+        *
+        * @param x, y - Top left corner of the square, in pixels
+        * @param size - Side of the square, in pixels
+        * @param known - Sample already traced in the square
+        * @param knownX, knownY - Where known was traced, in pixels
+        * @param levels - Number of times it may be split, at least 1
+        * @param rays - Incremented by the number of rays cast
+        */
+        vec3 refineSquare(Scene& scene, float x, float y, float size, const PixelSample& known,
+                          float knownX, float knownY, int levels, long& rays);
+        /**
+        * Trace a ray through a point of the image
+        *
+        * @param x, y - Image coordinates, in pixels
+        */
+        PixelSample traceSample(Scene& scene, float x, float y);
+        /**
+        * Whether two samples are on either side of an edge: one hits a surface
+        * and the other not, their surfaces or normals differ, or their colours
+        * differ by more than adaptiveContrast
+        *
+        */
+        bool samplesDiffer(Scene& scene, const PixelSample& a, const PixelSample& b);
+        /**
+        * Number of times an adaptively sampled pixel may be split into quadrants,
+        * the most that keep its 4^levels rays within adaptiveSamples
+        *
+        */
+        int adaptiveLevels();
+        /**
+        * Whether the frame is a Whitted ray through the center of every
+        * pixel, which the last level of a preview already is
+        *
+        */
+        bool isOneRayPerPixel();
+        /**
+        * Copy the scene once per NUMA node of the pool: its objects, the
+        * arrays of its meshes and its BVH, every copy made by a thread of
+        * its node so its memory is local to that node.
+        *
+        * @param scene - Scene to copy
+        * @return One scene per node
+        */
+        vector<Scene> replicateScene(Scene& scene);
+        /**
+        * Render a pass over the tiles, on the pool if there is one, every
+        * NUMA node starting on its own range
+        *
+        * @param scene - Scene to render
+        * @param replicas - Copies of the scene per NUMA node from replicateScene,
+        *                   made once per render; empty to use scene everywhere
+        * @param numTiles - Number of tiles
+        * @param renderTileAt - Renders a tile, given the scene to use and its number
+        */
+        void runPass(Scene& scene, vector<Scene>& replicas, int numTiles,
+                     const function<void(Scene&, int)>& renderTileAt);
+        /**
+        * Identify the render in progress, for its checkpoint
+        *
+        * @param numTiles - Number of tiles of the part rendered
+        */
+        CheckpointHeader checkpointHeader(Scene& scene, uint32_t numTiles);
+        /**
+        * Send finished rows of the image to the output pipeline
+        *
+        * @param y0 - First row, counted from the top of the image
+        * @param y1 - Row after the last one
+        */
+        void streamRows(int y0, int y1);
+
+        ThreadPool* pool = nullptr;
+        OutputPipeline* output = nullptr;
+        Checkpoint* checkpoint = nullptr;
+        // Whether the rows of the current image went to the pipeline already
+        bool streamed = false;
+        bool boundedMemory = false;
+        // Crop and tiles asked for, and the part of the frame they leave
+        int cropX0 = 0, cropY0 = 0, cropX1 = INT_MAX, cropY1 = INT_MAX;
+        int firstTile = 0, lastTile = INT_MAX;
+        int partX, partY, partWidth, partHeight;
+        // Linear colour of every pixel of the part, rows from the top of the image.
+        // Row j is at (j - framebufferY) % framebufferRows, which with bounded
+        // memory makes it a ring of bands
+        vector<vec3> framebuffer;
+        int framebufferY, framebufferRows;
         int width, height;
         int maxdepth;
+        int samplesPerPixel = 1;
+        PixelFilter filter = PIXEL_FILTER_BOX;
+        float filterRadius = 0.5;
+        int adaptiveSamples = 0; // 0 for uniform sampling
+        float adaptiveContrast = 0.1;
+        int convergeSamples = 0; // 0 for a fixed spp
+        float convergeError = 0.01;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        double snapshotInterval = 0; // Seconds, 0 for no snapshots
+        bool previewing = false;
+        Integrator integrator = INTEGRATOR_WHITTED;
+        // Of every pixel of the part, when sampling until tiles converge or progressively
+        vector<PixelStats> pixelStats;
         string fname;
 };
 
@@ -22,6 +22,33 @@ void Scene::addLight(std::shared_ptr<LightSource> light) {
 }
 
 void Scene::addObjectToScene(std::shared_ptr<SceneObject> sceneObj) {
+  vec3 centroid = sceneObj->getCentroid();
+  boundsMin = glm::min(boundsMin, centroid);
+  boundsMax = glm::max(boundsMax, centroid);
+  if (partitionAxis >= 0 and (centroid[partitionAxis] < partitionMin or
+                              centroid[partitionAxis] >= partitionMax)) return;
   sceneObjects.push_back(sceneObj);
 }
 
+void Scene::addMesh(shared_ptr<const MeshData> mesh, size_t first, size_t count,
+                    const materialProperties& materialProps, const mat4& transform) {
+  // The scene holds pointers into the block that share its ownership
+  auto triangles = std::make_shared<vector<MeshTriangle>>();
+  triangles->reserve(count);
+  for (size_t i = first; i < first + count; i++) {
+    triangles->emplace_back(mesh, i, materialProps, transform);
+    addObjectToScene(shared_ptr<SceneObject>(triangles, &triangles->back()));
+  }
+  geometryAdded();
+}
+
+void Scene::geometryAdded() {
+  if (bvhBuilder) bvhBuilder->objectsAdded(sceneObjects);
+}
+
+void Scene::setPartition(int axis, float lo, float hi) {
+  partitionAxis = axis;
+  partitionMin = lo;
+  partitionMax = hi;
+}
+
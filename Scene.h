@@ -6,9 +6,11 @@
 #include <vector>
 #include <string>
 #include <memory>
+#include <cfloat>
 #include "Transform.h"
 #include "SceneObjects.h"
 #include "Lights.h"
+#include "Bvh.h"
 
 using std::vector, std::string, std::shared_ptr, glm::vec3;
 
@@ -50,6 +52,35 @@ class Scene {
         * applied to the object. Identity by default
         */
         void addObjectToScene(shared_ptr<SceneObject> sceneObj);
+        /**
+        * Add triangles of a mesh. They are allocated together
+        * and read their vertices from the mesh arrays.
+        *
+        * @param mesh - Arrays of the mesh
+        * @param first - First triangle to add
+        * @param count - Number of triangles
+        * @param materialProps - Material of the triangles
+        * @param transform - Transform of the triangles
+        */
+        void addMesh(shared_ptr<const MeshData> mesh, size_t first, size_t count,
+                     const materialProperties& materialProps, const mat4& transform);
+        /**
+        * Hand the objects added so far to the BVH builder, if the
+        * scene has one. Called after every block of geometry.
+        *
+        */
+        void geometryAdded();
+        /**
+        * Only keep objects whose centroid lies in a slab of space.
+        * Objects outside of it are dropped by addObjectToScene,
+        * but still counted in the geometry bounds.
+        * An empty range keeps no geometry at all.
+        *
+        * @param axis - Axis (0, 1, 2) along which the slab is cut
+        * @param lo - Lower end of the slab (inclusive)
+        * @param hi - Upper end of the slab (exclusive)
+        */
+        void setPartition(int axis, float lo, float hi);
 
         // Camera params
         vec3 eye, center, up;
@@ -60,6 +91,16 @@ class Scene {
         vector<shared_ptr<SceneObject>> sceneObjects;
         // Lights in the scene
         vector<shared_ptr<LightSource>> lights;
+        // Hierarchy over sceneObjects, rays test every object without one
+        shared_ptr<Bvh> bvh;
+        // Builds bvh while the scene is read, if set
+        shared_ptr<BvhBuilder> bvhBuilder;
+
+        // Bounds of the centroids of all objects added, kept or not
+        vec3 boundsMin = vec3(FLT_MAX), boundsMax = vec3(-FLT_MAX);
+        // Partition of the geometry held by this scene, -1 for everything
+        int partitionAxis = -1;
+        float partitionMin, partitionMax;
 };
 
 #endif // SCENE_H_
@@ -1,10 +1,37 @@
 #include <vector>
 #include <iostream>
-#include <glm/gtc/random.hpp>
+#include <cfloat>
+#include <cstring>
 #include "SceneObjects.h"
 
 using std::vector, std::pair, std::make_pair, glm::vec3;
 
+// Every render thread has its own seed so they don't contend on one
+static thread_local uint32_t jitterSeed;
+
+void seedJitter(uint32_t seed) {
+  jitterSeed = seed;
+}
+
+// Jitter of a point tested against a triangle, drawn from the seed and the
+// point alone, so it does not depend on the tests made before it.
+// The sum of four random bytes is close to normal, with a standard
+// deviation of 147.8; the jitter has a mean and deviation of 0.001.
+static float jitterAt(const vec3& point) {
+  uint32_t bits[3];
+  memcpy(bits, &point, sizeof(bits));
+  uint32_t h = jitterSeed;
+  for (uint32_t b : bits) {
+    h ^= b;
+    h *= 0x7feb352du;
+    h ^= h >> 15;
+    h *= 0x846ca68bu;
+    h ^= h >> 16;
+  }
+  float sum = (h & 255) + (h >> 8 & 255) + (h >> 16 & 255) + (h >> 24);
+  return -0.001f + 0.001f * (sum - 510) / 147.8f;
+}
+
 void Triangle::printInfo() {
   std::cout <<
     "Object Type : Triangle\n\
@@ -22,12 +49,12 @@ void Triangle::printInfo() {
     Shininess: " << materialProps.shininess << "\n";
 }
 
-pair<float, vec3> Triangle::hitTest(vec3& eye, vec3& rayDirection) {
+// Intersect a ray, already in object space, with a triangle
+static pair<float, vec3> hitTriangle(const vec3& a, const vec3& b, const vec3& c,
+                                     const vec3& triNorm, const mat4& transform,
+                                     vec3& eye, vec3& transEye, vec3& transDirection) {
   vec3 hitPoint, pointA, pointB, pointC;
   float ray2Plane, hitDistance=0.;
-  auto transformedRay = getTransformedRay(eye, rayDirection);
-  vec3 transEye = transformedRay.first;
-  vec3 transDirection = transformedRay.second;
 
   // Find distance between ray and plane
   ray2Plane = ( dot(a, triNorm) - dot(transEye, triNorm) ) / dot( transDirection, triNorm );
@@ -35,7 +62,7 @@ pair<float, vec3> Triangle::hitTest(vec3& eye, vec3& rayDirection) {
 
   // Add noise to slightly jitter the points
   // Helps deal with precision issues at edges of triangles
-  float eps = glm::gaussRand(-0.001f, 0.001f);
+  float eps = jitterAt(hitPoint);
 
   pointA = normalize(cross(b-a, hitPoint-a+eps));
   pointB = normalize(cross(c-b, hitPoint-b+eps));
@@ -54,12 +81,108 @@ pair<float, vec3> Triangle::hitTest(vec3& eye, vec3& rayDirection) {
   return make_pair(hitDistance, hitPoint);
 }
 
+pair<float, vec3> Triangle::hitTest(vec3& eye, vec3& rayDirection) {
+  auto transformedRay = getTransformedRay(eye, rayDirection);
+  return hitTriangle(a, b, c, triNorm, transform, eye,
+                     transformedRay.first, transformedRay.second);
+}
+
 vec3 Triangle::getNorm(vec3 hitPoint) {
   mat4 invTransposeTransform = inverse( transpose (transform) );
   vec3 transNorm = normalize(mat3(invTransposeTransform) * triNorm);
   return transNorm;
 }
 
+vec3 Triangle::getCentroid() {
+  return vec3(transform * vec4((a+b+c)/3.0f, 1.0));
+}
+
+// Box around the transformed vertices of a triangle
+static void triangleBounds(const vec3& a, const vec3& b, const vec3& c, const mat4& transform,
+                           vec3& boundsMin, vec3& boundsMax) {
+  boundsMin = vec3(FLT_MAX);
+  boundsMax = vec3(-FLT_MAX);
+  for (const vec3* v : {&a, &b, &c}) {
+    vec3 p = vec3(transform * vec4(*v, 1.0));
+    boundsMin = glm::min(boundsMin, p);
+    boundsMax = glm::max(boundsMax, p);
+  }
+}
+
+void Triangle::getBounds(vec3& boundsMin, vec3& boundsMax) {
+  triangleBounds(a, b, c, transform, boundsMin, boundsMax);
+}
+
+shared_ptr<const MeshData> MeshData::copy() const {
+  struct Arrays {
+    vector<vec3> vertices, normals;
+    vector<uint32_t> indices, normalIndices;
+  };
+  auto arrays = std::make_shared<Arrays>();
+  arrays->vertices.assign(vertices, vertices + numVertices);
+  arrays->indices.assign(indices, indices + 3*numTriangles);
+  auto data = std::make_shared<MeshData>(*this);
+  data->vertices = arrays->vertices.data();
+  data->indices = arrays->indices.data();
+  if (normalIndices) {
+    arrays->normals.assign(normals, normals + numNormals);
+    arrays->normalIndices.assign(normalIndices, normalIndices + 3*numTriangles);
+    data->normals = arrays->normals.data();
+    data->normalIndices = arrays->normalIndices.data();
+  }
+  data->storage = arrays;
+  return data;
+}
+
+shared_ptr<SceneObject> MeshTriangle::clone(MeshCopies& meshes) {
+  auto copy = std::make_shared<MeshTriangle>(*this);
+  shared_ptr<const MeshData>& local = meshes[mesh.get()];
+  if (!local) local = mesh->copy();
+  copy->mesh = local;
+  return copy;
+}
+
+void MeshTriangle::printInfo() {
+  Triangle(vertex(0), vertex(1), vertex(2), materialProps, transform).printInfo();
+}
+
+pair<float, vec3> MeshTriangle::hitTest(vec3& eye, vec3& rayDirection) {
+  auto transformedRay = getTransformedRay(eye, rayDirection);
+  return hitTriangle(vertex(0), vertex(1), vertex(2), triNorm(), transform, eye,
+                     transformedRay.first, transformedRay.second);
+}
+
+vec3 MeshTriangle::getNorm(vec3 hitPoint) {
+  vec3 norm = triNorm();
+  const uint32_t* normalIndices = mesh->normalIndices ? mesh->normalIndices + 3*index : nullptr;
+  if (normalIndices and normalIndices[0] != MESH_NO_NORMAL and
+      normalIndices[1] != MESH_NO_NORMAL and normalIndices[2] != MESH_NO_NORMAL) {
+    // Barycentric coordinates of the untransformed hit point
+    vec3 p = vec3(inverse(transform) * vec4(hitPoint, 1.0));
+    vec3 a = vertex(0), b = vertex(1), c = vertex(2);
+    vec3 n = cross(b-a, c-a);
+    float area = dot(n, n);
+    if (area > 0) {
+      float u = dot(cross(c-b, p-b), n) / area;
+      float v = dot(cross(a-c, p-c), n) / area;
+      vec3 smooth = u * mesh->normals[normalIndices[0]] + v * mesh->normals[normalIndices[1]] +
+                    (1-u-v) * mesh->normals[normalIndices[2]];
+      if (dot(smooth, smooth) > 0) norm = normalize(smooth);
+    }
+  }
+  mat4 invTransposeTransform = inverse( transpose (transform) );
+  vec3 transNorm = normalize(mat3(invTransposeTransform) * norm);
+  return transNorm;
+}
+
+vec3 MeshTriangle::getCentroid() {
+  return vec3(transform * vec4((vertex(0)+vertex(1)+vertex(2))/3.0f, 1.0));
+}
+
+void MeshTriangle::getBounds(vec3& boundsMin, vec3& boundsMax) {
+  triangleBounds(vertex(0), vertex(1), vertex(2), transform, boundsMin, boundsMax);
+}
+
 void Sphere::printInfo() {
   std::cout <<
     "Object Type : Sphere\n\
@@ -118,3 +241,20 @@ vec3 Sphere::getNorm(vec3 hitPoint) {
   normal = normalize(mat3(invTransposeTransform) * normal);
   return normal;
 }
+
+vec3 Sphere::getCentroid() {
+  return vec3(transform * vec4(center, 1.0));
+}
+
+void Sphere::getBounds(vec3& boundsMin, vec3& boundsMax) {
+  // Transformed corners of the box around the untransformed sphere
+  boundsMin = vec3(FLT_MAX);
+  boundsMax = vec3(-FLT_MAX);
+  for (int corner = 0; corner < 8; corner++) {
+    vec3 offset((corner & 1) ? radius : -radius, (corner & 2) ? radius : -radius,
+                (corner & 4) ? radius : -radius);
+    vec3 p = vec3(transform * vec4(center + offset, 1.0));
+    boundsMin = glm::min(boundsMin, p);
+    boundsMax = glm::max(boundsMax, p);
+  }
+}
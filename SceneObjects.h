@@ -1,9 +1,26 @@
 #ifndef SCENEOBJECTS_H_
 #define SCENEOBJECTS_H_
 
+#include <memory>
+#include <cstdint>
+#include <unordered_map>
 #include "Transform.h"
 
-using std::pair, std::make_pair, glm::vec3;
+using std::pair, std::make_pair, std::shared_ptr, glm::vec3;
+
+struct MeshData;
+// Copies of mesh arrays made for one copy of a scene, by original
+typedef std::unordered_map<const MeshData*, shared_ptr<const MeshData>> MeshCopies;
+
+/**
+ * Seed the jitter of triangle edges on the calling thread. The jitter of a
+ * test depends on the seed and the point tested only, so pixels render the
+ * same whichever thread traces them, in whatever order, and whichever other
+ * objects their rays are tested against
+ *
+ * @param seed - Seed of the generator, e.g. one per pixel
+ */
+void seedJitter(uint32_t seed);
 
 /**
  * Store the various material properties of an object.
@@ -55,6 +72,34 @@ class SceneObject {
         */
         virtual vec3 getNorm(vec3 hitPoint) = 0;
 
+        /**
+        * Fetch the center of the object in world space.
+        * Used to assign objects to spatial partitions.
+        *
+        * @return Centroid of object after applying its transform
+        */
+        virtual vec3 getCentroid() = 0;
+
+        /**
+        * Fetch the axis aligned box around the object in world space.
+        * Used to build the bounding volume hierarchy.
+        *
+        * @param boundsMin - Set to the lowest corner of the box
+        * @param boundsMax - Set to the highest corner of the box
+        */
+        virtual void getBounds(vec3& boundsMin, vec3& boundsMax) = 0;
+
+        /**
+        * Make a copy of the object.
+        * The copy is allocated by the calling thread, which places it
+        * in the memory of that thread's NUMA node.
+        *
+        * @param meshes - Mesh arrays copied so far for the same copy of
+        * the scene, which the copies of their triangles share
+        * @return Pointer to the copy
+        */
+        virtual shared_ptr<SceneObject> clone(MeshCopies& meshes) = 0;
+
         /**
         * Return a reference to the material properties of the object.
         *
@@ -124,6 +169,24 @@ class Triangle : public SceneObject {
         */
         virtual vec3 getNorm(vec3 hitPoint = vec3(0,0,0));
         /**
+        * Fetch centroid of triangle
+        *
+        * @return Average of the transformed vertices
+        */
+        virtual vec3 getCentroid();
+        /**
+        * Fetch box around the transformed vertices
+        *
+        */
+        virtual void getBounds(vec3& boundsMin, vec3& boundsMax);
+        /**
+        * Copy the triangle
+        *
+        */
+        virtual shared_ptr<SceneObject> clone(MeshCopies& meshes) {
+                return std::make_shared<Triangle>(*this);
+        }
+        /**
         * Perform hit test on triangle.
         * Check if the ray cast from eye
         * intersects with the triangle.
@@ -140,6 +203,97 @@ class Triangle : public SceneObject {
         vec3 triNorm;
 };
 
+// Normal index of the corners of a triangle without vertex normals
+#define MESH_NO_NORMAL 0xffffffffu
+
+/**
+ * Vertex and index arrays of a mesh, used in place wherever they are
+ * stored, such as in a mapped binary scene file.
+ *
+ */
+struct MeshData {
+        const vec3* vertices;
+        const uint32_t* indices; // Three vertices per triangle
+        // Optional vertex normals, smoothing the shading of the triangles
+        const vec3* normals = nullptr;
+        const uint32_t* normalIndices = nullptr; // Three per triangle, or MESH_NO_NORMAL
+        shared_ptr<const void> storage; // Keeps the arrays alive
+        size_t numVertices = 0, numTriangles = 0, numNormals = 0;
+
+        /**
+        * Copy the arrays into memory allocated by the calling thread,
+        * so they live on its NUMA node
+        *
+        * @return The copy, keeping its arrays alive
+        */
+        shared_ptr<const MeshData> copy() const;
+};
+
+/**
+ * Triangle of a mesh, reading its vertices from the mesh arrays
+ * instead of holding copies.
+ *
+ */
+class MeshTriangle : public SceneObject {
+  public:
+        /**
+        * Initialize a triangle of a mesh
+        *
+        * @param mesh - Arrays of the mesh
+        * @param index - Index of the triangle in the mesh
+        * @param materialProps - Material properties of object, used for lighting.
+        * @param transform - 4x4 transform to be applied to object
+        */
+        MeshTriangle(shared_ptr<const MeshData> mesh, size_t index,
+                     materialProperties materialProps,
+                     mat4 transform = mat4(1.0)) :
+                mesh(mesh), index(index),
+                SceneObject(materialProps, transform) {}
+        /**
+        * Print paramters of the triangle
+        *
+        */
+        virtual void printInfo();
+        /**
+        * Fetch surface normal of triangle, interpolated
+        * between the vertex normals when the mesh has them
+        *
+        * @param hitPoint - Point of intersection on triangle
+        * @return Normal of triangle
+        */
+        virtual vec3 getNorm(vec3 hitPoint = vec3(0,0,0));
+        /**
+        * Fetch centroid of triangle
+        *
+        * @return Average of the transformed vertices
+        */
+        virtual vec3 getCentroid();
+        /**
+        * Fetch box around the transformed vertices
+        *
+        */
+        virtual void getBounds(vec3& boundsMin, vec3& boundsMax);
+        /**
+        * Copy the triangle, and the mesh arrays the first time
+        * a triangle of the mesh is copied
+        *
+        */
+        virtual shared_ptr<SceneObject> clone(MeshCopies& meshes);
+        /**
+        * Perform hit test on triangle, as Triangle::hitTest
+        *
+        */
+        virtual pair<float, vec3> hitTest(vec3& eye, vec3& rayDirection);
+  private:
+        const vec3& vertex(int k) {return mesh->vertices[mesh->indices[3*index + k]];}
+        vec3 triNorm() {
+                return normalize(cross(vertex(1)-vertex(0), vertex(2)-vertex(0)));
+        }
+
+        shared_ptr<const MeshData> mesh;
+        size_t index;
+};
+
 /**
  * Sphere object
  *
@@ -175,6 +329,24 @@ class Sphere : public SceneObject {
         */
         virtual vec3 getNorm(vec3 hitPoint);
         /**
+        * Fetch centroid of sphere
+        *
+        * @return Transformed center of sphere
+        */
+        virtual vec3 getCentroid();
+        /**
+        * Fetch box around the transformed sphere
+        *
+        */
+        virtual void getBounds(vec3& boundsMin, vec3& boundsMax);
+        /**
+        * Copy the sphere
+        *
+        */
+        virtual shared_ptr<SceneObject> clone(MeshCopies& meshes) {
+                return std::make_shared<Sphere>(*this);
+        }
+        /**
         * Perform hit test on sphere.
         * Check if the ray cast from eye
         * intersects with the sphere.
@@ -0,0 +1,121 @@
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+
+#include "ThreadPool.h"
+
+using namespace std;
+
+// Parse a /sys cpulist such as "0-3,8-11"
+static vector<int> parseCpuList(const string& list) {
+  vector<int> cpus;
+  stringstream s(list);
+  string range;
+  while (getline(s, range, ',')) {
+    if (range.find_first_not_of(" \t\r\n") == string::npos) continue;
+    int first, last;
+    size_t dash = range.find('-');
+    first = stoi(range.substr(0, dash));
+    last = dash == string::npos ? first : stoi(range.substr(dash+1));
+    for (int cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+NumaTopology NumaTopology::detect() {
+  NumaTopology topology;
+  cpu_set_t allowed;
+  CPU_ZERO(&allowed);
+  bool haveMask = sched_getaffinity(0, sizeof(allowed), &allowed) == 0;
+
+  for (int node = 0; ; node++) {
+    ifstream in("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+    if (!in.is_open()) break;
+    string list;
+    getline(in, list);
+    vector<int> cpus;
+    for (int cpu : parseCpuList(list))
+      if (!haveMask or CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    // Memory-only nodes have no CPUs
+    if (!cpus.empty()) topology.nodeCpus.push_back(cpus);
+  }
+
+  // No NUMA information: every CPU we may use is on a single node
+  if (topology.nodeCpus.empty()) {
+    vector<int> cpus;
+    for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+      if (haveMask and CPU_ISSET(cpu, &allowed)) cpus.push_back(cpu);
+    if (cpus.empty()) cpus.push_back(0);
+    topology.nodeCpus.push_back(cpus);
+  }
+  return topology;
+}
+
+ThreadPool::ThreadPool(int numThreads, bool pin) :
+  generation(0), running(0), stopping(false) {
+  if (pin) {
+    topology = NumaTopology::detect();
+  } else {
+    // Unpinned threads go wherever the OS puts them
+    topology.nodeCpus.push_back({});
+  }
+  if (numThreads <= 0) numThreads = max(1u, thread::hardware_concurrency());
+
+  for (int t = 0; t < numThreads; t++) {
+    threads.emplace_back(&ThreadPool::threadLoop, this, t);
+    if (pin) {
+      // Spread threads over the cores of their node
+      const vector<int>& cpus = topology.nodeCpus[nodeOf(t)];
+      cpu_set_t set;
+      CPU_ZERO(&set);
+      CPU_SET(cpus[(t / numNodes()) % cpus.size()], &set);
+      pthread_setaffinity_np(threads.back().native_handle(), sizeof(set), &set);
+    }
+  }
+  if (pin) {
+    cout << "Pinned " << numThreads << " threads over " << numNodes()
+         << " NUMA node(s)\n";
+  }
+}
+
+ThreadPool::~ThreadPool() {
+  {
+    lock_guard<std::mutex> lock(mutex);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (auto& t : threads) t.join();
+}
+
+void ThreadPool::run(function<void(int)> fn) {
+  unique_lock<std::mutex> lock(mutex);
+  job = fn;
+  running = threads.size();
+  generation++;
+  wake.notify_all();
+  finished.wait(lock, [this] {return running == 0;});
+  job = nullptr;
+}
+
+void ThreadPool::threadLoop(int idx) {
+  long seen = 0;
+  while (true) {
+    function<void(int)> fn;
+    {
+      unique_lock<std::mutex> lock(mutex);
+      wake.wait(lock, [&] {return stopping or generation != seen;});
+      if (stopping) return;
+      seen = generation;
+      fn = job;
+    }
+    fn(idx);
+    {
+      lock_guard<std::mutex> lock(mutex);
+      if (--running == 0) finished.notify_one();
+    }
+  }
+}
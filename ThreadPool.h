@@ -0,0 +1,81 @@
+#ifndef THREADPOOL_H_
+#define THREADPOOL_H_
+
+// Persistent render threads, optionally pinned to the cores of each NUMA node
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+
+using std::vector, std::function;
+
+/**
+ * CPUs of the machine grouped by NUMA node, read from /sys.
+ * Machines without NUMA information are a single node.
+ *
+ */
+struct NumaTopology {
+        vector<vector<int>> nodeCpus;
+        /**
+        * Detect the topology, limited to the CPUs this process may run on
+        *
+        * @return The CPUs of every node that has any
+        */
+        static NumaTopology detect();
+};
+
+/**
+ * Pool of threads that stay alive across renders.
+ * Thread t belongs to NUMA node t % numNodes(), so every node
+ * gets its share of the threads.
+ *
+ */
+class ThreadPool {
+    public:
+        /**
+        * Start the threads
+        *
+        * @param numThreads - Number of threads, 0 for one per CPU
+        * @param pin - Pin every thread to a single core of its node
+        */
+        ThreadPool(int numThreads=0, bool pin=false);
+        ~ThreadPool();
+        /**
+        * Run a function on every thread of the pool and wait for all of them
+        *
+        * @param fn - Called with the index of the thread
+        */
+        void run(function<void(int)> fn);
+        /**
+        * Number of threads in the pool
+        *
+        */
+        int size() {return threads.size();}
+        /**
+        * Number of NUMA nodes the threads are spread over
+        *
+        */
+        int numNodes() {return topology.nodeCpus.size();}
+        /**
+        * NUMA node of a thread
+        *
+        * @param thread - Index of the thread
+        */
+        int nodeOf(int thread) {return thread % numNodes();}
+
+    private:
+        void threadLoop(int idx);
+
+        NumaTopology topology;
+        vector<std::thread> threads;
+        std::mutex mutex;
+        std::condition_variable wake, finished;
+        function<void(int)> job;
+        long generation;
+        int running;
+        bool stopping;
+};
+
+#endif // THREADPOOL_H_
@@ -0,0 +1,43 @@
+#include <algorithm>
+#include <cstdio>
+
+#include "Timeline.h"
+
+using namespace std;
+
+// Width of the chart in characters
+#define TIMELINE_WIDTH 50
+
+void Timeline::record(const string& stage, Clock::time_point start, Clock::time_point end) {
+  double s = chrono::duration<double>(start - origin).count();
+  double e = chrono::duration<double>(end - origin).count();
+  lock_guard<std::mutex> lock(mutex);
+  for (auto& existing : stages) {
+    if (existing.name != stage) continue;
+    existing.start = min(existing.start, s);
+    existing.end = max(existing.end, e);
+    existing.busy += e - s;
+    return;
+  }
+  stages.push_back({stage, s, e, e - s});
+}
+
+void Timeline::print(ostream& out) {
+  lock_guard<std::mutex> lock(mutex);
+  double total = 0;
+  for (auto& stage : stages) total = max(total, stage.end);
+  if (total <= 0) return;
+  sort(stages.begin(), stages.end(),
+       [](const Stage& a, const Stage& b) {return a.start < b.start;});
+  out << "Timeline (ms)           start      end     busy\n";
+  for (auto& stage : stages) {
+    char line[128];
+    snprintf(line, sizeof(line), "  %-18s %8.1f %8.1f %8.1f  ", stage.name.c_str(),
+             stage.start*1e3, stage.end*1e3, stage.busy*1e3);
+    // The span of the stage on a common axis
+    int from = min(TIMELINE_WIDTH - 1, (int) (stage.start / total * TIMELINE_WIDTH));
+    int to = max(from + 1, (int) (stage.end / total * TIMELINE_WIDTH + 0.5));
+    out << line << '|' << string(from, ' ') << string(to - from, '#')
+        << string(max(0, TIMELINE_WIDTH - to), ' ') << "|\n";
+  }
+}
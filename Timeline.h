@@ -0,0 +1,53 @@
+#ifndef TIMELINE_H_
+#define TIMELINE_H_
+
+// When each stage of a render ran, to see how they overlap
+
+#include <vector>
+#include <string>
+#include <chrono>
+#include <mutex>
+#include <ostream>
+
+using std::vector, std::string;
+
+/**
+ * Busy intervals of the stages of a render, recorded from any thread
+ * and printed as a chart on a common time axis.
+ *
+ */
+class Timeline {
+  public:
+        using Clock = std::chrono::steady_clock;
+
+        Timeline() : origin(Clock::now()) {}
+        /**
+        * Record that a stage was busy. A stage may be recorded many times
+        * and from several threads, it spans from its first start to its
+        * last end.
+        *
+        * @param stage - Name of the stage
+        * @param start - When the work started
+        * @param end - When it ended
+        */
+        void record(const string& stage, Clock::time_point start, Clock::time_point end);
+        /**
+        * Print the span and busy time of every stage, in the order
+        * they started
+        *
+        * @param out - Stream to print to
+        */
+        void print(std::ostream& out);
+
+  private:
+        struct Stage {
+                string name;
+                double start, end, busy; // Seconds since the timeline was created
+        };
+
+        Clock::time_point origin;
+        vector<Stage> stages;
+        std::mutex mutex;
+};
+
+#endif // TIMELINE_H_
@@ -0,0 +1,36 @@
+// nanoraytracer-convert: turn text scene files into binary scene files
+
+#include <iostream>
+#include <string>
+#include <sstream>
+#include <stack>
+
+#include "BinaryScene.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if (argc != 3) {
+    cerr << "Usage: nanoraytracer-convert input.test output.nrs \n";
+    exit(-1);
+  }
+
+  Scene scene;
+  Raytracer raytracer;
+  BinarySceneWriter writer(scene, raytracer);
+  try {
+    readfile(argv[1], writer);
+  } catch (int) {
+    return -1;
+  }
+  if (!writer.write(argv[2])) {
+    cerr << "Unable to write binary scene file " << argv[2] << "\n";
+    return -1;
+  }
+  cout << "Wrote " << writer.indices.size() / 3 << " triangles, "
+       << writer.allVertices.size() << " vertices, "
+       << writer.spheres.size() << " spheres, "
+       << writer.materials.size() << " materials and "
+       << writer.transforms.size() << " transforms to " << argv[2] << "\n";
+  return 0;
+}
@@ -4,26 +4,246 @@
 #include <sstream>
 #include <deque>
 #include <stack>
+#include <climits>
+#include <chrono>
+#include <cstdio>
 
 #include <FreeImage.h>
 #include "Transform.h"
 #include "Scene.h"
 #include "Raytracer.h"
+#include "Distributed.h"
+#include "Batch.h"
 
 using namespace std;
 
 #include "readfile.h" // prototypes for readfile.cpp
 
+void usage() {
+  cerr << "Usage: nanoraytracer [options] scenefile \n"
+       << "       nanoraytracer [options] --batch manifest \n"
+       << "       nanoraytracer --worker address \n"
+       << "Options:\n"
+       << "  --workers n        Render tiles in n local worker processes\n"
+       << "  --listen address   Socket for workers to connect to (path or host:port)\n"
+       << "  --partitions n     Split the geometry over n workers (sort-last)\n"
+       << "  --threads n        Number of render threads (default: one per CPU)\n"
+       << "  --numa             Pin threads to cores and replicate the scene per NUMA node\n"
+       << "  --batch manifest   Render every scene listed in manifest\n"
+       << "  --accel-cache dir  Directory caching the BVH of large scenes, none to disable\n"
+       << "                     (default: " << Bvh::defaultCacheDir() << ")\n"
+       << "  --parse-bench      Only time the scene file parsers against each other\n"
+       << "  --timeline         Print when parsing, BVH building and rendering ran\n"
+       << "  --png mode         PNG compression: default, fast or stored\n"
+       << "  --encode-bench     Time every output format on the image instead of saving it\n"
+       << "  --bounded-memory   Only hold the rows being rendered, for huge images written\n"
+       << "                     as PNG, QOI, PFM, EXR or raw\n"
+       << "  --crop x0,y0,x1,y1 Only render pixels [x0, x1) x [y0, y1) of the frame\n"
+       << "  --tiles first,last Only render this range of the " << TILE_SIZE << "x" << TILE_SIZE
+       << " tiles, numbered in rows\n"
+       << "                     from the top left; see nanoraytracer-merge\n"
+       << "  --output file      Write the image to file instead of the one the scene names\n"
+       << "  --checkpoint file  Save the progress of the render to file every so often\n"
+       << "  --checkpoint-every seconds  Time between checkpoints (default: 60)\n"
+       << "  --resume           Continue the render saved in the checkpoint file\n"
+       << "  --sample-map file  Write an image of where samples went, for scenes that converge\n"
+       << "                     and progressive renders\n"
+       << "  --time-limit seconds  Render progressive passes until this long after starting,\n"
+       << "                     then save the image\n"
+       << "  --snapshot-every seconds  Write the image so far to the output file this often\n"
+       << "  --preview          Write images tracing a ray per 16x16 block, then 8x8 and so\n"
+       << "                     on, down to a ray per pixel, before the frame\n"
+       << "A scenefile of - reads the scene from standard input.\n";
+  exit(-1);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 2) {
-    cerr << "Usage: nanoraytracer scenefile \n";
+  auto programStart = chrono::steady_clock::now();
+  string sceneFile, listenAddress, batchManifest, outputFname;
+  string accelCache = Bvh::defaultCacheDir();
+  int numWorkers = -1, numPartitions = 0, numThreads = 0;
+  bool distributed = false, numa = false, parseBench = false, showTimeline = false;
+  bool encodeBench = false, boundedMemory = false, crop = false, preview = false;
+  int cropX0 = 0, cropY0 = 0, cropX1 = INT_MAX, cropY1 = INT_MAX;
+  int firstTile = 0, lastTile = INT_MAX;
+  string checkpointFname, sampleMapFname;
+  double checkpointInterval = 60, timeLimit = 0, snapshotInterval = 0;
+  bool resume = false;
+  for (int i = 1; i < argc; i++) {
+    string arg = argv[i];
+    if (arg == "--worker" and i+1 < argc) {
+      return runRenderWorker(argv[++i]);
+    } else if (arg == "--workers" and i+1 < argc) {
+      numWorkers = atoi(argv[++i]);
+      distributed = true;
+    } else if (arg == "--partitions" and i+1 < argc) {
+      numPartitions = atoi(argv[++i]);
+      distributed = true;
+    } else if (arg == "--threads" and i+1 < argc) {
+      numThreads = atoi(argv[++i]);
+    } else if (arg == "--batch" and i+1 < argc) {
+      batchManifest = argv[++i];
+    } else if (arg == "--numa") {
+      numa = true;
+    } else if (arg == "--accel-cache" and i+1 < argc) {
+      accelCache = argv[++i];
+      if (accelCache == "none") accelCache = "";
+    } else if (arg == "--parse-bench") {
+      parseBench = true;
+    } else if (arg == "--timeline") {
+      showTimeline = true;
+    } else if (arg == "--png" and i+1 < argc) {
+      string mode = argv[++i];
+      if (mode == "default") PngWriter::level = Z_DEFAULT_COMPRESSION;
+      else if (mode == "fast") PngWriter::level = Z_BEST_SPEED;
+      else if (mode == "stored") PngWriter::level = Z_NO_COMPRESSION;
+      else usage();
+    } else if (arg == "--encode-bench") {
+      encodeBench = true;
+    } else if (arg == "--bounded-memory") {
+      boundedMemory = true;
+    } else if (arg == "--crop" and i+1 < argc) {
+      if (sscanf(argv[++i], "%d,%d,%d,%d", &cropX0, &cropY0, &cropX1, &cropY1) != 4) usage();
+      crop = true;
+    } else if (arg == "--output" and i+1 < argc) {
+      outputFname = argv[++i];
+    } else if (arg == "--tiles" and i+1 < argc) {
+      if (sscanf(argv[++i], "%d,%d", &firstTile, &lastTile) != 2) usage();
+      crop = true;
+    } else if (arg == "--checkpoint" and i+1 < argc) {
+      checkpointFname = argv[++i];
+    } else if (arg == "--checkpoint-every" and i+1 < argc) {
+      checkpointInterval = atof(argv[++i]);
+    } else if (arg == "--resume") {
+      resume = true;
+    } else if (arg == "--time-limit" and i+1 < argc) {
+      timeLimit = atof(argv[++i]);
+    } else if (arg == "--snapshot-every" and i+1 < argc) {
+      snapshotInterval = atof(argv[++i]);
+    } else if (arg == "--preview") {
+      preview = true;
+    } else if (arg == "--sample-map" and i+1 < argc) {
+      sampleMapFname = argv[++i];
+    } else if (arg == "--listen" and i+1 < argc) {
+      listenAddress = argv[++i];
+      distributed = true;
+    } else if (arg[0] == '-' and arg != "-") {
+      usage();
+    } else {
+      sceneFile = arg;
+    }
+  }
+  if (!batchManifest.empty()) {
+    ThreadPool pool(numThreads, numa);
+    OutputPipeline output;
+    return runBatch(batchManifest, pool, output, accelCache) == 0 ? 0 : -1;
+  }
+  if (sceneFile.empty()) usage();
+  // Parses the scene, then renders unless the work goes to other processes
+  ThreadPool pool(numThreads, numa);
+  if (parseBench) return benchmarkParsers(sceneFile.c_str(), pool) ? 0 : -1;
+
+  // Unless told otherwise, every partition gets a local worker
+  // when nobody can connect from outside
+  if (numWorkers < 0) numWorkers = listenAddress.empty() ? numPartitions : 0;
+  if (distributed and sceneFile == "-") {
+    cerr << "Workers read the scene file themselves, it cannot come from standard input\n";
+    exit(-1);
+  }
+  if (boundedMemory and (distributed or encodeBench)) {
+    cerr << "--bounded-memory only streams images rendered and saved by this process\n";
+    exit(-1);
+  }
+  if (crop and distributed) {
+    cerr << "Workers render whole frames, use --crop or --tiles in separate processes\n";
+    exit(-1);
+  }
+  if (resume and checkpointFname.empty()) usage();
+  if (snapshotInterval > 0 and timeLimit <= 0) usage();
+  if (timeLimit > 0 and (boundedMemory or distributed or !checkpointFname.empty())) {
+    cerr << "--time-limit renders in this process with the whole framebuffer, without checkpoints\n";
+    exit(-1);
+  }
+  if (preview and (boundedMemory or distributed or timeLimit > 0 or !checkpointFname.empty())) {
+    cerr << "--preview renders in this process with the whole framebuffer, on its own\n";
+    exit(-1);
+  }
+  if (!checkpointFname.empty() and (boundedMemory or distributed or encodeBench)) {
+    cerr << "--checkpoint keeps the whole framebuffer of a render by this process\n";
     exit(-1);
   }
+
   Scene scene;
   Raytracer raytracer;
-  readfile(argv[1], scene, raytracer);
+  // Encodes and writes the image in the background
+  OutputPipeline output;
+  raytracer.setOutputPipeline(&output);
+  raytracer.setBoundedMemory(boundedMemory);
+  if (crop) raytracer.setCrop(cropX0, cropY0, cropX1, cropY1, firstTile, lastTile);
+  Checkpoint checkpoint(checkpointFname, checkpointInterval, resume);
+  if (!checkpointFname.empty()) raytracer.setCheckpoint(&checkpoint);
+  raytracer.setPreview(preview);
+  if (timeLimit > 0)
+    raytracer.setDeadline(programStart + chrono::duration_cast<chrono::steady_clock::duration>(
+                            chrono::duration<double>(timeLimit)), snapshotInterval);
+  // The workers hold the geometry in sort-last mode
+  if (numPartitions > 0) scene.setPartition(0, 0, 0);
+  // Blocks of geometry get their part of the BVH built while the
+  // rest is parsed, rendering starts once it is sealed
+  Timeline timeline;
+  scene.bvhBuilder = make_shared<BvhBuilder>(&timeline);
+  auto start = Timeline::Clock::now();
+  readfile(sceneFile.c_str(), scene, raytracer, nullptr, &pool);
+  timeline.record("parse", start, Timeline::Clock::now());
+  if (!outputFname.empty()) raytracer.setOutputFname(outputFname);
+  if (raytracer.isConverging() and (boundedMemory or distributed)) {
+    cerr << "Scenes sampled until they converge are rendered in one process, with the whole framebuffer\n";
+    exit(-1);
+  }
+  if (raytracer.isPathTracing() and numPartitions > 0) {
+    cerr << "Sort-last rendering traces Whitted rays only, not paths\n";
+    exit(-1);
+  }
+  if (raytracer.isEmpty()) {
+    cerr << "No pixel of the frame is in the crop and tiles asked for\n";
+    exit(-1);
+  }
+  if (raytracer.isPartial() and !encodeBench and
+      !ImageWriter::create(raytracer.getOutputFname())->keepsRegion()) {
+    cerr << "Partial images are written as PNG or EXR, which keep their place in the frame\n";
+    exit(-1);
+  }
+  if (boundedMemory and !ImageWriter::create(raytracer.getOutputFname())->streamsRows()) {
+    cerr << "--bounded-memory streams images written as PNG, QOI, PFM, EXR or raw, "
+         << "other formats hold the whole image\n";
+    exit(-1);
+  }
+  if (snapshotInterval > 0 and raytracer.getOutputFname() == "-") {
+    cerr << "Snapshots replace the output file, they cannot go to standard output\n";
+    exit(-1);
+  }
+  // The image goes to standard output, messages must not get into it
+  if (raytracer.getOutputFname() == "-") cout.rdbuf(cerr.rdbuf());
+  scene.bvh = scene.bvhBuilder->seal(scene.sceneObjects, accelCache);
+  scene.bvhBuilder = nullptr;
 
-  raytracer.rayTrace(scene);
+  start = Timeline::Clock::now();
+  if (distributed) {
+    RenderCoordinator coordinator(listenAddress, numWorkers, 32, numPartitions);
+    if (!coordinator.render(sceneFile, scene, raytracer)) exit(-1);
+  } else {
+    raytracer.setThreadPool(&pool);
+    raytracer.rayTrace(scene);
+  }
+  timeline.record("render", start, Timeline::Clock::now());
+  if (encodeBench) return raytracer.benchmarkOutput() ? 0 : -1;
+  start = Timeline::Clock::now();
   raytracer.saveImage();
-  return 0;
+  bool written = output.wait();
+  if (!sampleMapFname.empty()) written = raytracer.saveSampleMap(sampleMapFname) and written;
+  timeline.record("write", start, Timeline::Clock::now());
+  // The image is safely written, nothing is left to resume
+  if (written and !checkpointFname.empty()) checkpoint.remove();
+  if (showTimeline) timeline.print(cout);
+  return written ? 0 : -1;
 }
@@ -0,0 +1,74 @@
+// nanoraytracer-merge: assemble the partial images of a frame rendered
+// in parts with --crop or --tiles
+
+#include <iostream>
+#include <string>
+#include <vector>
+#include <cstring>
+
+#include "ImageReader.h"
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if (argc < 3) {
+    cerr << "Usage: nanoraytracer-merge output part... \n";
+    exit(-1);
+  }
+
+  int frameWidth = 0, frameHeight = 0;
+  vector<float> frame;
+  vector<bool> covered;
+  for (int k = 2; k < argc; k++) {
+    ImageData part;
+    if (!readImage(argv[k], part)) return -1;
+    const ImageRegion& region = part.region;
+    if (frame.empty()) {
+      frameWidth = region.frameWidth;
+      frameHeight = region.frameHeight;
+      frame.assign((size_t) frameWidth*frameHeight*3, 0.0f);
+      covered.assign((size_t) frameWidth*frameHeight, false);
+    } else if (region.frameWidth != frameWidth or region.frameHeight != frameHeight) {
+      cerr << argv[k] << " is part of a " << region.frameWidth << "x" << region.frameHeight
+           << " frame, not " << frameWidth << "x" << frameHeight << "\n";
+      return -1;
+    }
+    if (region.x < 0 or region.y < 0 or region.x + part.width > frameWidth or
+        region.y + part.height > frameHeight) {
+      cerr << argv[k] << " does not fit in its frame\n";
+      return -1;
+    }
+
+    // Only the pixels of the tiles the part was rendered for
+    int tilesPerBand = region.tileSize > 0 ? (frameWidth + region.tileSize-1) / region.tileSize : 0;
+    for (int j = 0; j < part.height; j++) {
+      int y = region.y + j;
+      for (int i = 0; i < part.width; i++) {
+        int x = region.x + i;
+        if (region.tileSize > 0) {
+          long tile = (long) (y / region.tileSize) * tilesPerBand + x / region.tileSize;
+          if (tile < region.firstTile or tile > region.lastTile) continue;
+        }
+        size_t pixel = (size_t) y*frameWidth + x;
+        memcpy(&frame[3*pixel], &part.rgb[3*((size_t) j*part.width + i)], 3*sizeof(float));
+        covered[pixel] = true;
+      }
+    }
+  }
+
+  size_t missing = 0;
+  for (bool c : covered) missing += !c;
+  if (missing > 0) cerr << missing << " pixels of the frame are in no part, left black\n";
+
+  unique_ptr<ImageWriter> writer = ImageWriter::create(argv[1]);
+  bool ok = writer->open(argv[1], frameWidth, frameHeight);
+  for (int j = 0; j < frameHeight and ok; j++)
+    ok = writer->writeRow(&frame[(size_t) j*frameWidth*3]);
+  if (!(ok and writer->close())) {
+    cerr << "Unable to write output file " << argv[1] << "\n";
+    return -1;
+  }
+  cout << "Merged " << argc - 2 << " parts into a " << frameWidth << "x" << frameHeight
+       << " frame " << argv[1] << "\n";
+  return missing > 0 ? -1 : 0;
+}
@@ -25,7 +25,19 @@
 #include <deque>
 #include <stack>
 #include <memory>
+#include <charconv>
+#include <chrono>
+#include <atomic>
+#include <cstring>
+#include <cctype>
+#include <algorithm>
+#include <cerrno>
+#include <unistd.h>
 #include "Transform.h"
+#include "MappedFile.h"
+#include "ThreadPool.h"
+#include "BinaryScene.h"
+#include "Mesh.h"
 
 using namespace std;
 #include "readfile.h"
@@ -64,232 +76,803 @@ materialProperties initMaterialProperties(float* ambient,
   return materialProps;
 }
 
-void readfile(const char* filename, Scene& scene, Raytracer& raytracer)
-{
-  string str, cmd; 
-  ifstream in;
+// Arguments of a line read through a stringstream
+class StreamArgs {
+  public:
+    StreamArgs(stringstream& s) : s(s) {}
+    bool readvals(const int numvals, float* values) {
+      return ::readvals(s, numvals, values);
+    }
+    bool word(string& w) {
+      return (bool) (s >> w);
+    }
+  private:
+    stringstream& s;
+};
 
-  string outputFname = "output.png";
-  int maxdepth = 5;
-
-  vec3 eye, up, center; // Positions of eye, center, up vectors
-  int w, h; // Image size
-  float fovy; // FOV of image
-  vector <vec3> allVertices;
-  vec3 vertex;
-  vec3 lightAttenuation(1.,0.,0.);
-  // Material properties
-  float ambient[3] = {0, 0, 0};
-  float diffuse[3] = {0, 0, 0};
-  float specular[3] = {0, 0, 0};
-  float emission[3] = {0, 0, 0};
-  float shininess = 1;
+// Arguments of a line of a mapped file, parsed in place.
+// Accepts the same input as operator>> on a stringstream.
+class TextArgs {
+  public:
+    TextArgs(const char* p, const char* end, ostream& log = cout) :
+      p(p), end(end), log(log) {}
+    bool readvals(const int numvals, float* values) {
+      for (int i = 0; i < numvals; i++) {
+        skipSpace();
+        // from_chars takes no '+', and also reads inf and nan, which
+        // operator>> does not
+        const char* start = p;
+        const char* digits = p;
+        if (digits < end and *digits == '+') start = ++digits;
+        else if (digits < end and *digits == '-') digits++;
+        from_chars_result result = {start, errc::invalid_argument};
+        if (digits < end and (isdigit(*digits) or *digits == '.'))
+          result = from_chars(start, end, values[i]);
+        if (result.ec != errc()) {
+          log << "Failed reading value " << i << " will skip\n"; 
+          return false;
+        }
+        p = result.ptr;
+      }
+      return true;
+    }
+    bool word(string& w) {
+      string_view token = next();
+      if (token.empty()) return false;
+      w = token;
+      return true;
+    }
+    string_view next() {
+      skipSpace();
+      const char* start = p;
+      while (p < end and !isSpace(*p)) p++;
+      return string_view(start, p - start);
+    }
+  private:
+    static bool isSpace(char c) {
+      return c == ' ' or c == '\t' or c == '\r' or c == '\v' or c == '\f';
+    }
+    void skipSpace() {
+      while (p < end and isSpace(*p)) p++;
+    }
+    const char* p;
+    const char* end;
+    ostream& log;
+};
 
-  in.open(filename); 
-  if (in.is_open()) {
+SceneBuilder::SceneBuilder(Scene& scene, Raytracer& raytracer) :
+  scene(scene), raytracer(raytracer) {
+  // I need to implement a matrix stack to store transforms.  
+  // This is done using standard STL Templates 
+  transfstack.push(mat4(1.0));  // identity
+}
 
-    // I need to implement a matrix stack to store transforms.  
-    // This is done using standard STL Templates 
-    stack <mat4> transfstack;
-    transfstack.push(mat4(1.0));  // identity
+template <class Args>
+void SceneBuilder::command(string_view cmd, Args& args) {
+  int i; 
+  float values[10]; // Position and color for light, colors for others
+  // Up to 10 params for cameras.  
+  bool validinput; // Validity of input 
 
-    getline (in, str); 
-    while (in) {
-      if ((str.find_first_not_of(" \t\r\n") != string::npos) && (str[0] != '#')) {
-        // Ruled out comment and blank lines 
+  // Geometry, checked first as it is most of the lines of a big scene
+  if (cmd == "vertex") {
+    validinput = args.readvals(3, values);
+    if (validinput) {
+      allVertices.push_back(vec3(values[0], values[1], values[2]));
+    }
+  } else if (cmd == "tri") {
+    validinput = args.readvals(3, values);
+    if (validinput) addTriangle(values);
+  } else if (cmd == "sphere") {
+    validinput = args.readvals(4, values);
+    if (validinput) addSphere(values);
+  } else if (cmd == "obj" or cmd == "ply") {
+    string fname;
+    if (args.word(fname)) {
+      // Relative to the scene file
+      if (fname[0] != '/' and !directory.empty()) fname = directory + "/" + fname;
+      auto mesh = make_shared<Mesh>();
+      bool loaded = cmd == "obj" ? loadObj(fname, *mesh) : loadPly(fname, *mesh);
+      if (loaded) addMesh(mesh);
+      else cerr << "Unable to Open Mesh File " << fname << " Skipping \n";
+    }
+  } else if (cmd == "use") {
+    string name;
+    if (args.word(name)) {
+      auto found = definitions.find(name);
+      if (found != definitions.end()) addMesh(found->second);
+      else cerr << "Unknown Geometry " << name << " Skipping \n";
+    }
+  } else if (cmd == "maxverts" or cmd == "maxvertnorms") {
+    ; // Not required
+  }
 
-        stringstream s(str);
-        s >> cmd; 
-        int i; 
-        float values[10]; // Position and color for light, colors for others
-        // Up to 10 params for cameras.  
-        bool validinput; // Validity of input 
-
-        // Process the lighting params
-        if (cmd == "directional" or cmd == "point") {
-            validinput = readvals(s, 6, values); // Position/color for lts.
-            if (validinput) {
-              std::shared_ptr<LightSource> l;
-              if (cmd == "point") l = std::make_shared<PointLight>(values, lightAttenuation);
-              else l = std::make_shared<DirectionalLight>(values, lightAttenuation);
-              scene.addLight(l);
-            }
-        }
+  // Process the lighting params
+  else if (cmd == "directional" or cmd == "point") {
+      validinput = args.readvals(6, values); // Position/color for lts.
+      if (validinput) addLight(cmd == "point", values);
+  }
 
-        else if (cmd == "attenuation") {
-          validinput = readvals(s, 3, values); // colors
-          if (validinput) {
-            lightAttenuation = vec3(values[0], values[1], values[2]);
-          }
-        }
+  else if (cmd == "attenuation") {
+    validinput = args.readvals(3, values); // colors
+    if (validinput) {
+      lightAttenuation = vec3(values[0], values[1], values[2]);
+    }
+  }
 
-        else if (cmd == "maxdepth") {
-          validinput = readvals(s, 1, values); // colors
-          if (validinput) maxdepth = values[0];
-        } else if (cmd == "output") {
-          s >> outputFname;
-        }
+  else if (cmd == "maxdepth") {
+    validinput = args.readvals(1, values); // colors
+    if (validinput) maxdepth = values[0];
+  } else if (cmd == "output") {
+    args.word(outputFname);
+  } else if (cmd == "spp") {
+    validinput = args.readvals(1, values);
+    if (validinput) samplesPerPixel = max((int) values[0], 1);
+  } else if (cmd == "adaptive") {
+    string contrast;
+    validinput = args.readvals(1, values);
+    if (validinput) adaptiveSamples = max((int) values[0], 0);
+    // The contrast is optional
+    adaptiveContrast = args.word(contrast) ? atof(contrast.c_str()) : 0;
+  } else if (cmd == "converge") {
+    validinput = args.readvals(2, values);
+    if (validinput) {
+      convergeError = values[0];
+      convergeSamples = max((int) values[1], 0);
+    }
+  } else if (cmd == "integrator") {
+    string name;
+    args.word(name);
+    if (name == "whitted") integrator = INTEGRATOR_WHITTED;
+    else if (name == "path") integrator = INTEGRATOR_PATH;
+    else cerr << "Unknown integrator " << name << " Skipping \n";
+  } else if (cmd == "filter") {
+    string name, radius;
+    args.word(name);
+    if (name == "box") filter = PIXEL_FILTER_BOX;
+    else if (name == "tent") filter = PIXEL_FILTER_TENT;
+    else if (name == "gaussian") filter = PIXEL_FILTER_GAUSSIAN;
+    else cerr << "Unknown filter " << name << " Skipping \n";
+    // The radius is optional
+    filterRadius = args.word(radius) ? atof(radius.c_str()) : 0;
+  }
 
-        // Material Commands
-        // Ambient, diffuse, specular, shininess properties for each object.
-        // Filling this in is pretty straightforward, so I've left it in 
-        // the skeleton, also as a hint of how to do the more complex ones.
-        // Note that no transforms/stacks are applied to the colors. 
-
-        else if (cmd == "ambient") {
-          validinput = readvals(s, 3, values); // colors
-          if (validinput) {
-            for (i = 0; i < 3; i++) {
-              ambient[i] = values[i]; 
-            }
-          }
-        } else if (cmd == "diffuse") {
-          validinput = readvals(s, 3, values);
-          if (validinput) {
-            for (i = 0; i < 3; i++) {
-              diffuse[i] = values[i]; 
-            }
-          }
-        } else if (cmd == "specular") {
-          validinput = readvals(s, 3, values);
-          if (validinput) {
-            for (i = 0; i < 3; i++) {
-              specular[i] = values[i]; 
-            }
-          }
-        } else if (cmd == "emission") {
-          validinput = readvals(s, 3, values);
-          if (validinput) {
-            for (i = 0; i < 3; i++) {
-              emission[i] = values[i]; 
-            }
-          }
-        } else if (cmd == "shininess") {
-          validinput = readvals(s, 1, values); 
-          if (validinput) {
-            shininess = values[0]; 
-          }
-        }
+  // Material Commands
+  // Ambient, diffuse, specular, shininess properties for each object.
+  // Filling this in is pretty straightforward, so I've left it in 
+  // the skeleton, also as a hint of how to do the more complex ones.
+  // Note that no transforms/stacks are applied to the colors. 
 
-        // Image Size and camera params
-        else if (cmd == "size") {
-          validinput = readvals(s,2,values);
-          if (validinput) { 
-            w = (int) values[0]; h = (int) values[1]; 
-          }
-          scene.setImageResolution(w, h);
-        } else if (cmd == "camera") {
-          validinput = readvals(s,10,values); // 10 values eye cen up fov
-          if (validinput) {
-
-            eye = vec3(values[0], values[1], values[2]);
-            center = vec3(values[3], values[4], values[5]);
-            up = vec3(values[6], values[7], values[8]);
-            up = Transform::upvector(up, eye-center);
-            fovy = values[9];
-
-          }
-        }
+  else if (cmd == "ambient") {
+    validinput = args.readvals(3, values); // colors
+    if (validinput) {
+      for (i = 0; i < 3; i++) {
+        ambient[i] = values[i]; 
+      }
+    }
+  } else if (cmd == "diffuse") {
+    validinput = args.readvals(3, values);
+    if (validinput) {
+      for (i = 0; i < 3; i++) {
+        diffuse[i] = values[i]; 
+      }
+    }
+  } else if (cmd == "specular") {
+    validinput = args.readvals(3, values);
+    if (validinput) {
+      for (i = 0; i < 3; i++) {
+        specular[i] = values[i]; 
+      }
+    }
+  } else if (cmd == "emission") {
+    validinput = args.readvals(3, values);
+    if (validinput) {
+      for (i = 0; i < 3; i++) {
+        emission[i] = values[i]; 
+      }
+    }
+  } else if (cmd == "shininess") {
+    validinput = args.readvals(1, values); 
+    if (validinput) {
+      shininess = values[0]; 
+    }
+  }
 
-        // Geometry
-        else if (cmd == "maxverts" or cmd == "maxvertnorms") {
-          ; // Not required
-        }
-        else if (cmd == "vertex") {
-          validinput = readvals(s, 3, values);
-          if (validinput) {
-            vertex = vec3(values[0], values[1], values[2]);
-          allVertices.push_back(vertex);
-          }
-        } else if (cmd == "tri") {
-          validinput = readvals(s, 3, values);
-          if (validinput) {
-            auto materialProps = initMaterialProperties(ambient,
-                                                        diffuse,
-                                                        specular,
-                                                        emission,
-                                                        shininess);
-            std::shared_ptr<SceneObject> tri =
-              std::make_shared<Triangle>(allVertices[values[0]],
-                                        allVertices[values[1]],
-                                        allVertices[values[2]],
-                                        materialProps,
-                                        transfstack.top());
-            scene.addObjectToScene(tri);
-          }
-        } else if (cmd == "sphere") {
-          validinput = readvals(s, 4, values);
-          if (validinput) {
-            auto materialProps = initMaterialProperties(ambient,
-                                                        diffuse,
-                                                        specular,
-                                                        emission,
-                                                        shininess);
-            std::shared_ptr<SceneObject> sphr =
-              std::make_shared<Sphere>(values[0], values[1], values[2],
-                                       values[3], materialProps,
-                                       transfstack.top());
-            scene.addObjectToScene(sphr);
-          }
-        }
+  // Image Size and camera params
+  else if (cmd == "size") {
+    validinput = args.readvals(2,values);
+    if (validinput) { 
+      w = (int) values[0]; h = (int) values[1]; 
+    }
+    scene.setImageResolution(w, h);
+  } else if (cmd == "camera") {
+    validinput = args.readvals(10,values); // 10 values eye cen up fov
+    if (validinput) {
 
-        // Transformations
-        else if (cmd == "translate") {
-          validinput = readvals(s,3,values); 
-          if (validinput) {
-            mat4 M(1,0,0,0,
-                   0,1,0,0,
-                   0,0,1,0,
-                   values[0],values[1],values[2],1);
-            rightmultiply(M, transfstack);
-          }
-        }
-        else if (cmd == "scale") {
-          validinput = readvals(s,3,values); 
-          if (validinput) {
-            mat4 M(values[0],0,0,0,
-                   0,values[1],0,0,
-                   0,0,values[2],0,
-                   0,0,0,1);
-            rightmultiply(M, transfstack);
-          }
-        }
-        else if (cmd == "rotate") {
-          validinput = readvals(s,4,values); 
-          if (validinput) {
-            vec3 axis(values[0], values[1], values[2]);
-            axis = normalize(axis);
-            mat3 R = Transform::rotate(values[3], axis);
-            mat4 M(R[0][0], R[0][1], R[0][2], 0,
-                   R[1][0], R[1][1], R[1][2], 0,
-                   R[2][0], R[2][1], R[2][2], 0,
-                   0, 0, 0, 1);
-            rightmultiply(M, transfstack);
-          }
+      eye = vec3(values[0], values[1], values[2]);
+      center = vec3(values[3], values[4], values[5]);
+      up = vec3(values[6], values[7], values[8]);
+      up = Transform::upvector(up, eye-center);
+      fovy = values[9];
+
+    }
+  }
+
+  // Transformations
+  else if (cmd == "translate") {
+    validinput = args.readvals(3,values); 
+    if (validinput) {
+      mat4 M(1,0,0,0,
+             0,1,0,0,
+             0,0,1,0,
+             values[0],values[1],values[2],1);
+      rightmultiply(M, transfstack);
+    }
+  }
+  else if (cmd == "scale") {
+    validinput = args.readvals(3,values); 
+    if (validinput) {
+      mat4 M(values[0],0,0,0,
+             0,values[1],0,0,
+             0,0,values[2],0,
+             0,0,0,1);
+      rightmultiply(M, transfstack);
+    }
+  }
+  else if (cmd == "rotate") {
+    validinput = args.readvals(4,values); 
+    if (validinput) {
+      vec3 axis(values[0], values[1], values[2]);
+      axis = normalize(axis);
+      mat3 R = Transform::rotate(values[3], axis);
+      mat4 M(R[0][0], R[0][1], R[0][2], 0,
+             R[1][0], R[1][1], R[1][2], 0,
+             R[2][0], R[2][1], R[2][2], 0,
+             0, 0, 0, 1);
+      rightmultiply(M, transfstack);
+    }
+  }
+
+  // I include the basic push/pop code for matrix stacks
+  else if (cmd == "pushTransform") {
+    transfstack.push(transfstack.top()); 
+  } else if (cmd == "popTransform") {
+    if (transfstack.size() <= 1) {
+      cerr << "Stack has no elements.  Cannot Pop\n"; 
+    } else {
+      transfstack.pop(); 
+    }
+  }
+
+  else {
+    cerr << "Unknown Command: " << cmd << " Skipping \n"; 
+  }
+}
+
+void SceneBuilder::addTriangle(const float* indices) {
+  auto materialProps = initMaterialProperties(ambient,
+                                              diffuse,
+                                              specular,
+                                              emission,
+                                              shininess);
+  std::shared_ptr<SceneObject> tri =
+    std::make_shared<Triangle>(allVertices[indices[0]],
+                              allVertices[indices[1]],
+                              allVertices[indices[2]],
+                              materialProps,
+                              transfstack.top());
+  scene.addObjectToScene(tri);
+}
+
+void SceneBuilder::addSphere(const float* values) {
+  auto materialProps = initMaterialProperties(ambient,
+                                              diffuse,
+                                              specular,
+                                              emission,
+                                              shininess);
+  std::shared_ptr<SceneObject> sphr =
+    std::make_shared<Sphere>(values[0], values[1], values[2],
+                             values[3], materialProps,
+                             transfstack.top());
+  scene.addObjectToScene(sphr);
+}
+
+void SceneBuilder::addMesh(shared_ptr<Mesh> mesh) {
+  auto data = make_shared<MeshData>();
+  data->vertices = mesh->vertices.data();
+  data->indices = mesh->indices.data();
+  if (mesh->normalIndexData()) {
+    data->normals = mesh->normals.data();
+    data->normalIndices = mesh->normalIndexData();
+  }
+  data->storage = mesh;
+  data->numVertices = mesh->vertices.size();
+  data->numTriangles = mesh->indices.size() / 3;
+  data->numNormals = mesh->normals.size();
+  scene.addMesh(data, 0, mesh->indices.size() / 3,
+                initMaterialProperties(ambient, diffuse, specular, emission, shininess),
+                transfstack.top());
+}
+
+void SceneBuilder::addLight(bool point, float* values) {
+  std::shared_ptr<LightSource> l;
+  if (point) l = std::make_shared<PointLight>(values, lightAttenuation);
+  else l = std::make_shared<DirectionalLight>(values, lightAttenuation);
+  scene.addLight(l);
+}
+
+void SceneBuilder::setDirectory(const string& filename) {
+  size_t slash = filename.rfind('/');
+  directory = slash == string::npos ? "" : filename.substr(0, slash);
+  if (slash == 0) directory = "/";
+}
+
+void SceneBuilder::finish() {
+  scene.addCamera(eye, center, up, fovy);
+  raytracer.init(scene.width, scene.height, outputFname, maxdepth);
+  raytracer.setSampling(samplesPerPixel, filter, filterRadius);
+  raytracer.setAdaptiveSampling(adaptiveSamples, adaptiveContrast);
+  raytracer.setConvergence(convergeError, convergeSamples);
+  raytracer.setIntegrator(integrator);
+}
+
+// Runs of vertex/tri lines shorter than this are not worth parsing in parallel
+#define PARALLEL_PARSE_SIZE (1 << 18)
+// Text read from a pipe is parsed once this much has arrived
+#define STREAM_BLOCK_SIZE (1 << 20)
+// Guards against files including each other
+#define MAX_INCLUDE_DEPTH 16
+
+// End of the line starting at p
+static const char* lineEnd(const char* p, const char* end) {
+  const char* eol = (const char*) memchr(p, '\n', end - p);
+  return eol ? eol : end;
+}
+
+// Whether a line is part of a run of vertex/tri commands
+static bool isGeometryLine(const char* p, const char* eol) {
+  while (p < eol and (*p == ' ' or *p == '\t')) p++;
+  for (string_view cmd : {"vertex", "tri"}) {
+    if ((size_t) (eol - p) > cmd.size() and cmd.compare(0, cmd.size(), p, cmd.size()) == 0
+        and isspace(p[cmd.size()])) return true;
+  }
+  return false;
+}
+
+// Run the command on a line of a mapped file
+static void parseLine(SceneBuilder& builder, const char* p, const char* eol) {
+  // Ruled out comment and blank lines 
+  const char* c = p;
+  while (c < eol and (*c == ' ' or *c == '\t' or *c == '\r')) c++;
+  if (c == eol or *p == '#') return;
+
+  TextArgs args(p, eol);
+  builder.command(args.next(), args);
+}
+
+// What a chunk of a run of vertex/tri lines produces
+struct GeometryChunk {
+  const char* begin;
+  const char* end;
+  vector<vec3> vertices;
+  vector<vec3> tris; // Vertex indices, as read
+  ostringstream log;
+};
+
+// Parse a run of vertex/tri lines. Long runs are cut into chunks at line
+// boundaries whose numbers are read on every thread of the pool, then
+// their vertices and triangles go to the builder in file order so the
+// scene is the same as when parsing line by line.
+static void parseRun(SceneBuilder& builder, const char* p, const char* end,
+                     ThreadPool* pool) {
+  if (!pool or pool->size() == 1 or end - p < PARALLEL_PARSE_SIZE) {
+    while (p < end) {
+      const char* eol = lineEnd(p, end);
+      parseLine(builder, p, eol);
+      p = eol < end ? eol + 1 : end;
+    }
+    return;
+  }
+
+  // Several chunks per thread, in case some are slower
+  int numChunks = min<long>(pool->size() * 4, (end - p) / (PARALLEL_PARSE_SIZE / 4));
+  vector<GeometryChunk> chunks(numChunks);
+  const char* chunkBegin = p;
+  for (int k = 0; k < numChunks; k++) {
+    const char* chunkEnd = k == numChunks-1 ? end : lineEnd(p + (end - p) * (k+1) / numChunks, end);
+    if (chunkEnd < end) chunkEnd++;
+    chunks[k].begin = chunkBegin;
+    chunks[k].end = max(chunkBegin, chunkEnd);
+    chunkBegin = chunks[k].end;
+  }
+
+  // Read the numbers of every chunk
+  atomic<int> nextChunk(0);
+  pool->run([&](int thread) {
+    for (int k = nextChunk++; k < numChunks; k = nextChunk++) {
+      GeometryChunk& chunk = chunks[k];
+      for (const char* line = chunk.begin; line < chunk.end; ) {
+        const char* eol = lineEnd(line, chunk.end);
+        TextArgs args(line, eol, chunk.log);
+        string_view cmd = args.next();
+        float values[3];
+        if (args.readvals(3, values)) {
+          if (cmd == "vertex") chunk.vertices.push_back(vec3(values[0], values[1], values[2]));
+          else chunk.tris.push_back(vec3(values[0], values[1], values[2]));
         }
+        line = eol < chunk.end ? eol + 1 : chunk.end;
+      }
+    }
+  });
+
+  // Triangles may use vertices of any earlier chunk. They go through
+  // addTriangle like those of any other line, for builders storing them
+  // their own way.
+  for (auto& chunk : chunks) {
+    cout << chunk.log.str();
+    builder.allVertices.insert(builder.allVertices.end(), chunk.vertices.begin(),
+                               chunk.vertices.end());
+  }
+  for (auto& chunk : chunks)
+    for (auto& tri : chunk.tris) builder.addTriangle(&tri[0]);
+}
+
+// First word of a line
+static string_view firstWord(const char* p, const char* eol) {
+  while (p < eol and (*p == ' ' or *p == '\t' or *p == '\r')) p++;
+  const char* start = p;
+  while (p < eol and !isspace(*p)) p++;
+  return string_view(start, p - start);
+}
 
-        // I include the basic push/pop code for matrix stacks
-        else if (cmd == "pushTransform") {
-          transfstack.push(transfstack.top()); 
-        } else if (cmd == "popTransform") {
-          if (transfstack.size() <= 1) {
-            cerr << "Stack has no elements.  Cannot Pop\n"; 
-          } else {
-            transfstack.pop(); 
-          }
+// Parse the vertex/tri lines of a define block into a mesh of its own
+static shared_ptr<Mesh> parseDefinition(const char* p, const char* end) {
+  auto mesh = make_shared<Mesh>();
+  while (p < end) {
+    const char* eol = lineEnd(p, end);
+    string_view cmd = firstWord(p, eol);
+    if (!cmd.empty() and cmd[0] != '#') {
+      TextArgs args(p, eol);
+      args.next();
+      float values[3];
+      if (cmd != "vertex" and cmd != "tri") {
+        cerr << "Only vertex and tri can be defined, skipping " << cmd << "\n";
+      } else if (args.readvals(3, values)) {
+        if (cmd == "vertex") {
+          mesh->vertices.push_back(vec3(values[0], values[1], values[2]));
+        } else if (*min_element(values, values + 3) < 0 or
+                   *max_element(values, values + 3) >= mesh->vertices.size()) {
+          cerr << "Vertex index out of range, skipping triangle\n";
+        } else {
+          for (float v : values) mesh->indices.push_back((uint32_t) v);
         }
+      }
+    }
+    p = eol < end ? eol + 1 : end;
+  }
+  return mesh;
+}
+
+// Name the geometry of a define block. Blocks with the same text share
+// one mesh, parsed once per scene, or once per batch with a cache.
+static void defineGeometry(SceneBuilder& builder, const char* line, const char* eol,
+                           const char* body, const char* bodyEnd, GeometryCache* cache) {
+  TextArgs args(line, eol);
+  args.next();
+  string name;
+  if (!args.word(name)) {
+    cerr << "define needs a name, skipping block\n";
+    return;
+  }
+  static const uint64_t seed = GeometryCache::hash("define", 6);
+  uint64_t key = GeometryCache::hash(body, bodyEnd - body, seed);
+  shared_ptr<Mesh>& mesh = builder.definedMeshes[key];
+  if (!mesh and cache) {
+    auto block = cache->find(key);
+    if (block) mesh = block->mesh;
+  }
+  if (!mesh) {
+    mesh = parseDefinition(body, bodyEnd);
+    if (cache) {
+      auto block = make_shared<GeometryCache::Block>();
+      block->mesh = mesh;
+      cache->insert(key, block);
+    }
+  }
+  builder.definitions[name] = mesh;
+}
+
+// Start of the enddefine line closing a define block, or nullptr
+static const char* findEndDefine(const char* p, const char* end) {
+  while (p < end) {
+    const char* eol = lineEnd(p, end);
+    if (firstWord(p, eol) == "enddefine") return p;
+    p = eol < end ? eol + 1 : end;
+  }
+  return nullptr;
+}
+
+static const char* parseText(SceneBuilder& builder, const char* p, const char* end,
+                             GeometryCache* cache, ThreadPool* pool, bool more = false);
 
-        else {
-          cerr << "Unknown Command: " << cmd << " Skipping \n"; 
+// Parse the commands of another scene file where it is included
+static void includeFile(SceneBuilder& builder, string fname,
+                        GeometryCache* cache, ThreadPool* pool) {
+  // Relative to the including file
+  if (fname[0] != '/' and !builder.directory.empty()) fname = builder.directory + "/" + fname;
+  if (builder.includeDepth >= MAX_INCLUDE_DEPTH) {
+    cerr << "Includes nested too deeply, skipping " << fname << "\n";
+    return;
+  }
+  MappedFile file;
+  if (!file.open(fname)) {
+    cerr << "Unable to Open Include File " << fname << " Skipping \n";
+    return;
+  }
+  if (isBinaryScene(file.data(), file.size())) {
+    cerr << "Binary scene files cannot be included, skipping " << fname << "\n";
+    return;
+  }
+  string directory = builder.directory;
+  builder.setDirectory(fname);
+  builder.includeDepth++;
+  parseText(builder, file.data(), file.data() + file.size(), cache, pool);
+  builder.includeDepth--;
+  builder.directory = directory;
+}
+
+// Run every command of the text of a scene file. With more text to come,
+// stops at a define block whose end has not arrived yet.
+// Returns where parsing stopped.
+static const char* parseText(SceneBuilder& builder, const char* p, const char* end,
+                             GeometryCache* cache, ThreadPool* pool, bool more) {
+  Scene& scene = builder.scene;
+  uint64_t& vertexHash = builder.vertexHash;
+  while (p < end) {
+    const char* eol = lineEnd(p, end);
+    if (!isGeometryLine(p, eol)) {
+      // Commands spanning files or lines are handled here, the rest by the builder
+      string_view cmd = firstWord(p, eol);
+      const char* next = eol < end ? eol + 1 : end;
+      if (cmd == "include") {
+        TextArgs args(p, eol);
+        args.next();
+        string fname;
+        if (args.word(fname)) includeFile(builder, fname, cache, pool);
+      } else if (cmd == "define") {
+        const char* bodyEnd = findEndDefine(next, end);
+        if (!bodyEnd and more) return p;
+        if (!bodyEnd) {
+          cerr << "define without enddefine, skipping the rest of the file\n";
+          return end;
         }
+        defineGeometry(builder, p, eol, next, bodyEnd, cache);
+        const char* endLine = lineEnd(bodyEnd, end);
+        next = endLine < end ? endLine + 1 : end;
+      } else if (cmd == "enddefine") {
+        cerr << "enddefine without define, skipping\n";
+      } else {
+        parseLine(builder, p, eol);
       }
-      getline (in, str); 
+      p = next;
+      continue;
+    }
+
+    // Runs of vertex/tri lines only depend on the state at their start
+    const char* runEnd = p;
+    while (runEnd < end and isGeometryLine(runEnd, lineEnd(runEnd, end))) {
+      const char* next = lineEnd(runEnd, end);
+      runEnd = next < end ? next + 1 : end;
+    }
+    if (!cache) {
+      parseRun(builder, p, runEnd, pool);
+      scene.geometryAdded();
+      p = runEnd;
+      continue;
+    }
+
+    // With a cache, runs are looked up by their hash before being
+    // parsed, and what they produced is stored for the next scenes.
+    // The objects depend on the earlier vertices, material and transform
+    uint64_t key = vertexHash;
+    for (float* m : {builder.ambient, builder.diffuse, builder.specular, builder.emission})
+      key = GeometryCache::hash(m, 3*sizeof(float), key);
+    key = GeometryCache::hash(&builder.shininess, sizeof(builder.shininess), key);
+    key = GeometryCache::hash(&builder.transfstack.top(), sizeof(mat4), key);
+    key = GeometryCache::hash(p, runEnd - p, key);
+    vertexHash = GeometryCache::hash(p, runEnd - p, vertexHash);
+
+    auto block = cache->find(key);
+    if (block) {
+      builder.allVertices.insert(builder.allVertices.end(), block->vertices.begin(),
+                                 block->vertices.end());
+      for (auto& obj : block->objects) scene.addObjectToScene(obj);
+    } else {
+      size_t firstVertex = builder.allVertices.size();
+      size_t firstObject = scene.sceneObjects.size();
+      parseRun(builder, p, runEnd, pool);
+      block = make_shared<GeometryCache::Block>();
+      block->vertices.assign(builder.allVertices.begin() + firstVertex,
+                             builder.allVertices.end());
+      block->objects.assign(scene.sceneObjects.begin() + firstObject,
+                            scene.sceneObjects.end());
+      cache->insert(key, block);
     }
+    scene.geometryAdded();
+    p = runEnd;
+  }
+  return end;
+}
+
+// Parse a scene read from a pipe as it arrives, a block of whole lines at a time
+static void parseStream(SceneBuilder& builder, int fd, ThreadPool* pool) {
+  vector<char> buffer(2 * STREAM_BLOCK_SIZE);
+  size_t filled = 0;
+  bool ended = false, checked = false;
+  while (!ended) {
+    size_t wanted = filled + STREAM_BLOCK_SIZE;
+    while (filled < wanted) {
+      ssize_t n = ::read(fd, buffer.data() + filled, buffer.size() - filled);
+      if (n < 0 and errno == EINTR) continue;
+      if (n < 0) {
+        cerr << "Unable to Read Input Data from Standard Input\n";
+        throw 2;
+      }
+      if (n == 0) {
+        ended = true;
+        break;
+      }
+      filled += n;
+    }
+    if (!checked and filled >= 8) {
+      // Binary scenes are used in place, so they need a file to map
+      if (isBinaryScene(buffer.data(), filled)) {
+        cerr << "Binary scene files cannot be read from standard input\n";
+        throw 2;
+      }
+      checked = true;
+    }
+
+    size_t complete = filled;
+    if (!ended) {
+      const char* lastLine = (const char*) memrchr(buffer.data(), '\n', filled);
+      complete = lastLine ? lastLine + 1 - buffer.data() : 0;
+    }
+    complete = parseText(builder, buffer.data(), buffer.data() + complete, nullptr, pool, !ended)
+      - buffer.data();
+    // The start of the last line is kept, growing the buffer if it is long
+    memmove(buffer.data(), buffer.data() + complete, filled - complete);
+    filled -= complete;
+    if (buffer.size() - filled < STREAM_BLOCK_SIZE) buffer.resize(filled + 2 * STREAM_BLOCK_SIZE);
+  }
+}
 
-    scene.addCamera(eye, center, up, fovy);
-    raytracer.init(scene.width, scene.height, outputFname, maxdepth);
+void readfile(const char* filename, Scene& scene, Raytracer& raytracer,
+              GeometryCache* cache, ThreadPool* pool)
+{
+  if (string_view(filename) == "-") {
+    SceneBuilder builder(scene, raytracer);
+    parseStream(builder, STDIN_FILENO, pool);
+    builder.finish();
+    return;
+  }
+
+  // Shared with the meshes of a binary scene, which use it in place
+  auto file = make_shared<MappedFile>();
+  if (!file->open(filename)) {
+    cerr << "Unable to Open Input Data File " << filename << "\n"; 
+    throw 2; 
+  }
+  if (isBinaryScene(file->data(), file->size())) {
+    readBinaryScene(file, scene, raytracer);
+    return;
+  }
+
+  SceneBuilder builder(scene, raytracer);
+  builder.setDirectory(filename);
+  parseText(builder, file->data(), file->data() + file->size(), cache, pool);
+  builder.finish();
+}
+
+void readfile(const char* filename, SceneBuilder& builder)
+{
+  MappedFile file;
+  if (!file.open(filename)) {
+    cerr << "Unable to Open Input Data File " << filename << "\n"; 
+    throw 2; 
+  }
+  builder.setDirectory(filename);
+  parseText(builder, file.data(), file.data() + file.size(), nullptr, nullptr);
+}
+
+void readfileStream(const char* filename, Scene& scene, Raytracer& raytracer)
+{
+  string str, cmd; 
+  ifstream in;
+
+  in.open(filename); 
+  if (in.is_open()) {
+    SceneBuilder builder(scene, raytracer);
+    getline (in, str); 
+    while (in) {
+      if ((str.find_first_not_of(" \t\r\n") != string::npos) && (str[0] != '#')) {
+        // Ruled out comment and blank lines 
+
+        stringstream s(str);
+        s >> cmd; 
+        StreamArgs args(s);
+        builder.command(cmd, args);
+      }
+      getline (in, str); 
+    }
+    builder.finish();
   } else {
     cerr << "Unable to Open Input Data File " << filename << "\n"; 
     throw 2; 
   }
 }
+
+// Whether two parsers built the same scene
+static bool sameScene(Scene& a, Scene& b) {
+  bool same = a.sceneObjects.size() == b.sceneObjects.size() and
+    a.lights.size() == b.lights.size() and
+    a.width == b.width and a.height == b.height;
+  for (size_t i = 0; same and i < a.sceneObjects.size(); i++) {
+    same = a.sceneObjects[i]->getCentroid() == b.sceneObjects[i]->getCentroid();
+  }
+  return same;
+}
+
+bool benchmarkParsers(const char* filename, ThreadPool& pool)
+{
+  MappedFile file;
+  if (!file.open(filename)) {
+    cerr << "Unable to Open Input Data File " << filename << "\n"; 
+    return false;
+  }
+  double megabytes = file.size() / 1e6;
+  bool binary = isBinaryScene(file.data(), file.size());
+  file.close();
+
+  // Best of a few runs, keeping the scene of the last one to compare
+  const int runs = 3;
+  auto time = [&](auto parse, Scene& scene, const string& name) {
+    double best = 1e30;
+    for (int run = 0; run < runs; run++) {
+      scene = Scene();
+      Raytracer raytracer;
+      auto start = chrono::steady_clock::now();
+      parse(filename, scene, raytracer);
+      best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    cout << name << ": " << best * 1e3 << " ms, " << megabytes / best << " MB/s, "
+         << scene.sceneObjects.size() << " objects\n";
+    return best;
+  };
+
+  Scene streamScene, mappedScene, parallelScene;
+  try {
+    // Binary scenes have a single loader, just time it
+    if (binary) {
+      time([](const char* f, Scene& s, Raytracer& r) {readfile(f, s, r);},
+           mappedScene, "binary scene");
+      return true;
+    }
+    double streamTime = time(readfileStream, streamScene, "stringstream parser");
+    double mappedTime = time([](const char* f, Scene& s, Raytracer& r) {readfile(f, s, r);},
+                             mappedScene, "mmap parser");
+    double parallelTime = time([&](const char* f, Scene& s, Raytracer& r) {
+                                 readfile(f, s, r, nullptr, &pool);
+                               },
+                               parallelScene,
+                               "mmap parser, " + to_string(pool.size()) + " threads");
+    cout << "Speedup: " << streamTime / mappedTime << "x, "
+         << streamTime / parallelTime << "x with threads\n";
+  } catch (int) {
+    return false;
+  }
+
+  bool same = sameScene(streamScene, mappedScene) and sameScene(streamScene, parallelScene);
+  if (!same) cerr << "The parsers built different scenes\n";
+  return same;
+}
@@ -1,7 +1,142 @@
 // Readfile definitions
+#ifndef READFILE_H_
+#define READFILE_H_
+
+#include <string_view>
+#include <stack>
+#include <sstream>
+#include <map>
 #include "Scene.h"
 #include "Raytracer.h"
+#include "GeometryCache.h"
+#include "ThreadPool.h"
+#include "Mesh.h"
+
+using std::stack, std::stringstream, std::map;
+
+/**
+ * State of a scene file being read: the current material, transform
+ * stack and vertices, and the settings given to the raytracer at the end.
+ * Parsers split the file into commands and hand them over one at a time,
+ * so every parser accepts exactly the same commands.
+ *
+ */
+class SceneBuilder {
+  public:
+        SceneBuilder(Scene& scene, Raytracer& raytracer);
+        virtual ~SceneBuilder() {}
+        /**
+        * Run a command
+        *
+        * @param cmd - Name of the command
+        * @param args - Parser positioned after the name, giving the
+        *               values with readvals(n, values) and words with word()
+        */
+        template <class Args> void command(std::string_view cmd, Args& args);
+        /**
+        * Add a triangle with the current material and transform
+        *
+        * @param indices - Indices of its three vertices, as read
+        */
+        virtual void addTriangle(const float* indices);
+        /**
+        * Add a sphere with the current material and transform
+        *
+        * @param values - Center and radius
+        */
+        virtual void addSphere(const float* values);
+        /**
+        * Add a light with the current attenuation
+        *
+        * @param point - Point light, or else directional
+        * @param values - Position/direction and color
+        */
+        virtual void addLight(bool point, float* values);
+        /**
+        * Add a mesh with the current material and transform
+        *
+        * @param mesh - Mesh read from a mesh file
+        */
+        virtual void addMesh(shared_ptr<Mesh> mesh);
+        /**
+        * Set up the camera and raytracer once every command is read
+        *
+        */
+        void finish();
+        /**
+        * Resolve relative mesh file names against the directory of a scene file
+        *
+        * @param filename - Name of the scene file
+        */
+        void setDirectory(const string& filename);
+
+        Scene& scene;
+        Raytracer& raytracer;
+        string outputFname = "output.png";
+        int maxdepth = 5;
+        int samplesPerPixel = 1;
+        PixelFilter filter = PIXEL_FILTER_BOX;
+        float filterRadius = 0; // Default of the filter
+        int adaptiveSamples = 0; // Uniform sampling
+        float adaptiveContrast = 0; // Default contrast
+        float convergeError = 0.01;
+        int convergeSamples = 0; // Fixed spp
+        Integrator integrator = INTEGRATOR_WHITTED;
+        vec3 eye, up, center; // Positions of eye, center, up vectors
+        int w, h; // Image size
+        float fovy; // FOV of image
+        vector <vec3> allVertices;
+        vec3 lightAttenuation = vec3(1.,0.,0.);
+        // Material properties
+        float ambient[3] = {0, 0, 0};
+        float diffuse[3] = {0, 0, 0};
+        float specular[3] = {0, 0, 0};
+        float emission[3] = {0, 0, 0};
+        float shininess = 1;
+        stack <mat4> transfstack;
+        string directory; // Of the scene file, for the files it names
+        // Geometry of define blocks by name, for use commands
+        map<string, shared_ptr<Mesh>> definitions;
+        // Geometry of define blocks by hash of their text, parsed once
+        map<uint64_t, shared_ptr<Mesh>> definedMeshes;
+        // Hash of every run of vertex/tri lines so far, for the geometry cache
+        uint64_t vertexHash = GeometryCache::hash(nullptr, 0);
+        int includeDepth = 0; // Of the file being parsed
+};
 
 void rightmultiply (const mat4 & M, stack<mat4> &transfstack) ;
 bool readvals (stringstream &s, const int numvals, float * values) ;
-void readfile (const char * filename, Scene& scene, Raytracer& raytracer) ;
+/**
+ * Read a scene file. The file is memory mapped and parsed in place,
+ * binary scene files (see BinaryScene.h) are used in place.
+ * A filename of - reads a text scene from standard input, parsing
+ * blocks of lines as they arrive.
+ * Throws 2 if the file cannot be opened or is invalid.
+ *
+ * @param cache - Geometry shared with earlier scenes, may be nullptr
+ * @param pool - Threads parsing long runs of vertex/tri lines, may be nullptr
+ */
+void readfile (const char * filename, Scene& scene, Raytracer& raytracer,
+               GeometryCache* cache = nullptr, ThreadPool* pool = nullptr) ;
+/**
+ * Read the commands of a text scene file into a builder, without
+ * finishing it. Used to convert scenes to other formats.
+ * Throws 2 if the file cannot be opened.
+ *
+ */
+void readfile (const char * filename, SceneBuilder& builder) ;
+/**
+ * Read a scene file line by line through a stringstream.
+ * The original parser, kept to compare against.
+ *
+ */
+void readfileStream (const char * filename, Scene& scene, Raytracer& raytracer) ;
+/**
+ * Time the parsers on a scene file and check they build the same scene
+ *
+ * @param pool - Threads for the parallel parse
+ * @return false if the file cannot be read or the parsers disagree
+ */
+bool benchmarkParsers (const char * filename, ThreadPool& pool) ;
+
+#endif // READFILE_H_
@@ -0,0 +1,20 @@
+#!/bin/bash
+# Renders the 32768x32768 demo/giga.test with --bounded-memory under a
+# 512 MB address space limit, 4% of its 12.9 GB framebuffer, and checks
+# the PNG holds every row. Takes a few minutes per core used.
+cd "$(dirname "$0")"
+out=$(mktemp -d)
+trap 'rm -rf $out' EXIT
+
+# Few malloc arenas and threads, each reserving address space of its own,
+# so the limit measures the image held rather than the machine
+export MALLOC_ARENA_MAX=2
+start=$(date +%s)
+if ! (ulimit -v 524288 && ../nanoraytracer --bounded-memory --png fast --threads 4 \
+        --output $out/giga.png ../demo/giga.test > /dev/null); then
+  echo "FAIL: render did not complete within 512 MB"
+  exit 1
+fi
+# Every chunk intact and every row in the image data, up to IEND
+./png-rows $out/giga.png 32768 32768 || exit 1
+echo "PASS: 32768x32768 PNG rendered within 512 MB in $(( $(date +%s) - start )) s"
@@ -0,0 +1,117 @@
+// Checks that a PNG written by PngWriter is complete: every chunk has a
+// valid CRC, the IDAT chunks inflate to one filtered row per line of the
+// image, and the file ends with IEND. The image is inflated a piece at a
+// time, so the largest renders can be checked.
+
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <zlib.h>
+
+using namespace std;
+
+static uint32_t bigEndian(const uint8_t* p) {
+  return (uint32_t) p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static bool fail(const string& reason) {
+  cout << "FAIL: " << reason << "\n";
+  return false;
+}
+
+static bool checkPng(const char* fname, uint32_t width, uint32_t height) {
+  FILE* file = fopen(fname, "rb");
+  if (!file) return fail(string("cannot open ") + fname);
+  uint8_t signature[8];
+  if (fread(signature, 1, 8, file) != 8 or memcmp(signature, "\x89PNG\r\n\x1a\n", 8) != 0) {
+    fclose(file);
+    return fail("not a PNG");
+  }
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  inflateInit(&stream);
+  // One filter byte then 3 bytes per pixel on every row
+  uint64_t stride = 1 + 3 * (uint64_t) width, inflated = 0;
+  vector<uint8_t> data, out(1 << 20);
+  bool ok = true, streamEnd = false, sawHeader = false, sawEnd = false;
+  while (ok and !sawEnd) {
+    uint8_t header[8];
+    if (fread(header, 1, 8, file) != 8) {
+      ok = fail("missing IEND");
+      break;
+    }
+    uint32_t length = bigEndian(header);
+    string type((const char*) header + 4, 4);
+    if (length >= 1u << 31) {
+      ok = fail("bad length of " + type + " chunk");
+      break;
+    }
+    data.resize(length + 4);
+    if (fread(data.data(), 1, length + 4, file) != length + 4) {
+      ok = fail("truncated " + type + " chunk");
+      break;
+    }
+    uLong crc = crc32(crc32(0, header + 4, 4), data.data(), length);
+    if (crc != bigEndian(data.data() + length)) {
+      ok = fail("bad CRC in " + type + " chunk");
+      break;
+    }
+
+    if (type == "IHDR") {
+      sawHeader = true;
+      if (length < 13 or bigEndian(data.data()) != width or bigEndian(data.data() + 4) != height)
+        ok = fail("image is not " + to_string(width) + "x" + to_string(height));
+      else if (data[8] != 8 or data[9] != 2)
+        ok = fail("image is not 8-bit RGB");
+    } else if (type == "IDAT") {
+      if (!sawHeader or streamEnd) {
+        ok = fail("IDAT outside of the image data");
+        break;
+      }
+      stream.next_in = data.data();
+      stream.avail_in = length;
+      while (ok and stream.avail_in > 0 and !streamEnd) {
+        stream.next_out = out.data();
+        stream.avail_out = out.size();
+        int result = inflate(&stream, Z_NO_FLUSH);
+        if (result != Z_OK and result != Z_STREAM_END and result != Z_BUF_ERROR) {
+          ok = fail("corrupt image data");
+          break;
+        }
+        size_t produced = out.size() - stream.avail_out;
+        // Every row starts with one of the 5 filter types
+        for (uint64_t p = (stride - inflated % stride) % stride; p < produced; p += stride) {
+          if (out[p] > 4) {
+            ok = fail("bad filter type on row " + to_string((inflated + p) / stride));
+            break;
+          }
+        }
+        inflated += produced;
+        streamEnd = result == Z_STREAM_END;
+        if (result == Z_BUF_ERROR and produced == 0) break;
+      }
+    } else if (type == "IEND") {
+      sawEnd = true;
+    }
+  }
+  inflateEnd(&stream);
+  fclose(file);
+  if (!ok) return false;
+  if (!streamEnd) return fail("image data ends early");
+  if (inflated != stride * height)
+    return fail(to_string(inflated / stride) + " rows of image data, not " + to_string(height));
+  return true;
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 4) {
+    cerr << "Usage: png-rows file.png width height\n";
+    return 2;
+  }
+  return checkPng(argv[1], strtoul(argv[2], nullptr, 10), strtoul(argv[3], nullptr, 10)) ? 0 : 1;
+}
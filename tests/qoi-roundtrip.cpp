@@ -0,0 +1,125 @@
+// Writes images with QoiWriter and reads them back with a decoder
+// following the QOI specification (qoiformat.org), which must give the
+// same bytes, all opaque.
+
+#include <iostream>
+#include <vector>
+#include <cstdio>
+#include <cstdint>
+#include <random>
+#include <unistd.h>
+
+#include "../ImageWriter.h"
+
+using namespace std;
+
+// Decode a QOI file into RGBA, as the reference decoder does
+static bool decodeQoi(const vector<uint8_t>& data, int& width, int& height,
+                      vector<uint8_t>& rgba) {
+  if (data.size() < 22 or data[0] != 'q' or data[1] != 'o' or data[2] != 'i' or data[3] != 'f')
+    return false;
+  width = data[4] << 24 | data[5] << 16 | data[6] << 8 | data[7];
+  height = data[8] << 24 | data[9] << 16 | data[10] << 8 | data[11];
+  uint8_t index[64][4] = {};
+  uint8_t px[4] = {0, 0, 0, 255};
+  size_t p = 14, end = data.size() - 8;
+  int run = 0;
+  rgba.resize((size_t) width*height*4);
+  for (size_t i = 0; i < rgba.size(); i += 4) {
+    if (run > 0) {
+      run--;
+    } else if (p < end) {
+      int b1 = data[p++];
+      if (b1 == 0xfe) {
+        px[0] = data[p++]; px[1] = data[p++]; px[2] = data[p++];
+      } else if (b1 == 0xff) {
+        px[0] = data[p++]; px[1] = data[p++]; px[2] = data[p++]; px[3] = data[p++];
+      } else if ((b1 & 0xc0) == 0x00) {
+        for (int c = 0; c < 4; c++) px[c] = index[b1][c];
+      } else if ((b1 & 0xc0) == 0x40) {
+        px[0] += ((b1 >> 4) & 3) - 2;
+        px[1] += ((b1 >> 2) & 3) - 2;
+        px[2] += (b1 & 3) - 2;
+      } else if ((b1 & 0xc0) == 0x80) {
+        int b2 = data[p++];
+        int dg = (b1 & 0x3f) - 32;
+        px[0] += dg - 8 + ((b2 >> 4) & 0x0f);
+        px[1] += dg;
+        px[2] += dg - 8 + (b2 & 0x0f);
+      } else {
+        run = b1 & 0x3f;
+      }
+      int hash = (px[0]*3 + px[1]*5 + px[2]*7 + px[3]*11) % 64;
+      for (int c = 0; c < 4; c++) index[hash][c] = px[c];
+    }
+    for (int c = 0; c < 4; c++) rgba[i+c] = px[c];
+  }
+  return true;
+}
+
+// Encode the image, decode it and compare, printing the mismatches
+static bool roundTrip(const char* name, const vector<float>& rgb, int width, int height) {
+  string fname = "/tmp/qoi-roundtrip-" + to_string(getpid()) + ".qoi";
+  QoiWriter writer;
+  bool ok = writer.open(fname, width, height);
+  for (int j = 0; ok and j < height; j++) ok = writer.writeRow(&rgb[(size_t) j*width*3]);
+  ok = writer.close() and ok;
+  vector<uint8_t> data;
+  FILE* file = fopen(fname.c_str(), "rb");
+  for (int c; file and (c = fgetc(file)) != EOF;) data.push_back(c);
+  if (file) fclose(file);
+  unlink(fname.c_str());
+
+  int decodedWidth, decodedHeight;
+  vector<uint8_t> rgba, expected(rgb.size());
+  if (!ok or !decodeQoi(data, decodedWidth, decodedHeight, rgba) or
+      decodedWidth != width or decodedHeight != height) {
+    cout << "FAIL: " << name << ": not written or not decodable\n";
+    return false;
+  }
+  ImageWriter::toBytes(rgb.data(), rgb.size(), expected.data());
+  int wrongColour = 0, wrongAlpha = 0;
+  for (size_t i = 0; i < (size_t) width*height; i++) {
+    for (int c = 0; c < 3; c++)
+      if (rgba[4*i+c] != expected[3*i+c]) {
+        wrongColour++;
+        break;
+      }
+    if (rgba[4*i+3] != 255) wrongAlpha++;
+  }
+  if (wrongColour > 0 or wrongAlpha > 0) {
+    cout << "FAIL: " << name << ": " << wrongColour << " pixels of the wrong colour, "
+         << wrongAlpha << " not opaque\n";
+    return false;
+  }
+  cout << "PASS: " << name << "\n";
+  return true;
+}
+
+int main() {
+  bool ok = true;
+  // Black after other colours falls on the hash slot of (0, 0, 0, 0)
+  float c1[3] = {0.8f, 0.3f, 0.1f}, c2[3] = {0.1f, 0.9f, 0.5f};
+  vector<float> row = {0.5f, 0.5f, 0.5f, 0, 0, 0, c1[0], c1[1], c1[2],
+                       c2[0], c2[1], c2[2], 0, 0, 0, c1[0], c1[1], c1[2]};
+  ok = roundTrip("black after other colours", row, 6, 1) and ok;
+
+  // Runs over row ends and longer than 62, then a few colours repeating
+  // and small steps, for every kind of chunk
+  int width = 100, height = 80;
+  vector<float> image((size_t) width*height*3, 0);
+  minstd_rand generator(1);
+  const float palette[4][3] = {{0, 0, 0}, {1, 1, 1}, {0.2f, 0.4f, 0.6f}, {0.21f, 0.4f, 0.59f}};
+  for (int j = 2; j < height; j++) {
+    for (int i = 0; i < width; i++) {
+      float* p = &image[((size_t) j*width + i)*3];
+      if (j < height/2) {
+        for (int c = 0; c < 3; c++) p[c] = palette[generator() % 4][c];
+      } else {
+        for (int c = 0; c < 3; c++) p[c] = (generator() % 256) / 255.0f;
+      }
+    }
+  }
+  ok = roundTrip("runs, repeated and random colours", image, width, height) and ok;
+  return ok ? 0 : 1;
+}
@@ -0,0 +1,26 @@
+#!/bin/bash
+# A worker dies holding tiles once every other tile is rendered, so the
+# only live worker is idle: the coordinator must hand it the lost tiles
+# instead of waiting for it to speak. The image must match a local render.
+cd "$(dirname "$0")"
+port=$((20000 + $$ % 10000))
+out=$(mktemp -d)
+trap 'rm -rf $out; kill $(jobs -p) 2>/dev/null' EXIT
+
+../nanoraytracer --output $out/local.png worker-lost.test > /dev/null || exit 1
+timeout 30 ../nanoraytracer --listen 127.0.0.1:$port --output $out/workers.png worker-lost.test &
+coordinator=$!
+sleep 1
+# Fake worker: says it is ready, takes the first two tiles and dies 3s later
+(exec 3<>/dev/tcp/127.0.0.1/$port && printf '\x02\0\0\0\0\0\0\0' >&3 && sleep 3) &
+sleep 1
+../nanoraytracer --worker 127.0.0.1:$port &
+if ! wait $coordinator; then
+  echo "FAIL: coordinator did not finish after losing a worker"
+  exit 1
+fi
+if ! cmp -s $out/local.png $out/workers.png; then
+  echo "FAIL: image differs from a local render"
+  exit 1
+fi
+echo "PASS: tiles of a lost worker went to an idle worker"